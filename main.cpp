@@ -1,5 +1,7 @@
 #include "screen_capture.h"
 #include <signal.h>  // For signal handling (Ctrl+C)
+#include <cstdlib>   // strtoull/strtol for --window and numeric flags
+#include <sstream>   // --sweep axis parsing
 
 // Global pointer for signal handler
 ScreenCaptureEncoder* g_encoder = nullptr;
@@ -25,32 +27,420 @@ int main(int argc, char* argv[]) {
     int fps = 60;          // Default FPS
     std::wstring pipe_name = L"\\\\.\\pipe\\CloudGameCapture";  // Default pipe name
     
+    bool follow_resolution = false;  // Reopen encoder when the desktop resizes
+    CaptureTiming capture_timing = CaptureTiming::kPoll;
+    int idle_fps = 0;                // Rate governor idle rate (0 = off)
+    bool motion_hints = false;       // Send move rects ahead of video frames
+    bool pre_analysis = false;       // Scene-cut/complexity analysis before encoding
+    int temporal_layers = 1;         // 1 = off, 2 = L1T2, 3 = L1T3
+    int pace_kbps = 0;               // Pipe pacing rate (0 = off)
+    int pace_burst_kb = 64;          // Pacer bucket depth
+    uint32_t strip_nals = 0;         // NAL types removed from the bitstream (bit per type)
+    bool timing_sei = false;         // Capture-time SEI in every access unit
+    bool latency_probe = false;      // Closed-loop latency measurement (replay only)
+    EncoderTuning tuning;            // NVENC preset/tune/rc/profile/GOP
+    std::string sweep;               // Encoder sweep axes (empty = normal streaming)
+    int sweep_frames = 300;          // Frames encoded per sweep point
+    RECT region = {};                // Capture region (empty = full desktop)
+    HWND window = nullptr;           // Window to capture (nullptr = off)
+    std::vector<UINT> outputs;       // Outputs to capture (empty = primary)
+    CursorMode cursor_mode = CursorMode::kComposite;
+    ReplaySettings replay;           // File to play instead of the desktop (empty = desktop)
+    std::string record_path;         // Session recording base path (empty = off)
+    uint64_t record_limit_mb = 1024;
+    
     // Simple argument parsing
-    // Usage: program.exe [width] [height] [fps] [pipe_name]
-    if (argc > 1) {
-        width = std::stoi(argv[1]);   // Convert string to int
+    // Usage: program.exe [options] [width] [height] [fps] [pipe_name]
+    // Options:
+    //   --follow-resolution   encode at the desktop size, following mode changes
+    //   --capture-mode <m>    poll | event | vblank (default: poll); event wakes on new
+    //                         desktop frames and uses fps only as a cap, vblank ticks
+    //                         on display refreshes divided down to fps
+    //   --idle-fps <n>        drop to n fps after a second of only small changes (typing,
+    //                         caret, clocks); activity restores the full rate at once
+    //   --motion-hints        send move rects (duplication's and detected scrolls) ahead
+    //                         of each video frame (pipe flag bit3); not with --layers
+    //   --pre-analysis        measure frame complexity before encoding; scene cuts get
+    //                         the IDR (and a short bitrate boost) instead of mid-scene
+    //   --layers <n>          temporal layers, 1 (off) | 2 | 3; droppable frames carry
+    //                         their layer (pipe flags bits 4-5); adds 1 (2) or 3 (3) frames of delay
+    //   --pace-kbps <n>       pace large video frames onto the pipe at n kbps (at least
+    //                         one frame interval per frame), smoothing IDR bursts
+    //   --pace-burst-kb <n>   bytes the pacer lets through back to back (default: 64)
+    //   --strip-nals <list>   remove these NAL types from every access unit, comma
+    //                         separated: aud, filler, sei or a type number
+    //   --timing-sei          add a capture-time SEI (user_data_unregistered) to every
+    //                         access unit for end-to-end latency measurement
+    //   --region x,y,w,h      capture only this rectangle of the desktop
+    //   --window <hwnd|title> capture only this window, following it as it moves
+    //   --output <i>[,<j>...] capture these outputs; several are composited into one stream
+    //   --list-outputs        print the available outputs and exit
+    //   --bench-nal           benchmark NAL length-prefix conversion and exit
+    //   --cursor <mode>       none | composite | metadata (default: composite)
+    //                         metadata sends the pointer out-of-band for client-side drawing
+    //   --replay <file>       play a file instead of capturing the desktop
+    //   --replay-format <fmt> y4m | bgra | nv12 (default: y4m)
+    //   --replay-size WxH     frame size of raw (bgra/nv12) files
+    //   --replay-dirty <file> sidecar dirty-rect track ("<frame> [x y w h]..." per line)
+    //   --replay-unpaced      play as fast as the pipeline allows instead of at fps
+    //   --replay-once         stop at the end of the file instead of looping
+    //   --preset <p>          h264_nvenc preset p1..p7 (default: p1)
+    //   --tune <t>            ll | ull | hq | lossless (default: ll)
+    //   --rc <mode>           cbr | vbr | constqp (default: cbr)
+    //   --profile <p>         baseline | main | high (default: baseline)
+    //   --gop <n>             frames between IDRs (default: two seconds)
+    //   --sweep <axes>        encode the replay file at every combination of settings and
+    //                         print a table instead of streaming (no pipe is created and
+    //                         no client is waited for); axes are separated by
+    //                         '/', e.g. preset=p1,p4,p7/tune=ll,hq/rc=cbr,vbr/gop=60,600
+    //                         (axes not given keep the values above); with --layers the
+    //                         stream is also decoded with the top layers shed (shed_errors)
+    //   --sweep-frames <n>    frames encoded per combination (default: 300)
+    //   --latency-probe       stamp a frame counter into replayed frames and decode the
+    //                         pipe output in-process to measure capture-to-decoded
+    //                         latency and dropped/duplicated frames (stats probe_*)
+    //   --record <base>       record frames (<base>.scd, replayable with --replay), the
+    //                         bitstream (<base>.h264) and its timing (<base>.timing.txt)
+    //   --record-limit-mb <n> stop recording after n MB (default: 1024)
+    // --region/--window encode at the region size (they imply --follow-resolution)
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--follow-resolution") {
+            follow_resolution = true;
+        } else if (arg == "--capture-mode" && i + 1 < argc) {
+            std::string mode(argv[++i]);
+            if (mode == "poll") {
+                capture_timing = CaptureTiming::kPoll;
+            } else if (mode == "event") {
+                capture_timing = CaptureTiming::kEvent;
+            } else if (mode == "vblank") {
+                capture_timing = CaptureTiming::kVblank;
+            } else {
+                std::cerr << "Invalid --capture-mode, expected poll, event or vblank" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--idle-fps" && i + 1 < argc) {
+            idle_fps = std::stoi(argv[++i]);
+            if (idle_fps < 0) {
+                std::cerr << "Invalid --idle-fps, expected 0 or more" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--motion-hints") {
+            motion_hints = true;
+        } else if (arg == "--pre-analysis") {
+            pre_analysis = true;
+        } else if (arg == "--layers" && i + 1 < argc) {
+            temporal_layers = std::stoi(argv[++i]);
+            if (temporal_layers < 1 || temporal_layers > 3) {
+                std::cerr << "Invalid --layers, expected 1, 2 or 3" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--pace-kbps" && i + 1 < argc) {
+            char* end = nullptr;
+            long value = std::strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || end == argv[i] || value < 0 || value > 10000000) {
+                std::cerr << "Invalid --pace-kbps, expected 0 (off) or a rate in kbps" << std::endl;
+                return 1;
+            }
+            pace_kbps = static_cast<int>(value);
+        } else if (arg == "--pace-burst-kb" && i + 1 < argc) {
+            char* end = nullptr;
+            long value = std::strtol(argv[++i], &end, 10);
+            if (!end || *end != '\0' || end == argv[i] || value < 1 || value > 1024 * 1024) {
+                std::cerr << "Invalid --pace-burst-kb, expected a size of 1 KB or more" << std::endl;
+                return 1;
+            }
+            pace_burst_kb = static_cast<int>(value);
+        } else if (arg == "--strip-nals" && i + 1 < argc) {
+            std::string list(argv[++i]);
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                std::string item = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                if (item == "aud") {
+                    strip_nals |= 1u << 9;
+                } else if (item == "filler") {
+                    strip_nals |= 1u << 12;
+                } else if (item == "sei") {
+                    strip_nals |= 1u << 6;
+                } else if (!item.empty() && item.size() <= 2 && item.find_first_not_of("0123456789") == std::string::npos &&
+                           std::stoi(item) < 32) {
+                    strip_nals |= 1u << std::stoi(item);
+                } else {
+                    std::cerr << "Invalid --strip-nals item '" << item << "', expected aud, filler, sei or 0-31" << std::endl;
+                    return 1;
+                }
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+        } else if (arg == "--timing-sei") {
+            timing_sei = true;
+        } else if (arg == "--region" && i + 1 < argc) {
+            int x = 0, y = 0, w = 0, h = 0;
+            if (sscanf_s(argv[++i], "%d,%d,%d,%d", &x, &y, &w, &h) != 4 || w <= 0 || h <= 0) {
+                std::cerr << "Invalid --region, expected x,y,w,h" << std::endl;
+                return 1;
+            }
+            region = { x, y, x + w, y + h };
+            follow_resolution = true;
+        } else if (arg == "--cursor" && i + 1 < argc) {
+            std::string mode(argv[++i]);
+            if (mode == "none") {
+                cursor_mode = CursorMode::kNone;
+            } else if (mode == "composite") {
+                cursor_mode = CursorMode::kComposite;
+            } else if (mode == "metadata") {
+                cursor_mode = CursorMode::kMetadata;
+            } else {
+                std::cerr << "Invalid --cursor, expected none, composite or metadata" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--replay" && i + 1 < argc) {
+            std::string path(argv[++i]);
+            replay.path = std::wstring(path.begin(), path.end());
+        } else if (arg == "--replay-format" && i + 1 < argc) {
+            std::string format(argv[++i]);
+            if (format == "y4m") {
+                replay.format = ReplayFormat::kY4m;
+            } else if (format == "bgra") {
+                replay.format = ReplayFormat::kBgra;
+            } else if (format == "nv12") {
+                replay.format = ReplayFormat::kNv12;
+            } else {
+                std::cerr << "Invalid --replay-format, expected y4m, bgra or nv12" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--replay-size" && i + 1 < argc) {
+            if (sscanf_s(argv[++i], "%dx%d", &replay.width, &replay.height) != 2 ||
+                replay.width <= 0 || replay.height <= 0) {
+                std::cerr << "Invalid --replay-size, expected WxH" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--replay-dirty" && i + 1 < argc) {
+            std::string path(argv[++i]);
+            replay.dirty_rects_path = std::wstring(path.begin(), path.end());
+        } else if (arg == "--replay-unpaced") {
+            replay.unpaced = true;
+        } else if (arg == "--replay-once") {
+            replay.loop = false;
+        } else if (arg == "--latency-probe") {
+            latency_probe = true;
+        } else if (arg == "--preset" && i + 1 < argc) {
+            tuning.preset = argv[++i];
+        } else if (arg == "--tune" && i + 1 < argc) {
+            tuning.tune = argv[++i];
+        } else if (arg == "--rc" && i + 1 < argc) {
+            tuning.rc = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            tuning.profile = argv[++i];
+        } else if (arg == "--gop" && i + 1 < argc) {
+            tuning.gop = std::stoi(argv[++i]);
+        } else if (arg == "--sweep" && i + 1 < argc) {
+            sweep = argv[++i];
+        } else if (arg == "--sweep-frames" && i + 1 < argc) {
+            sweep_frames = std::stoi(argv[++i]);
+        } else if (arg == "--record" && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (arg == "--record-limit-mb" && i + 1 < argc) {
+            // The limit is shifted into bytes, so it must fit in 64 bits as a byte count
+            char* end = nullptr;
+            unsigned long long value = std::strtoull(argv[++i], &end, 10);
+            if (!end || *end != '\0' || end == argv[i] || argv[i][0] == '-' ||
+                value < 1 || value > (UINT64_MAX >> 20)) {
+                std::cerr << "Invalid --record-limit-mb, expected a size in MB" << std::endl;
+                return 1;
+            }
+            record_limit_mb = value;
+        } else if (arg == "--list-outputs") {
+            ScreenCaptureEncoder::ListOutputs();
+            return 0;
+        } else if (arg == "--bench-nal") {
+            ScreenCaptureEncoder::BenchmarkNalRewrite();
+            return 0;
+        } else if (arg == "--output" && i + 1 < argc) {
+            std::string list(argv[++i]);
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                std::string item = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                if (!item.empty()) {
+                    outputs.push_back(static_cast<UINT>(std::stoul(item)));
+                }
+                if (comma == std::string::npos) break;
+                start = comma + 1;
+            }
+        } else if (arg == "--window" && i + 1 < argc) {
+            std::string target(argv[++i]);
+            char* end = nullptr;
+            unsigned long long handle = std::strtoull(target.c_str(), &end, 0);
+            if (end && *end == '\0' && handle != 0) {
+                window = reinterpret_cast<HWND>(static_cast<uintptr_t>(handle));
+            } else {
+                window = FindWindowA(nullptr, target.c_str());  // Match by title
+            }
+            if (!window || !IsWindow(window)) {
+                std::cerr << "Window not found: " << target << std::endl;
+                return 1;
+            }
+            follow_resolution = true;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    
+    if (positional.size() > 0) {
+        width = std::stoi(positional[0]);   // Convert string to int
     }
-    if (argc > 2) {
-        height = std::stoi(argv[2]);
+    if (positional.size() > 1) {
+        height = std::stoi(positional[1]);
     }
-    if (argc > 3) {
-        fps = std::stoi(argv[3]);
+    if (positional.size() > 2) {
+        fps = std::stoi(positional[2]);
     }
-    if (argc > 4) {
+    if (positional.size() > 3) {
         // Convert narrow string to wide string
-        std::string narrow_pipe(argv[4]);
+        const std::string& narrow_pipe = positional[3];
         pipe_name = std::wstring(narrow_pipe.begin(), narrow_pipe.end());
     }
     
+    // Cross product of the sweep axes, starting from the configured tuning
+    std::vector<EncoderTuning> sweep_points;
+    if (!sweep.empty()) {
+        sweep_points.push_back(tuning);
+        size_t start = 0;
+        while (start <= sweep.size()) {
+            size_t slash = sweep.find('/', start);
+            std::string axis = sweep.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+            size_t equals = axis.find('=');
+            std::string key = axis.substr(0, equals);
+            if (equals == std::string::npos ||
+                (key != "preset" && key != "tune" && key != "rc" && key != "profile" && key != "gop")) {
+                std::cerr << "Invalid --sweep axis '" << axis << "', expected preset|tune|rc|profile|gop=v1,v2,..." << std::endl;
+                return 1;
+            }
+            
+            std::vector<EncoderTuning> expanded;
+            std::istringstream values(axis.substr(equals + 1));
+            std::string value;
+            while (std::getline(values, value, ',')) {
+                if (value.empty()) {
+                    continue;
+                }
+                for (EncoderTuning point : sweep_points) {
+                    if (key == "preset") point.preset = value;
+                    else if (key == "tune") point.tune = value;
+                    else if (key == "rc") point.rc = value;
+                    else if (key == "profile") point.profile = value;
+                    else point.gop = std::stoi(value);
+                    expanded.push_back(point);
+                }
+            }
+            if (!expanded.empty()) {
+                sweep_points.swap(expanded);
+            }
+            if (slash == std::string::npos) break;
+            start = slash + 1;
+        }
+        if (replay.path.empty() || sweep_frames <= 0) {
+            std::cerr << "--sweep needs --replay and a positive --sweep-frames" << std::endl;
+            return 1;
+        }
+    }
+    
     std::cout << "Configuration:" << std::endl;
     std::cout << "  Resolution: " << width << "x" << height << std::endl;
     std::cout << "  FPS: " << fps << std::endl;
     std::wcout << L"  Pipe Name: " << pipe_name << std::endl;
+    std::wcout << L"  Control Pipe: " << pipe_name << L"_control" << std::endl;
+    static const char* kTimingNames[] = { "poll", "event-driven (fps cap)", "vblank-aligned" };
+    std::cout << "  Capture mode: " << kTimingNames[static_cast<int>(capture_timing)] << std::endl;
+    if (idle_fps > 0) {
+        std::cout << "  Idle rate: " << idle_fps << " fps" << std::endl;
+    }
+    if (motion_hints) {
+        std::cout << "  Motion hints: " << (temporal_layers > 1 ? "off (not with temporal layers)" : "on") << std::endl;
+    }
+    if (pre_analysis) {
+        std::cout << "  Pre-analysis: on" << std::endl;
+    }
+    if (temporal_layers > 1) {
+        std::cout << "  Temporal layers: L1T" << temporal_layers << std::endl;
+    }
+    if (pace_kbps > 0) {
+        std::cout << "  Pacing: " << pace_kbps << " kbps, burst " << pace_burst_kb << " KB" << std::endl;
+    }
+    if (strip_nals != 0) {
+        std::cout << "  Stripped NAL types:";
+        for (int type = 0; type < 32; ++type) {
+            if (strip_nals & (1u << type)) {
+                std::cout << " " << type;
+            }
+        }
+        std::cout << std::endl;
+    }
+    if (timing_sei) {
+        std::cout << "  Timing SEI: on" << std::endl;
+    }
+    std::cout << "  Resize policy: " << (follow_resolution ? "follow desktop" : "scale to fixed size") << std::endl;
+    if (!outputs.empty()) {
+        std::cout << "  Outputs:";
+        for (UINT output : outputs) {
+            std::cout << " " << output;
+        }
+        std::cout << (outputs.size() > 1 ? " (composited)" : "") << std::endl;
+    }
+    if (!replay.path.empty()) {
+        std::wcout << L"  Replay: " << replay.path
+                   << (replay.unpaced ? L" (unpaced" : L" (at fps")
+                   << (replay.loop ? L", looping)" : L", once)") << std::endl;
+    }
+    std::cout << "  Encoder: " << tuning.preset << " / " << tuning.tune << " / " << tuning.rc
+              << " / " << tuning.profile;
+    if (tuning.gop > 0) {
+        std::cout << ", IDR every " << tuning.gop << " frames";
+    }
+    std::cout << std::endl;
+    if (!sweep_points.empty()) {
+        std::cout << "  Sweep: " << sweep_points.size() << " combinations x " << sweep_frames << " frames" << std::endl;
+    }
+    if (latency_probe) {
+        std::cout << "  Latency probe: on" << std::endl;
+    }
+    if (!record_path.empty()) {
+        std::cout << "  Recording: " << record_path << ".* (limit " << record_limit_mb << " MB)" << std::endl;
+    }
+    if (window) {
+        std::cout << "  Capture window: 0x" << std::hex << reinterpret_cast<uintptr_t>(window) << std::dec << std::endl;
+    } else if (region.right > region.left) {
+        std::cout << "  Capture region: " << region.left << "," << region.top << " "
+                  << (region.right - region.left) << "x" << (region.bottom - region.top) << std::endl;
+    }
     std::cout << std::endl;
     
     // Create encoder instance
     ScreenCaptureEncoder encoder;
     g_encoder = &encoder;  // Set global pointer for signal handler
+    encoder.SetFollowSourceResolution(follow_resolution);
+    encoder.SetCaptureTiming(capture_timing);
+    encoder.SetIdleFrameRate(idle_fps);
+    encoder.SetMotionHints(motion_hints);
+    encoder.SetPreAnalysis(pre_analysis);
+    encoder.SetTemporalLayers(temporal_layers);
+    encoder.SetPacing(pace_kbps, pace_burst_kb);
+    encoder.SetNalFilter(strip_nals);
+    encoder.SetTimingSei(timing_sei);
+    encoder.SetOutputs(outputs);
+    encoder.SetCursorMode(cursor_mode);
+    encoder.SetCaptureRegion(region);
+    encoder.SetCaptureWindow(window);
+    encoder.SetReplaySource(replay);
+    encoder.SetLatencyProbe(latency_probe);
+    encoder.SetSweepMode(!sweep_points.empty());
+    encoder.SetEncoderTuning(tuning);
+    if (!record_path.empty()) {
+        encoder.StartRecording(std::wstring(record_path.begin(), record_path.end()), record_limit_mb << 20);
+    }
     
     // Register signal handler for Ctrl+C
     signal(SIGINT, SignalHandler);   // Ctrl+C
@@ -70,6 +460,14 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    // Sweep mode encodes the replay file offline and exits
+    if (!sweep_points.empty()) {
+        std::cout << std::endl;
+        bool swept = encoder.RunEncoderSweep(sweep_points, sweep_frames);
+        encoder.Stop();  // Flushes a --record session and releases the device, MF and COM
+        return swept ? 0 : 1;
+    }
+    
     std::cout << std::endl;
     std::cout << "Starting capture..." << std::endl;
     
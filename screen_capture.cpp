@@ -1,6 +1,18 @@
 #include "screen_capture.h"
 #include <wmcodecdsp.h> // CLSID_CMSH264EncoderMFT (fallback if needed)
 #include <errno.h>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <fstream>
+#include <deque>
+#include <condition_variable>
+#include <cmath>
+#include <iomanip>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>       // SSE2 (frame pre-analysis)
+#endif
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -12,6 +24,297 @@ extern "C" {
 }
 
 namespace {
+// Largest rectangle with the source aspect ratio centered in dst (even-aligned for NV12)
+RECT ComputeLetterboxRect(int src_width, int src_height, int dst_width, int dst_height) {
+    RECT rect = { 0, 0, dst_width, dst_height };
+    if (src_width <= 0 || src_height <= 0) {
+        return rect;
+    }
+
+    int64_t scaled_width = static_cast<int64_t>(dst_height) * src_width / src_height;
+    if (scaled_width <= dst_width) {
+        int width = static_cast<int>(scaled_width) & ~1;
+        rect.left = ((dst_width - width) / 2) & ~1;
+        rect.right = rect.left + width;
+    } else {
+        int height = static_cast<int>(static_cast<int64_t>(dst_width) * src_height / src_width) & ~1;
+        rect.top = ((dst_height - height) / 2) & ~1;
+        rect.bottom = rect.top + height;
+    }
+    return rect;
+}
+
+// Capture region coordinates -> encoded picture coordinates, for a frame of
+// src size scaled and letterboxed into dst size the way the converter draws it
+struct PictureMapping {
+    PictureMapping(int src_width, int src_height, int dst_width, int dst_height)
+        : dst(ComputeLetterboxRect(src_width, src_height, dst_width, dst_height))
+        , src_width((std::max)(src_width, 1))
+        , src_height((std::max)(src_height, 1)) {
+    }
+    
+    int32_t MapX(int64_t x) const {
+        return static_cast<int32_t>(dst.left + x * (dst.right - dst.left) / src_width);
+    }
+    int32_t MapY(int64_t y) const {
+        return static_cast<int32_t>(dst.top + y * (dst.bottom - dst.top) / src_height);
+    }
+    
+    RECT dst;
+    int src_width;
+    int src_height;
+};
+
+// Capture region clamped to the source; an empty or invalid region means the whole source
+RECT ClampRegion(const RECT& region, int width, int height) {
+    RECT full = { 0, 0, width, height };
+    if (region.right <= region.left || region.bottom <= region.top) {
+        return full;
+    }
+
+    // Even origin and size so the NV12 chroma planes line up
+    RECT clamped;
+    clamped.left = (std::max)(0L, (std::min)(region.left, static_cast<LONG>(width))) & ~1L;
+    clamped.top = (std::max)(0L, (std::min)(region.top, static_cast<LONG>(height))) & ~1L;
+    clamped.right = (std::max)(clamped.left, (std::min)(region.right, static_cast<LONG>(width)));
+    clamped.bottom = (std::max)(clamped.top, (std::min)(region.bottom, static_cast<LONG>(height)));
+    clamped.right = clamped.left + ((clamped.right - clamped.left) & ~1L);
+    clamped.bottom = clamped.top + ((clamped.bottom - clamped.top) & ~1L);
+    if (clamped.right - clamped.left < 16 || clamped.bottom - clamped.top < 16) {
+        return full;
+    }
+    return clamped;
+}
+
+// Find output `index` counting across all adapters in DXGI enumeration order.
+// Caller releases both interfaces.
+bool FindOutput(UINT index, IDXGIAdapter1** out_adapter, IDXGIOutput** out_output) {
+    IDXGIFactory1* factory = nullptr;
+    if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), reinterpret_cast<void**>(&factory)))) {
+        return false;
+    }
+
+    bool found = false;
+    UINT global_index = 0;
+    IDXGIAdapter1* adapter = nullptr;
+    for (UINT a = 0; !found && factory->EnumAdapters1(a, &adapter) != DXGI_ERROR_NOT_FOUND; ++a) {
+        IDXGIOutput* output = nullptr;
+        for (UINT o = 0; adapter->EnumOutputs(o, &output) != DXGI_ERROR_NOT_FOUND; ++o) {
+            if (global_index++ == index) {
+                adapter->AddRef();
+                *out_adapter = adapter;
+                *out_output = output;
+                found = true;
+                break;
+            }
+            output->Release();
+        }
+        adapter->Release();
+    }
+
+    factory->Release();
+    return found;
+}
+
+void AppendLE(std::vector<uint8_t>& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+uint64_t ReadLE(const uint8_t* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t ReadBE(const uint8_t* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+// Sum of absolute differences of two byte runs (SSE2 PSADBW, 16 bytes a step)
+uint64_t SumAbsDiff(const uint8_t* a, const uint8_t* b, int count) {
+    uint64_t sum = 0;
+    int i = 0;
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    alignas(16) uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < count; ++i) {
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+    }
+    return sum;
+}
+
+// Sum of each 8-byte group of a row (PSADBW against zero), for 8x8 box downsampling
+void SumGroupsOf8(const uint8_t* row, int groups, uint32_t* sums) {
+    int g = 0;
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; g + 2 <= groups; g += 2) {
+        __m128i sad = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + g * 8)), zero);
+        sums[g] += static_cast<uint32_t>(_mm_cvtsi128_si32(sad));
+        sums[g + 1] += static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(sad, 8)));
+    }
+#endif
+    for (; g < groups; ++g) {
+        for (int i = 0; i < 8; ++i) {
+            sums[g] += row[g * 8 + i];
+        }
+    }
+}
+
+// Sum of squared differences of two byte runs (SSE2: widen to 16 bits, PMADDWD)
+uint64_t SumSquaredDiff(const uint8_t* a, const uint8_t* b, int count) {
+    uint64_t sum = 0;
+    int i = 0;
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= count) {
+        // 32-bit lanes gain at most 4 * 255^2 per step; flush well before they overflow
+        __m128i acc = _mm_setzero_si128();
+        for (int steps = 0; steps < 1024 && i + 16 <= count; ++steps, i += 16) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        alignas(16) uint32_t lanes[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+        sum += static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; i < count; ++i) {
+        int diff = a[i] - b[i];
+        sum += static_cast<uint64_t>(diff * diff);
+    }
+    return sum;
+}
+
+// Mean SSIM of two luma planes over 8x8 windows stepped by 4 (the usual
+// fast approximation of the Gaussian-windowed original). Window moments are
+// gathered with SSE2: PSADBW for the sums, PMADDWD for the products.
+double LumaSsim(const uint8_t* a, int stride_a, const uint8_t* b, int stride_b, int width, int height) {
+    const double c1 = (0.01 * 255) * (0.01 * 255) * 64 * 64;
+    const double c2 = (0.03 * 255) * (0.03 * 255) * 64 * 64;
+    double total = 0.0;
+    int windows = 0;
+    for (int y = 0; y + 8 <= height; y += 4) {
+        for (int x = 0; x + 8 <= width; x += 4) {
+            uint32_t sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_ab = 0;
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+            const __m128i zero = _mm_setzero_si128();
+            __m128i sums = _mm_setzero_si128();
+            __m128i aa = _mm_setzero_si128(), bb = _mm_setzero_si128(), ab = _mm_setzero_si128();
+            for (int row = 0; row < 8; ++row) {
+                __m128i va = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + (y + row) * stride_a + x));
+                __m128i vb = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + (y + row) * stride_b + x));
+                sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_unpacklo_epi64(va, vb), zero));
+                __m128i wa = _mm_unpacklo_epi8(va, zero);
+                __m128i wb = _mm_unpacklo_epi8(vb, zero);
+                aa = _mm_add_epi32(aa, _mm_madd_epi16(wa, wa));
+                bb = _mm_add_epi32(bb, _mm_madd_epi16(wb, wb));
+                ab = _mm_add_epi32(ab, _mm_madd_epi16(wa, wb));
+            }
+            alignas(16) uint32_t lanes[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sums);
+            sum_a = lanes[0];
+            sum_b = lanes[2];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), aa);
+            sum_aa = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), bb);
+            sum_bb = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            _mm_store_si128(reinterpret_cast<__m128i*>(lanes), ab);
+            sum_ab = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#else
+            for (int row = 0; row < 8; ++row) {
+                for (int col = 0; col < 8; ++col) {
+                    uint32_t pa = a[(y + row) * stride_a + x + col];
+                    uint32_t pb = b[(y + row) * stride_b + x + col];
+                    sum_a += pa;
+                    sum_b += pb;
+                    sum_aa += pa * pa;
+                    sum_bb += pb * pb;
+                    sum_ab += pa * pb;
+                }
+            }
+#endif
+            // SSIM from the raw window moments, everything scaled by n^2 (n = 64)
+            double sa = sum_a, sb = sum_b;
+            double variance_terms = 64.0 * (static_cast<double>(sum_aa) + sum_bb) - sa * sa - sb * sb;
+            double covariance_term = 64.0 * sum_ab - sa * sb;
+            total += ((2.0 * sa * sb + c1) * (2.0 * covariance_term + c2)) /
+                     ((sa * sa + sb * sb + c1) * (variance_terms + c2));
+            windows++;
+        }
+    }
+    return windows ? total / windows : 1.0;
+}
+
+// User plus kernel time of the whole process (NVENC submits from driver threads)
+uint64_t ProcessCpuTimeUs() {
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+        return 0;
+    }
+    ULARGE_INTEGER k = { { kernel.dwLowDateTime, kernel.dwHighDateTime } };
+    ULARGE_INTEGER u = { { user.dwLowDateTime, user.dwHighDateTime } };
+    return (k.QuadPart + u.QuadPart) / 10;  // 100 ns units
+}
+
+// Join a thread that blocks in ConnectNamedPipe/ReadFile/WriteFile on pipe_name.
+// CancelSynchronousIo only cancels a call already in progress, so a thread
+// still between its running_ check and the call would block afterwards:
+// keep cancelling until it exits, and connect a throwaway client so a
+// listening ConnectNamedPipe returns on its own.
+void JoinPipeThread(std::thread& thread, const std::wstring& pipe_name) {
+    HANDLE handle = thread.native_handle();
+    while (WaitForSingleObject(handle, 10) == WAIT_TIMEOUT) {
+        CancelSynchronousIo(handle);
+        HANDLE client = CreateFileW(pipe_name.c_str(), GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (client != INVALID_HANDLE_VALUE) {
+            CloseHandle(client);  // The thread sees running_ cleared once connected
+        }
+    }
+    thread.join();
+}
+
+// Frames in flight between capture and encode: one being encoded, one in the
+// mailbox, one being copied by the capture thread, and the last encoded frame
+// held for a joining client. With four slots the capture thread always finds
+// a free one.
+const int kFrameRingSize = 4;
+
+// Pipe backlog (queued messages) per temporal layer shed: at this depth the
+// top layer is dropped, at twice it the next one too
+const size_t kShedBacklog = 4;
+
+// Cursor shapes remembered as already sent (most recently used kept); an
+// evicted shape is simply sent again when it comes back
+const size_t kCursorShapeCache = 32;
+
+// Pacer write unit; video frames up to this size bypass pacing
+const size_t kPaceChunkBytes = 16 * 1024;
+
+// Frame dump written by CaptureRecorder and played by ReplaySource:
+// [8: magic] [4: width] [4: height], then one record per captured frame
+// (see CaptureRecorder::CollectSlot). Pixels are BGRA.
+const char kDumpMagic[8] = "SCDUMP1";
+
 void AppendStartCode(std::vector<uint8_t>& out) {
     out.push_back(0x00);
     out.push_back(0x00);
@@ -19,10 +322,19 @@ void AppendStartCode(std::vector<uint8_t>& out) {
     out.push_back(0x01);
 }
 
-bool ConvertAvccToAnnexB(const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+// avcC decoder configuration record -> Annex B parameter sets. The record
+// also fixes the size of the NAL length prefixes in the packets that follow
+// (lengthSizeMinusOne + 1), returned in length_size.
+bool ConvertAvccToAnnexB(const uint8_t* data, size_t len, std::vector<uint8_t>& out, int* length_size) {
     if (len < 7) {
         return false;
     }
+    if (length_size) {
+        *length_size = (data[4] & 0x03) + 1;
+        if (*length_size == 3) {
+            return false;  // Reserved value
+        }
+    }
 
     size_t offset = 5;  // Skip configuration version + profile/compat/level + lengthSizeMinusOne
     uint8_t num_sps = data[offset++] & 0x1F;
@@ -51,14 +363,73 @@ bool ConvertAvccToAnnexB(const uint8_t* data, size_t len, std::vector<uint8_t>&
     return !out.empty();
 }
 
-bool ConvertLengthPrefixedToAnnexB(const uint8_t* data, size_t len, std::vector<uint8_t>& out) {
+// Walk the length-prefixed NAL units of a packet; false unless the prefixes
+// tile the packet exactly (nothing is rewritten from a malformed packet)
+bool CountLengthPrefixedNals(const uint8_t* data, size_t len, int length_size, size_t* count) {
+    size_t offset = 0;
+    *count = 0;
+    while (offset + length_size <= len) {
+        uint32_t nal_len = static_cast<uint32_t>(ReadBE(data + offset, length_size));
+        offset += length_size;
+        if (nal_len == 0 || nal_len > len - offset) {
+            return false;
+        }
+        offset += nal_len;
+        ++*count;
+    }
+    return offset == len && *count > 0;
+}
+
+// 4-byte prefixes are exactly as long as a 4-byte start code, so the packet
+// is rewritten where it is
+bool RewriteLengthPrefixedInPlace(uint8_t* data, size_t len) {
+    size_t count = 0;
+    if (!CountLengthPrefixedNals(data, len, 4, &count)) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset < len) {
+        uint32_t nal_len = static_cast<uint32_t>(ReadBE(data + offset, 4));
+        data[offset] = 0x00;
+        data[offset + 1] = 0x00;
+        data[offset + 2] = 0x00;
+        data[offset + 3] = 0x01;
+        offset += 4 + nal_len;
+    }
+    return true;
+}
+
+// Shorter prefixes grow by 4 - length_size bytes per NAL: one exact-size allocation
+bool ConvertLengthPrefixedToAnnexB(const uint8_t* data, size_t len, int length_size, std::vector<uint8_t>& out) {
+    size_t count = 0;
+    if (!CountLengthPrefixedNals(data, len, length_size, &count)) {
+        return false;
+    }
+    out.resize(len + count * (4 - length_size));
+    uint8_t* dst = out.data();
+    size_t offset = 0;
+    while (offset < len) {
+        uint32_t nal_len = static_cast<uint32_t>(ReadBE(data + offset, length_size));
+        offset += length_size;
+        dst[0] = 0x00;
+        dst[1] = 0x00;
+        dst[2] = 0x00;
+        dst[3] = 0x01;
+        memcpy(dst + 4, data + offset, nal_len);
+        dst += 4 + nal_len;
+        offset += nal_len;
+    }
+    return true;
+}
+
+// The conversion EncodeFrame used before the exact-size and in-place paths:
+// a start code and the NAL appended per unit to a growing vector, stopping at
+// the first prefix that overruns. Kept only as the --bench-nal baseline.
+bool ConvertLengthPrefixedAppend(const uint8_t* data, size_t len, int length_size, std::vector<uint8_t>& out) {
     size_t offset = 0;
-    while (offset + 4 <= len) {
-        uint32_t nal_len = (static_cast<uint32_t>(data[offset]) << 24) |
-                           (static_cast<uint32_t>(data[offset + 1]) << 16) |
-                           (static_cast<uint32_t>(data[offset + 2]) << 8) |
-                           static_cast<uint32_t>(data[offset + 3]);
-        offset += 4;
+    while (offset + length_size <= len) {
+        uint32_t nal_len = static_cast<uint32_t>(ReadBE(data + offset, length_size));
+        offset += length_size;
         if (offset + nal_len > len) break;
         AppendStartCode(out);
         out.insert(out.end(), data + offset, data + offset + nal_len);
@@ -67,6 +438,109 @@ bool ConvertLengthPrefixedToAnnexB(const uint8_t* data, size_t len, std::vector<
     return !out.empty();
 }
 
+// Offset of the first Annex B start code (3 or 4 bytes) at or after from, or size
+size_t FindStartCode(const uint8_t* data, size_t size, size_t from) {
+    for (size_t i = from; i + 3 <= size; ++i) {
+        if (data[i] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x01) {
+            return (i > from && data[i - 1] == 0x00) ? i - 1 : i;
+        }
+    }
+    return size;
+}
+
+// Drop the NAL units whose type bit is set in drop_mask from an Annex B
+// access unit in one pass, moving the kept units down over the gaps. Bytes
+// removed (start codes included) are added to removed[type].
+void FilterNalUnits(std::vector<uint8_t>& data, uint32_t drop_mask, uint64_t removed[32]) {
+    uint8_t* base = data.data();
+    size_t size = data.size();
+    size_t unit = FindStartCode(base, size, 0);
+    size_t write = unit;  // Anything before the first start code is kept as is
+    while (unit < size) {
+        size_t header = unit + (base[unit + 2] == 0x01 ? 3 : 4);
+        size_t next = FindStartCode(base, size, header);
+        size_t length = next - unit;
+        uint8_t type = header < size ? (base[header] & 0x1F) : 0;
+        if (drop_mask & (1u << type)) {
+            removed[type] += length;
+        } else {
+            if (write != unit) {
+                memmove(base + write, base + unit, length);
+            }
+            write += length;
+        }
+        unit = next;
+    }
+    data.resize(write);
+}
+
+// user_data_unregistered SEI identifying capture timing (random UUID)
+const uint8_t kTimingSeiUuid[16] = {
+    0x5c, 0x3a, 0x91, 0xe4, 0x2f, 0x7b, 0x4d, 0x08, 0xa6, 0x1e, 0xc9, 0x53, 0x70, 0xbd, 0x24, 0x8f
+};
+
+// Annex B SEI NAL carrying one user_data_unregistered message. Payload
+// (big-endian): UUID, version 1, sequence (4), capture time on the host's
+// monotonic clock in us (8), capture time in Unix us (8). Emulation
+// prevention is applied.
+std::vector<uint8_t> BuildTimingSei(uint32_t sequence, uint64_t monotonic_us, uint64_t unix_us) {
+    std::vector<uint8_t> payload(kTimingSeiUuid, kTimingSeiUuid + 16);
+    payload.push_back(1);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        payload.push_back(static_cast<uint8_t>(sequence >> shift));
+    }
+    for (uint64_t value : { monotonic_us, unix_us }) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            payload.push_back(static_cast<uint8_t>(value >> shift));
+        }
+    }
+    
+    std::vector<uint8_t> rbsp;
+    rbsp.push_back(5);                                      // payloadType: user_data_unregistered
+    rbsp.push_back(static_cast<uint8_t>(payload.size()));   // payloadSize (< 255)
+    rbsp.insert(rbsp.end(), payload.begin(), payload.end());
+    rbsp.push_back(0x80);                                   // rbsp_trailing_bits
+    
+    std::vector<uint8_t> nal;
+    AppendStartCode(nal);
+    nal.push_back(0x06);                                    // nal_ref_idc 0, type 6 (SEI)
+    int zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros == 2 && byte <= 0x03) {
+            nal.push_back(0x03);
+            zeros = 0;
+        }
+        nal.push_back(byte);
+        zeros = byte == 0x00 ? zeros + 1 : 0;
+    }
+    return nal;
+}
+
+// Insert a NAL unit in front of the first slice of an Annex B access unit
+void InsertBeforeFirstSlice(std::vector<uint8_t>& data, const std::vector<uint8_t>& nal) {
+    size_t unit = FindStartCode(data.data(), data.size(), 0);
+    while (unit < data.size()) {
+        size_t header = unit + (data[unit + 2] == 0x01 ? 3 : 4);
+        uint8_t type = header < data.size() ? (data[header] & 0x1F) : 0;
+        if (type == 1 || type == 5) {
+            break;
+        }
+        unit = FindStartCode(data.data(), data.size(), header);
+    }
+    data.insert(data.begin() + unit, nal.begin(), nal.end());
+}
+
+// Latency probe pattern: a row of square cells at the top-left of the
+// source, a white and a black marker cell, then the 32-bit frame counter
+// MSB first (white = 1). Cells are large enough to survive low bitrates.
+const int kProbeCells = 34;
+const int kProbeMinCell = 4;
+const int kProbeHistory = 1024;    // Capture times kept for counters in flight
+
+int ProbeCellSize(int width) {
+    return (std::min)(16, (width / kProbeCells) & ~1);
+}
+
 bool ContainsKeyframe(const std::vector<uint8_t>& data) {
     for (size_t i = 0; i + 4 < data.size(); ++i) {
         if (data[i] == 0x00 && data[i + 1] == 0x00 &&
@@ -84,6 +558,55 @@ bool ContainsKeyframe(const std::vector<uint8_t>& data) {
     return false;
 }
 
+// Temporal layer of an H.264 access unit coded with B-frame layering (see
+// FfmpegNvencEncoder::Initialize): non-reference pictures (nal_ref_idc 0) are
+// the top layer, referenced B pictures the middle one, I/P the base.
+int TemporalLayerOf(const std::vector<uint8_t>& data, int layers) {
+    for (size_t i = 0; i + 4 < data.size(); ++i) {
+        if (data[i] != 0x00 || data[i + 1] != 0x00 || data[i + 2] != 0x01) {
+            continue;
+        }
+        size_t nal_index = i + 3;
+        uint8_t nal_type = data[nal_index] & 0x1F;
+        if (nal_type != 1 && nal_type != 5) {
+            continue;  // Parameter sets, SEI, AUD
+        }
+        if (nal_type == 5) {
+            return 0;
+        }
+        if ((data[nal_index] & 0x60) == 0) {
+            return layers - 1;
+        }
+        
+        // first_mb_in_slice and slice_type are the first two ue(v) fields
+        // (short enough that emulation prevention cannot occur in them)
+        size_t bit = (nal_index + 1) * 8;
+        auto read_ue = [&](uint32_t* value) {
+            int zeros = 0;
+            while (bit < data.size() * 8 && !((data[bit / 8] >> (7 - bit % 8)) & 1)) {
+                ++zeros;
+                ++bit;
+            }
+            if (zeros > 31 || bit + zeros >= data.size() * 8) {
+                return false;
+            }
+            ++bit;
+            uint32_t suffix = 0;
+            for (int b = 0; b < zeros; ++b, ++bit) {
+                suffix = (suffix << 1) | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+            }
+            *value = (1u << zeros) - 1 + suffix;
+            return true;
+        };
+        uint32_t first_mb = 0, slice_type = 0;
+        if (!read_ue(&first_mb) || !read_ue(&slice_type)) {
+            return 0;
+        }
+        return (slice_type % 5 == 1 && layers > 2) ? 1 : 0;
+    }
+    return 0;
+}
+
 }  // namespace
 
 class FfmpegNvencEncoder {
@@ -96,16 +619,23 @@ public:
         , context_(nullptr)
         , width_(0)
         , height_(0)
-        , fps_(0) {
+        , fps_(0)
+        , temporal_layers_(1)
+        , length_size_(0)
+        , force_idr_(false)
+        , last_pts_(-1)
+        , last_out_pts_(-1) {
     }
 
     bool Initialize(ID3D11Device* device, ID3D11DeviceContext* context,
-                    int width, int height, int fps, int bitrate) {
+                    int width, int height, int fps, int bitrate, int gop_size, int temporal_layers,
+                    const EncoderTuning& tuning) {
         if (!device) return false;
 
         width_ = width;
         height_ = height;
         fps_ = fps;
+        temporal_layers_ = temporal_layers;
         device_ = device;
         context_ = context;
         device_->AddRef();
@@ -125,19 +655,40 @@ public:
 
         codec_ctx_->width = width_;
         codec_ctx_->height = height_;
-        codec_ctx_->time_base = AVRational{1, fps_};
+        // Timestamps are capture times in microseconds, so frames can be spaced
+        // irregularly (event capture, rate governor); framerate is only the
+        // nominal rate that rate control budgets for
+        codec_ctx_->time_base = AVRational{1, 1000000};
         codec_ctx_->framerate = AVRational{fps_, 1};
-        codec_ctx_->gop_size = fps_ * 2;
+        codec_ctx_->gop_size = gop_size;
         codec_ctx_->max_b_frames = 0;
         codec_ctx_->bit_rate = bitrate;
         codec_ctx_->pix_fmt = AV_PIX_FMT_D3D11;
 
-        // Low-latency, WebRTC-friendly defaults.
-        av_opt_set(codec_ctx_->priv_data, "preset", "p1", 0);
-        av_opt_set(codec_ctx_->priv_data, "tune", "ll", 0);
-        av_opt_set(codec_ctx_->priv_data, "rc", "cbr", 0);
-        av_opt_set(codec_ctx_->priv_data, "profile", "baseline", 0);
+        // Operating point; the defaults are low-latency and WebRTC-friendly
+        // (p1 / ll / cbr / baseline)
+        if (av_opt_set(codec_ctx_->priv_data, "preset", tuning.preset.c_str(), 0) < 0 ||
+            av_opt_set(codec_ctx_->priv_data, "tune", tuning.tune.c_str(), 0) < 0 ||
+            av_opt_set(codec_ctx_->priv_data, "rc", tuning.rc.c_str(), 0) < 0 ||
+            av_opt_set(codec_ctx_->priv_data, "profile", tuning.profile.c_str(), 0) < 0) {
+            std::cerr << "FFmpeg: h264_nvenc rejected preset " << tuning.preset << ", tune " << tuning.tune
+                      << ", rc " << tuning.rc << " or profile " << tuning.profile << std::endl;
+            return false;
+        }
         av_opt_set(codec_ctx_->priv_data, "repeat_headers", "1", 0);
+        // Make AV_PICTURE_TYPE_I produce a real IDR so a new client can start decoding.
+        av_opt_set(codec_ctx_->priv_data, "forced-idr", "1", 0);
+
+        // Temporal layers from B-frames (h264_nvenc has no SVC controls):
+        // L1T2 = P b P b with non-reference b; L1T3 = P b B b P where only the
+        // middle B is referenced. Costs 1 or 3 frames of reordering delay.
+        if (temporal_layers_ > 1) {
+            codec_ctx_->max_b_frames = temporal_layers_ == 2 ? 1 : 3;
+            if (tuning.profile == "baseline") {
+                av_opt_set(codec_ctx_->priv_data, "profile", "main", 0);
+            }
+            av_opt_set(codec_ctx_->priv_data, "b_ref_mode", temporal_layers_ == 2 ? "disabled" : "middle", 0);
+        }
 
         if (!InitHwDevice()) {
             return false;
@@ -148,6 +699,17 @@ public:
             return false;
         }
 
+        // Packets are Annex B unless the encoder exported an avcC record
+        // (global headers), whose lengthSizeMinusOne sizes the NAL prefixes
+        length_size_ = 0;
+        if (codec_ctx_->extradata && codec_ctx_->extradata_size >= 7 && codec_ctx_->extradata[0] == 1) {
+            std::vector<uint8_t> parameter_sets;
+            int length_size = 0;
+            if (ConvertAvccToAnnexB(codec_ctx_->extradata, codec_ctx_->extradata_size, parameter_sets, &length_size)) {
+                length_size_ = length_size;
+            }
+        }
+
         return true;
     }
 
@@ -179,12 +741,43 @@ public:
         return true;
     }
 
+    int GopSize() const {
+        return codec_ctx_ ? codec_ctx_->gop_size : 0;
+    }
+
+    // NVENC reconfigures the rate control on the next frame when bit_rate changes
+    void SetBitrate(int bitrate) {
+        if (codec_ctx_) {
+            codec_ctx_->bit_rate = bitrate;
+        }
+    }
+
+    // Force the next encoded frame to be an IDR (SPS/PPS are repeated on every IDR).
+    void RequestKeyframe() {
+        force_idr_ = true;
+    }
+
+    // With B-frames (temporal layers) frames up to LastPts() may still be
+    // inside the reorder window, and come out only once later frames arrive
+    int64_t LastPts() const { return last_pts_; }
+    int64_t LastOutputPts() const { return last_out_pts_; }
+
     bool EncodeFrame(AVFrame* frame, uint64_t timestamp_us, std::vector<EncodedFrame>& out_frames) {
         if (!codec_ctx_ || !frame) return false;
 
-        int64_t pts = av_rescale_q(static_cast<int64_t>(timestamp_us), AVRational{1, 1000000}, codec_ctx_->time_base);
+        // pts must increase strictly; two captures in the same microsecond are nudged apart
+        int64_t pts = static_cast<int64_t>(timestamp_us);
+        if (pts <= last_pts_) {
+            pts = last_pts_ + 1;
+        }
+        last_pts_ = pts;
         frame->pts = pts;
 
+        if (force_idr_) {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            force_idr_ = false;
+        }
+
         int ret = avcodec_send_frame(codec_ctx_, frame);
         av_frame_free(&frame);
         if (ret < 0) {
@@ -205,20 +798,32 @@ public:
             }
 
             EncodedFrame out;
-            if (pkt.size >= 4 &&
-                pkt.data[0] == 0x00 && pkt.data[1] == 0x00 &&
-                (pkt.data[2] == 0x01 || (pkt.data[2] == 0x00 && pkt.data[3] == 0x01))) {
+            bool annex_b = length_size_ == 0 && pkt.size >= 4 &&
+                           pkt.data[0] == 0x00 && pkt.data[1] == 0x00 &&
+                           (pkt.data[2] == 0x01 || (pkt.data[2] == 0x00 && pkt.data[3] == 0x01));
+            if (annex_b) {
                 out.data.assign(pkt.data, pkt.data + pkt.size);
             } else {
-                ConvertLengthPrefixedToAnnexB(pkt.data, pkt.size, out.data);
-                if (out.data.empty()) {
+                // Without an avcC record the prefixes are taken to be 4 bytes
+                int length_size = length_size_ ? length_size_ : 4;
+                if (length_size == 4) {
+                    if (av_packet_make_writable(&pkt) >= 0) {
+                        RewriteLengthPrefixedInPlace(pkt.data, pkt.size);
+                    }
                     out.data.assign(pkt.data, pkt.data + pkt.size);
+                } else if (!ConvertLengthPrefixedToAnnexB(pkt.data, pkt.size, length_size, out.data)) {
+                    out.data.assign(pkt.data, pkt.data + pkt.size);  // Unparseable, pass through
                 }
             }
 
-            out.timestamp = timestamp_us;
+            // With B-frames packets leave in decode order; pts is the capture time
+            out.timestamp = pkt.pts != AV_NOPTS_VALUE ? static_cast<uint64_t>(pkt.pts) : timestamp_us;
+            last_out_pts_ = (std::max)(last_out_pts_, pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pts);
             out.is_keyframe = (pkt.flags & AV_PKT_FLAG_KEY) != 0;
             out.is_audio = false;
+            if (temporal_layers_ > 1) {
+                out.temporal_layer = TemporalLayerOf(out.data, temporal_layers_);
+            }
             out_frames.push_back(std::move(out));
 
             av_packet_unref(&pkt);
@@ -307,578 +912,4666 @@ private:
     int width_;
     int height_;
     int fps_;
+    int temporal_layers_;                                // 1 = off, 2 = L1T2, 3 = L1T3
+    int length_size_;                                    // NAL length prefix size from avcC (0 = Annex B)
+    bool force_idr_;
+    int64_t last_pts_;                                   // Last pts sent, kept strictly increasing
+    int64_t last_out_pts_;                               // Latest pts that has come out as a packet
 };
 
-HRESULT CreateH264Encoder(IMFTransform** out_encoder) {
-    if (!out_encoder) return E_POINTER;
-    *out_encoder = nullptr;
-
-    IMFActivate** activates = nullptr;
-    UINT32 count = 0;
-    MFT_REGISTER_TYPE_INFO out_type = { MFMediaType_Video, MFVideoFormat_H264 };
-    HRESULT hr = MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER,
-                   MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
-                   nullptr, &out_type, &activates, &count);
-    if (SUCCEEDED(hr) && count > 0) {
-        hr = activates[0]->ActivateObject(IID_PPV_ARGS(out_encoder));
-    }
-
-    for (UINT32 i = 0; i < count; ++i) {
-        activates[i]->Release();
+// Draws the mouse pointer into captured frames.
+// Desktop duplication delivers the pointer separately from the desktop image,
+// so shapes are decoded once (cached by content hash) and blended on the CPU
+// over just the tile under the pointer. The duplicated desktop texture cannot
+// be written, so the capture region is copied to an owned canvas and drawn on
+// there; when only the pointer moved the canvas is patched in place (restore
+// old tile, draw new tile) without copying the desktop again.
+//
+// The blend needs the canvas pixels under the pointer. They are read back
+// through a small ring of staging textures, each covering the tile plus
+// kReadbackMargin: while the desktop is unchanged, moves inside an area
+// already read back cost no GPU round trip, and the area around the pointer
+// is copied ahead (and mapped a frame or more later, like the recorder's
+// ring) before the pointer reaches its edge. Only new desktop content under
+// the pointer is waited for.
+class CursorCompositor {
+public:
+    CursorCompositor()
+        : device_(nullptr)
+        , context_(nullptr)
+        , canvas_(nullptr)
+        , region_()
+        , generation_(1)
+        , next_readback_(0)
+        , readback_size_(0)
+        , background_area_()
+        , background_generation_(0)
+        , current_(nullptr)
+        , current_hash_(0)
+        , position_()
+        , visible_(false)
+        , saved_rect_()
+        , has_saved_(false) {
     }
-    CoTaskMemFree(activates);
 
-    if (SUCCEEDED(hr) && *out_encoder) {
-        return hr;
+    void Initialize(ID3D11Device* device, ID3D11DeviceContext* context) {
+        device_ = device;
+        context_ = context;
+        device_->AddRef();
+        context_->AddRef();
     }
 
-    // Fallback to software encoder if no hardware MFT is available.
-    hr = CoCreateInstance(CLSID_CMSH264EncoderMFT, nullptr, CLSCTX_INPROC_SERVER,
-                          IID_PPV_ARGS(out_encoder));
-    return hr;
-}
-
-bool SetH264OutputType(IMFTransform* encoder, UINT32 width, UINT32 height, UINT32 fps) {
-    if (!encoder) return false;
-
-    IMFMediaType* type = nullptr;
-    HRESULT hr = MFCreateMediaType(&type);
-    if (FAILED(hr)) return false;
+    // Must be called while the duplication frame is still held
+    void UpdateShape(IDXGIOutputDuplication* duplication, UINT buffer_size) {
+        shape_buffer_.resize(buffer_size);
+        UINT required = 0;
+        DXGI_OUTDUPL_POINTER_SHAPE_INFO info = {};
+        HRESULT hr = duplication->GetFramePointerShape(buffer_size, shape_buffer_.data(),
+                                                       &required, &info);
+        if (FAILED(hr)) {
+            std::cerr << "GetFramePointerShape failed: 0x" << std::hex << hr << std::dec << std::endl;
+            return;
+        }
 
-    type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
-    type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264);
-    type->SetUINT32(MF_MT_AVG_BITRATE, 5000000);
-    type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
-    MFSetAttributeSize(type, MF_MT_FRAME_SIZE, width, height);
-    MFSetAttributeRatio(type, MF_MT_FRAME_RATE, fps, 1);
-    MFSetAttributeRatio(type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
-    type->SetUINT32(MF_MT_MPEG2_PROFILE, 66); // Baseline
+        uint64_t hash = HashShape(info, shape_buffer_.data(), required);
+        auto it = cache_.find(hash);
+        if (it == cache_.end()) {
+            const size_t kMaxCachedShapes = 64;
+            if (cache_.size() >= kMaxCachedShapes) {
+                cache_.clear();
+            }
+            it = cache_.emplace(hash, DecodeShape(info, shape_buffer_.data())).first;
+        }
+        current_ = &it->second;
+        current_hash_ = hash;
+    }
 
-    hr = encoder->SetOutputType(0, type, MFT_SET_TYPE_TEST_ONLY);
-    if (SUCCEEDED(hr)) {
-        hr = encoder->SetOutputType(0, type, 0);
+    // position is in canvas coordinates (upper-left corner of the shape)
+    void UpdatePosition(bool visible, POINT position) {
+        visible_ = visible;
+        position_ = position;
     }
-    type->Release();
 
-    if (FAILED(hr)) {
-        std::cerr << "SetOutputType failed: 0x" << std::hex << hr << std::endl;
-        return false;
+    bool visible() const { return visible_; }
+    POINT position() const { return position_; }
+    bool has_shape() const { return current_ != nullptr; }
+    // Tile the pointer was drawn over, in desktop coordinates
+    RECT drawn_rect() const {
+        RECT rect = {};
+        if (has_saved_) {
+            rect = saved_rect_;
+            OffsetRect(&rect, region_.left, region_.top);
+        }
+        return rect;
     }
-    return true;
-}
+    uint64_t shape_hash() const { return current_hash_; }
 
-bool SetH264InputType(IMFTransform* encoder, UINT32 width, UINT32 height, UINT32 fps) {
-    if (!encoder) return false;
+    // Cursor shape message payload (little-endian):
+    // [1: type=2] [8: shape hash] [2: width] [2: height] [2: hotspot x] [2: hotspot y]
+    // [1: kind] [width*height*4: BGRA] ([width*height: AND mask] if kind == 1)
+    // kind 0 = straight-alpha BGRA, kind 1 = out = (screen & AND) ^ BGRA
+    void SerializeShape(std::vector<uint8_t>& out) const {
+        if (!current_) return;
+        out.push_back(2);
+        AppendLE(out, current_hash_, 8);
+        AppendLE(out, static_cast<uint64_t>(current_->width), 2);
+        AppendLE(out, static_cast<uint64_t>(current_->height), 2);
+        AppendLE(out, static_cast<uint64_t>(current_->hotspot.x), 2);
+        AppendLE(out, static_cast<uint64_t>(current_->hotspot.y), 2);
+        out.push_back(current_->alpha_blend ? 0 : 1);
 
-    auto try_type = [&](bool add_sample_size) -> HRESULT {
-        IMFMediaType* type = nullptr;
-        HRESULT hr = MFCreateMediaType(&type);
-        if (FAILED(hr)) return hr;
+        const uint8_t* color = reinterpret_cast<const uint8_t*>(current_->color.data());
+        out.insert(out.end(), color, color + current_->color.size() * 4);
+        if (!current_->alpha_blend) {
+            for (uint32_t mask : current_->and_mask) {
+                out.push_back((mask & 0x00FFFFFF) ? 1 : 0);
+            }
+        }
+    }
 
-        type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
-        type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
-        type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
-        MFSetAttributeSize(type, MF_MT_FRAME_SIZE, width, height);
-        MFSetAttributeRatio(type, MF_MT_FRAME_RATE, fps, 1);
-        MFSetAttributeRatio(type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+    // Returns the capture region of the frame with the pointer drawn on it
+    // (caller releases). region is in frame coordinates.
+    // desktop_updated: the frame carries new desktop content and must be copied.
+    ID3D11Texture2D* Compose(ID3D11Texture2D* frame, const RECT& region, bool desktop_updated) {
+        int width = region.right - region.left;
+        int height = region.bottom - region.top;
 
-        if (add_sample_size) {
-            type->SetUINT32(MF_MT_FIXED_SIZE_SAMPLES, TRUE);
-            type->SetUINT32(MF_MT_SAMPLE_SIZE, width * height * 3 / 2);
+        bool fresh_canvas = false;
+        if (canvas_) {
+            D3D11_TEXTURE2D_DESC canvas_desc = {};
+            canvas_->GetDesc(&canvas_desc);
+            if (static_cast<int>(canvas_desc.Width) != width || static_cast<int>(canvas_desc.Height) != height) {
+                canvas_->Release();
+                canvas_ = nullptr;
+            }
+        }
+        if (!canvas_) {
+            D3D11_TEXTURE2D_DESC desc = {};
+            frame->GetDesc(&desc);
+            desc.Width = width;
+            desc.Height = height;
+            desc.MipLevels = 1;
+            desc.ArraySize = 1;
+            desc.Usage = D3D11_USAGE_DEFAULT;
+            desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+            desc.CPUAccessFlags = 0;
+            desc.MiscFlags = 0;
+            if (FAILED(device_->CreateTexture2D(&desc, nullptr, &canvas_))) {
+                return nullptr;
+            }
+            fresh_canvas = true;
         }
 
-        hr = encoder->SetInputType(0, type, MFT_SET_TYPE_TEST_ONLY);
-        if (SUCCEEDED(hr)) {
-            hr = encoder->SetInputType(0, type, 0);
+        bool region_moved = !EqualRect(&region, &region_);
+        region_ = region;
+
+        if (desktop_updated || fresh_canvas || region_moved) {
+            // Only the region is copied; the rest of the desktop is never touched
+            D3D11_BOX box = { static_cast<UINT>(region.left), static_cast<UINT>(region.top), 0,
+                              static_cast<UINT>(region.right), static_cast<UINT>(region.bottom), 1 };
+            context_->CopySubresourceRegion(canvas_, 0, 0, 0, 0, frame, 0, &box);
+            has_saved_ = false;  // Old pointer pixels were overwritten
+            ++generation_;       // and so was everything read back
+        } else if (has_saved_) {
+            // Pointer-only update: put back what was under the old position
+            D3D11_BOX box = { static_cast<UINT>(saved_rect_.left), static_cast<UINT>(saved_rect_.top), 0,
+                              static_cast<UINT>(saved_rect_.right), static_cast<UINT>(saved_rect_.bottom), 1 };
+            context_->UpdateSubresource(canvas_, 0, &box, saved_pixels_.data(),
+                                        (saved_rect_.right - saved_rect_.left) * 4, 0);
+            has_saved_ = false;
         }
-        type->Release();
-        return hr;
-    };
 
-    HRESULT hr = try_type(false);
-    if (SUCCEEDED(hr)) return true;
+        if (visible_ && current_) {
+            DrawPointer(width, height);
+        }
 
-    hr = try_type(true);
-    if (SUCCEEDED(hr)) return true;
+        canvas_->AddRef();
+        return canvas_;
+    }
 
-    std::cerr << "SetInputType failed: 0x" << std::hex << hr << std::endl;
-    return false;
-}
-ScreenCaptureEncoder::ScreenCaptureEncoder()
-    : d3d_device_(nullptr)              // NULL until InitializeD3D11() succeeds
-    , d3d_context_(nullptr)
-    , desktop_duplication_(nullptr)
-    , dxgi_manager_(nullptr)
+    void Shutdown() {
+        ReleaseReadbacks();
+        if (canvas_) {
+            canvas_->Release();
+            canvas_ = nullptr;
+        }
+        if (context_) {
+            context_->Release();
+            context_ = nullptr;
+        }
+        if (device_) {
+            device_->Release();
+            device_ = nullptr;
+        }
+    }
+
+private:
+    static const int kReadbackSlots = 3;                 // Canvas tile copies in flight
+    static const int kReadbackMargin = 64;               // Pixels read back around the pointer tile
+
+    // One staging copy of a canvas area
+    struct Readback {
+        ID3D11Texture2D* texture;
+        RECT area;                                       // Canvas area copied into texture
+        uint64_t generation;                             // Canvas content it was copied from
+        bool pending;                                    // Copied, not mapped yet
+
+        Readback() : texture(nullptr), area(), generation(0), pending(false) {}
+    };
+
+    // Decoded pointer: out = (dst & and_mask) ^ xor_color for mask cursors,
+    // alpha blend of color for color cursors
+    struct CursorBitmap {
+        bool alpha_blend;
+        int width;
+        int height;
+        POINT hotspot;
+        std::vector<uint32_t> color;      // BGRA (color) or XOR value (mask cursors)
+        std::vector<uint32_t> and_mask;   // Mask cursors only
+    };
+
+    static uint64_t HashShape(const DXGI_OUTDUPL_POINTER_SHAPE_INFO& info,
+                              const uint8_t* data, size_t size) {
+        // FNV-1a over the shape header and bitmap
+        uint64_t hash = 1469598103934665603ULL;
+        auto mix = [&hash](const uint8_t* bytes, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+            }
+        };
+        mix(reinterpret_cast<const uint8_t*>(&info), sizeof(info));
+        mix(data, size);
+        return hash;
+    }
+
+    static CursorBitmap DecodeShape(const DXGI_OUTDUPL_POINTER_SHAPE_INFO& info, const uint8_t* data) {
+        CursorBitmap bitmap;
+        bitmap.width = static_cast<int>(info.Width);
+        bitmap.height = static_cast<int>(info.Height);
+        bitmap.alpha_blend = (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_COLOR);
+        bitmap.hotspot = info.HotSpot;
+
+        if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME) {
+            // 1bpp AND mask on top, 1bpp XOR mask below it
+            bitmap.height = static_cast<int>(info.Height / 2);
+            size_t count = static_cast<size_t>(bitmap.width) * bitmap.height;
+            bitmap.color.resize(count);
+            bitmap.and_mask.resize(count);
+            for (int y = 0; y < bitmap.height; ++y) {
+                const uint8_t* and_row = data + y * info.Pitch;
+                const uint8_t* xor_row = data + (y + bitmap.height) * info.Pitch;
+                for (int x = 0; x < bitmap.width; ++x) {
+                    uint8_t bit = static_cast<uint8_t>(0x80 >> (x % 8));
+                    size_t i = static_cast<size_t>(y) * bitmap.width + x;
+                    bitmap.and_mask[i] = (and_row[x / 8] & bit) ? 0xFFFFFFFF : 0xFF000000;
+                    bitmap.color[i] = (xor_row[x / 8] & bit) ? 0x00FFFFFF : 0x00000000;
+                }
+            }
+            return bitmap;
+        }
+
+        size_t count = static_cast<size_t>(bitmap.width) * bitmap.height;
+        bitmap.color.resize(count);
+        for (int y = 0; y < bitmap.height; ++y) {
+            memcpy(&bitmap.color[static_cast<size_t>(y) * bitmap.width], data + y * info.Pitch,
+                   static_cast<size_t>(bitmap.width) * 4);
+        }
+
+        if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MASKED_COLOR) {
+            // Alpha 0xFF: XOR with the screen, alpha 0: replace the screen
+            bitmap.and_mask.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                bool xor_pixel = (bitmap.color[i] >> 24) == 0xFF;
+                bitmap.and_mask[i] = xor_pixel ? 0xFFFFFFFF : 0xFF000000;
+                bitmap.color[i] &= 0x00FFFFFF;
+            }
+        }
+        return bitmap;
+    }
+
+    static bool Contains(const RECT& outer, const RECT& inner) {
+        return inner.left >= outer.left && inner.top >= outer.top &&
+               inner.right <= outer.right && inner.bottom <= outer.bottom;
+    }
+
+    // area, less `slack` on every side that is not the canvas edge
+    static RECT Shrink(const RECT& area, int slack, int canvas_width, int canvas_height) {
+        RECT inner = area;
+        if (inner.left > 0) inner.left += slack;
+        if (inner.top > 0) inner.top += slack;
+        if (inner.right < canvas_width) inner.right -= slack;
+        if (inner.bottom < canvas_height) inner.bottom -= slack;
+        return inner;
+    }
+
+    void ReleaseReadbacks() {
+        for (Readback& slot : readbacks_) {
+            if (slot.texture) {
+                slot.texture->Release();
+                slot.texture = nullptr;
+            }
+            slot.pending = false;
+        }
+        next_readback_ = 0;
+        readback_size_ = 0;
+        background_generation_ = 0;
+    }
+
+    // Copy the canvas around tile into the next ring slot; mapped later
+    Readback* IssueReadback(const RECT& tile, int canvas_width, int canvas_height) {
+        int needed = (std::max)(tile.right - tile.left, tile.bottom - tile.top) + 2 * kReadbackMargin;
+        if (readback_size_ < needed) {
+            ReleaseReadbacks();
+            readback_size_ = needed;
+        }
+
+        Readback& slot = readbacks_[next_readback_];
+        next_readback_ = (next_readback_ + 1) % kReadbackSlots;
+        if (!slot.texture) {
+            D3D11_TEXTURE2D_DESC desc = {};
+            canvas_->GetDesc(&desc);
+            desc.Width = readback_size_;
+            desc.Height = readback_size_;
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.BindFlags = 0;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            if (FAILED(device_->CreateTexture2D(&desc, nullptr, &slot.texture))) {
+                return nullptr;
+            }
+        }
+
+        RECT area = { tile.left - kReadbackMargin, tile.top - kReadbackMargin,
+                      tile.right + kReadbackMargin, tile.bottom + kReadbackMargin };
+        RECT bounds = { 0, 0, canvas_width, canvas_height };
+        IntersectRect(&area, &area, &bounds);
+        D3D11_BOX box = { static_cast<UINT>(area.left), static_cast<UINT>(area.top), 0,
+                          static_cast<UINT>(area.right), static_cast<UINT>(area.bottom), 1 };
+        context_->CopySubresourceRegion(slot.texture, 0, 0, 0, 0, canvas_, 0, &box);
+        slot.area = area;
+        slot.generation = generation_;
+        slot.pending = true;
+        return &slot;
+    }
+
+    // Map a slot into background_ (waits only for what is still in flight)
+    bool CollectReadback(Readback& slot) {
+        slot.pending = false;
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        if (FAILED(context_->Map(slot.texture, 0, D3D11_MAP_READ, 0, &mapped))) {
+            return false;
+        }
+        int area_width = slot.area.right - slot.area.left;
+        int area_height = slot.area.bottom - slot.area.top;
+        background_.resize(static_cast<size_t>(area_width) * area_height);
+        for (int y = 0; y < area_height; ++y) {
+            memcpy(&background_[static_cast<size_t>(y) * area_width],
+                   static_cast<const uint8_t*>(mapped.pData) + y * mapped.RowPitch,
+                   static_cast<size_t>(area_width) * 4);
+        }
+        context_->Unmap(slot.texture, 0);
+        background_area_ = slot.area;
+        background_generation_ = slot.generation;
+        return true;
+    }
+
+    // Make background_ hold the current (pointer-free) canvas pixels under tile
+    bool ReadBackground(const RECT& tile, int canvas_width, int canvas_height) {
+        if (background_generation_ == generation_ && Contains(background_area_, tile)) {
+            return true;
+        }
+        // Newest copy first; one issued ahead has usually finished by now
+        for (int i = 1; i <= kReadbackSlots; ++i) {
+            Readback& slot = readbacks_[(next_readback_ + kReadbackSlots - i) % kReadbackSlots];
+            if (slot.pending && slot.generation == generation_ && Contains(slot.area, tile)) {
+                return CollectReadback(slot);
+            }
+        }
+        // New desktop content under the pointer: nothing to do but wait for it
+        Readback* slot = IssueReadback(tile, canvas_width, canvas_height);
+        return slot && CollectReadback(*slot);
+    }
+
+    // Copy the area around the pointer ahead once it nears the edge of what is read back
+    void Prefetch(const RECT& tile, int canvas_width, int canvas_height) {
+        const int kSlack = kReadbackMargin / 2;
+        if (Contains(Shrink(background_area_, kSlack, canvas_width, canvas_height), tile)) {
+            return;
+        }
+        for (const Readback& slot : readbacks_) {
+            if (slot.pending && slot.generation == generation_ &&
+                Contains(Shrink(slot.area, kSlack, canvas_width, canvas_height), tile)) {
+                return;  // Already on its way
+            }
+        }
+        IssueReadback(tile, canvas_width, canvas_height);
+    }
+
+    void DrawPointer(int canvas_width, int canvas_height) {
+        RECT tile = { position_.x - region_.left, position_.y - region_.top,
+                      position_.x - region_.left + current_->width, position_.y - region_.top + current_->height };
+        RECT bounds = { 0, 0, canvas_width, canvas_height };
+        RECT clipped;
+        if (!IntersectRect(&clipped, &tile, &bounds)) {
+            return;
+        }
+        int tile_width = clipped.right - clipped.left;
+        int tile_height = clipped.bottom - clipped.top;
+
+        if (!ReadBackground(clipped, canvas_width, canvas_height)) {
+            return;
+        }
+        int background_width = background_area_.right - background_area_.left;
+        saved_pixels_.resize(static_cast<size_t>(tile_width) * tile_height);
+        for (int y = 0; y < tile_height; ++y) {
+            size_t src = static_cast<size_t>(y + clipped.top - background_area_.top) * background_width +
+                         (clipped.left - background_area_.left);
+            memcpy(&saved_pixels_[static_cast<size_t>(y) * tile_width], &background_[src],
+                   static_cast<size_t>(tile_width) * 4);
+        }
+
+        // The canvas is still pointer-free here
+        Prefetch(clipped, canvas_width, canvas_height);
+
+        saved_rect_ = clipped;
+        has_saved_ = true;
+
+        blended_pixels_ = saved_pixels_;
+        int offset_x = clipped.left - tile.left;
+        int offset_y = clipped.top - tile.top;
+        for (int y = 0; y < tile_height; ++y) {
+            for (int x = 0; x < tile_width; ++x) {
+                size_t src = static_cast<size_t>(y + offset_y) * current_->width + (x + offset_x);
+                uint32_t& dst = blended_pixels_[static_cast<size_t>(y) * tile_width + x];
+                uint32_t color = current_->color[src];
+                if (current_->alpha_blend) {
+                    uint32_t alpha = color >> 24;
+                    uint32_t inv = 255 - alpha;
+                    uint32_t rb = (((color & 0x00FF00FF) * alpha + (dst & 0x00FF00FF) * inv) >> 8) & 0x00FF00FF;
+                    uint32_t g = (((color & 0x0000FF00) * alpha + (dst & 0x0000FF00) * inv) >> 8) & 0x0000FF00;
+                    dst = 0xFF000000 | rb | g;
+                } else {
+                    dst = ((dst & current_->and_mask[src]) ^ color) | 0xFF000000;
+                }
+            }
+        }
+
+        D3D11_BOX box = { static_cast<UINT>(clipped.left), static_cast<UINT>(clipped.top), 0,
+                          static_cast<UINT>(clipped.right), static_cast<UINT>(clipped.bottom), 1 };
+        context_->UpdateSubresource(canvas_, 0, &box, blended_pixels_.data(), tile_width * 4, 0);
+    }
+
+    ID3D11Device* device_;
+    ID3D11DeviceContext* context_;
+    ID3D11Texture2D* canvas_;              // Owned copy of the capture region with the pointer drawn
+    RECT region_;                          // Frame area the canvas holds
+    uint64_t generation_;                  // Bumped whenever the canvas gets new desktop content
+    Readback readbacks_[kReadbackSlots];
+    int next_readback_;
+    int readback_size_;                    // Width and height of each staging texture
+    std::vector<uint32_t> background_;     // Pointer-free canvas pixels of background_area_
+    RECT background_area_;
+    uint64_t background_generation_;       // Canvas content background_ holds (0 = none)
+    std::unordered_map<uint64_t, CursorBitmap> cache_;
+    const CursorBitmap* current_;
+    uint64_t current_hash_;
+    POINT position_;
+    bool visible_;
+    std::vector<uint8_t> shape_buffer_;
+    std::vector<uint32_t> saved_pixels_;   // Canvas pixels under the drawn pointer
+    std::vector<uint32_t> blended_pixels_;
+    RECT saved_rect_;
+    bool has_saved_;
+};
+
+// Plays a Y4M or raw frame file in place of desktop duplication so pipeline
+// and encoder performance can be measured on identical content. The file is
+// memory-mapped; each frame is written into a staging texture and copied into
+// an owned frame texture, so only the dirty rectangles of a frame (from the
+// optional sidecar track) cost an upload. YUV sources are uploaded as NV12
+// and converted by the video processor like any other input.
+//
+// Sidecar dirty-rect track (text, '#' starts a comment), one line per changed frame:
+//   <frame index> [<x> <y> <w> <h>]...
+// Frames not listed are unchanged and are not delivered (like a duplication
+// timeout); a line without rectangles marks the whole frame dirty.
+// Recorder dumps carry their own changed rectangles and need no sidecar.
+class ReplaySource {
+public:
+    ReplaySource()
+        : file_(INVALID_HANDLE_VALUE)
+        , mapping_(nullptr)
+        , view_(nullptr)
+        , file_size_(0)
+        , format_(ReplayFormat::kY4m)
+        , width_(0)
+        , height_(0)
+        , frame_size_(0)
+        , has_dirty_track_(false)
+        , next_frame_(0)
+        , frames_played_(0)
+        , loops_(0)
+        , content_frame_(0)
+        , loop_(true)
+        , finished_(false)
+        , stamp_counter_(false)
+        , device_(nullptr)
+        , context_(nullptr)
+        , staging_(nullptr)
+        , frame_texture_(nullptr)
+        , needs_full_upload_(true)
+        , changed_full_(true) {
+    }
+
+    ~ReplaySource() {
+        ReleaseDevice();
+        Close();
+    }
+
+    bool Open(const ReplaySettings& settings) {
+        file_ = CreateFileW(settings.path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+            std::wcerr << L"Failed to open replay file " << settings.path
+                       << L". Error: " << GetLastError() << std::endl;
+            return false;
+        }
+
+        LARGE_INTEGER size = {};
+        if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+            std::cerr << "Replay file is empty" << std::endl;
+            Close();
+            return false;
+        }
+        file_size_ = static_cast<size_t>(size.QuadPart);
+
+        mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_) {
+            view_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        }
+        if (!view_) {
+            std::cerr << "Failed to map replay file. Error: " << GetLastError() << std::endl;
+            Close();
+            return false;
+        }
+
+        format_ = settings.format;
+        if (file_size_ >= sizeof(kDumpMagic) && memcmp(view_, kDumpMagic, sizeof(kDumpMagic)) == 0) {
+            format_ = ReplayFormat::kDump;
+        }
+        loop_ = settings.loop;
+        stamp_counter_ = settings.stamp_counter;
+        bool indexed = false;
+        if (format_ == ReplayFormat::kY4m) {
+            indexed = IndexY4m();
+        } else if (format_ == ReplayFormat::kDump) {
+            indexed = IndexDump();
+        } else {
+            indexed = IndexRaw(settings.width, settings.height);
+        }
+        if (!indexed) {
+            Close();
+            return false;
+        }
+
+        if (!settings.dirty_rects_path.empty() && format_ != ReplayFormat::kDump &&
+            !LoadDirtyRects(settings.dirty_rects_path)) {
+            Close();
+            return false;
+        }
+
+        std::cout << "Replay source: " << frame_offsets_.size() << " frames, "
+                  << width_ << "x" << height_
+                  << (is_nv12() ? " NV12" : " BGRA")
+                  << (format_ == ReplayFormat::kDump ? " dump" : "")
+                  << (has_dirty_track_ ? ", dirty-rect track" : "") << std::endl;
+        return true;
+    }
+
+    void Close() {
+        if (view_) {
+            UnmapViewOfFile(view_);
+            view_ = nullptr;
+        }
+        if (mapping_) {
+            CloseHandle(mapping_);
+            mapping_ = nullptr;
+        }
+        if (file_ != INVALID_HANDLE_VALUE) {
+            CloseHandle(file_);
+            file_ = INVALID_HANDLE_VALUE;
+        }
+        frame_offsets_.clear();
+        dirty_rects_.clear();
+    }
+
+    bool is_open() const { return view_ != nullptr; }
+    int width() const { return width_; }
+    int height() const { return height_; }
+    bool is_nv12() const { return format_ == ReplayFormat::kY4m || format_ == ReplayFormat::kNv12; }
+    uint64_t frames_played() const { return frames_played_; }
+    // Position in the file's timeline of the last frame handed out, counting
+    // frames the dirty-rect track skipped and earlier loops
+    uint64_t content_frame() const { return content_frame_; }
+    bool finished() const { return finished_; }
+    // What the last frame changed: the whole frame, or these rects (dirty-rect
+    // track, recorded dump or probe counter cells)
+    bool changed_full() const { return changed_full_; }
+    const std::vector<RECT>& changed_rects() const { return changed_rects_; }
+
+    // GPU objects are tied to the device, the mapping and position are not, so
+    // a device or duplication reset continues playback where it was
+    bool AttachDevice(ID3D11Device* device, ID3D11DeviceContext* context) {
+        ReleaseDevice();
+
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = width_;
+        desc.Height = height_;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = is_nv12() ? DXGI_FORMAT_NV12 : DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_STAGING;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        HRESULT hr = device->CreateTexture2D(&desc, nullptr, &staging_);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create replay staging texture: 0x" << std::hex << hr << std::dec << std::endl;
+            return false;
+        }
+
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.CPUAccessFlags = 0;
+        desc.BindFlags = is_nv12() ? D3D11_BIND_SHADER_RESOURCE
+                                   : D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+        hr = device->CreateTexture2D(&desc, nullptr, &frame_texture_);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create replay frame texture: 0x" << std::hex << hr << std::dec << std::endl;
+            ReleaseDevice();
+            return false;
+        }
+
+        device_ = device;
+        context_ = context;
+        device_->AddRef();
+        context_->AddRef();
+        needs_full_upload_ = true;  // New textures have no content yet
+        if (format_ == ReplayFormat::kDump) {
+            next_frame_ = 0;  // Dump records are deltas; only the first one is whole
+        }
+        return true;
+    }
+
+    void ReleaseDevice() {
+        if (frame_texture_) {
+            frame_texture_->Release();
+            frame_texture_ = nullptr;
+        }
+        if (staging_) {
+            staging_->Release();
+            staging_ = nullptr;
+        }
+        if (context_) {
+            context_->Release();
+            context_ = nullptr;
+        }
+        if (device_) {
+            device_->Release();
+            device_ = nullptr;
+        }
+    }
+
+    // Advance one frame. Returns false for frames the dirty-rect track marks
+    // unchanged and once playback has finished (without looping).
+    bool NextFrame(ID3D11Texture2D** out_texture, DXGI_OUTDUPL_FRAME_INFO* frame_info) {
+        if (finished_ || !frame_texture_) {
+            return false;
+        }
+        if (next_frame_ >= frame_offsets_.size()) {
+            if (!loop_) {
+                std::cout << "Replay finished after " << frames_played_ << " frames" << std::endl;
+                finished_ = true;
+                return false;
+            }
+            next_frame_ = 0;
+            loops_++;
+        }
+
+        size_t index = next_frame_++;
+        content_frame_ = loops_ * frame_offsets_.size() + index;
+        const std::vector<RECT>* rects = nullptr;
+        bool unchanged = false;  // Only the probe counter changes
+        if (format_ == ReplayFormat::kDump) {
+            rects = &dirty_rects_[index];
+            if (rects->empty()) {
+                if (!stamp_counter_) {
+                    return false;  // Pointer-only frame in the recording
+                }
+                unchanged = true;
+            }
+        } else if (has_dirty_track_ && !needs_full_upload_) {
+            auto it = dirty_rects_.find(index);
+            if (it == dirty_rects_.end()) {
+                if (!stamp_counter_) {
+                    return false;  // Unchanged frame
+                }
+                unchanged = true;
+            } else {
+                rects = &it->second;
+            }
+        }
+
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        HRESULT hr = context_->Map(staging_, 0, D3D11_MAP_WRITE, 0, &mapped);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to map replay staging texture: 0x" << std::hex << hr << std::dec << std::endl;
+            return false;
+        }
+
+        RECT full = { 0, 0, width_, height_ };
+        const uint8_t* frame = view_ + frame_offsets_[index];
+        if (format_ == ReplayFormat::kDump) {
+            const uint8_t* pixels = frame;
+            for (const RECT& rect : *rects) {
+                UploadPackedRect(pixels, rect, mapped);
+                pixels += static_cast<size_t>(rect.right - rect.left) * (rect.bottom - rect.top) * 4;
+            }
+        } else if (rects && !rects->empty()) {
+            for (const RECT& rect : *rects) {
+                UploadRect(frame, rect, mapped);
+            }
+        } else if (!unchanged) {
+            UploadRect(frame, full, mapped);
+        }
+
+        // Partial frames copy the counter cells along with their own rects
+        std::vector<RECT> copies;
+        if (rects) {
+            copies = *rects;
+        }
+        if (stamp_counter_) {
+            RECT cells = StampCounter(mapped, static_cast<uint32_t>(frames_played_));
+            if (rects || unchanged) {
+                copies.push_back(cells);
+            }
+        }
+        context_->Unmap(staging_, 0);
+
+        if (!copies.empty()) {
+            for (const RECT& rect : copies) {
+                D3D11_BOX box = { static_cast<UINT>(rect.left), static_cast<UINT>(rect.top), 0,
+                                  static_cast<UINT>(rect.right), static_cast<UINT>(rect.bottom), 1 };
+                context_->CopySubresourceRegion(frame_texture_, 0, rect.left, rect.top, 0,
+                                                staging_, 0, &box);
+            }
+        } else {
+            context_->CopyResource(frame_texture_, staging_);
+        }
+        needs_full_upload_ = false;
+        changed_full_ = copies.empty();
+        changed_rects_.swap(copies);
+
+        *frame_info = {};
+        frame_info->LastPresentTime.QuadPart = static_cast<LONGLONG>(frames_played_ + 1);
+        frame_info->AccumulatedFrames = 1;
+
+        ++frames_played_;
+        frame_texture_->AddRef();
+        *out_texture = frame_texture_;
+        return true;
+    }
+
+    // Play from the first frame again (encoder sweep: same input per run)
+    void Rewind() {
+        next_frame_ = 0;
+        frames_played_ = 0;
+        loops_ = 0;
+        content_frame_ = 0;
+        finished_ = false;
+        needs_full_upload_ = true;
+    }
+
+private:
+    // YUV4MPEG2 header: "YUV4MPEG2 W<w> H<h> F<n>:<d> I<i> A<a> C<c> X<x>\n",
+    // then per frame "FRAME[ params]\n" followed by the Y, U and V planes
+    bool IndexY4m() {
+        const char kMagic[] = "YUV4MPEG2 ";
+        const size_t magic_length = sizeof(kMagic) - 1;
+        const uint8_t* header_end = static_cast<const uint8_t*>(memchr(view_, '\n', (std::min)(file_size_, size_t(4096))));
+        if (file_size_ < magic_length || memcmp(view_, kMagic, magic_length) != 0 || !header_end) {
+            std::cerr << "Not a Y4M file" << std::endl;
+            return false;
+        }
+
+        std::istringstream header(std::string(reinterpret_cast<const char*>(view_) + magic_length,
+                                              reinterpret_cast<const char*>(header_end)));
+        std::string token;
+        std::string chroma = "420";
+        int rate_num = 0, rate_den = 1;
+        while (header >> token) {
+            switch (token[0]) {
+            case 'W': width_ = std::atoi(token.c_str() + 1); break;
+            case 'H': height_ = std::atoi(token.c_str() + 1); break;
+            case 'C': chroma = token.substr(1); break;
+            case 'F': sscanf_s(token.c_str() + 1, "%d:%d", &rate_num, &rate_den); break;
+            case 'I':
+                if (token != "Ip" && token != "I?") {
+                    std::cerr << "Interlaced Y4M is not supported" << std::endl;
+                    return false;
+                }
+                break;
+            default: break;
+            }
+        }
+        if (chroma.compare(0, 3, "420") != 0) {
+            std::cerr << "Only 4:2:0 Y4M is supported (got C" << chroma << ")" << std::endl;
+            return false;
+        }
+        // 420p10/420p12/420p16 store 16-bit samples; only 8-bit maps onto NV12
+        if (chroma.size() > 4 && chroma[3] == 'p' && chroma[4] >= '0' && chroma[4] <= '9') {
+            std::cerr << "Only 8-bit Y4M is supported (got C" << chroma << ")" << std::endl;
+            return false;
+        }
+        // NV12 surfaces need even dimensions
+        if (width_ <= 0 || height_ <= 0 || (width_ & 1) || (height_ & 1)) {
+            std::cerr << "Y4M frame size " << width_ << "x" << height_ << " is not usable" << std::endl;
+            return false;
+        }
+        if (rate_num > 0 && rate_den > 0) {
+            std::cout << "Replay file rate: " << rate_num << "/" << rate_den
+                      << " fps (played at the configured fps)" << std::endl;
+        }
+
+        frame_size_ = static_cast<size_t>(width_) * height_ * 3 / 2;
+        size_t position = static_cast<size_t>(header_end - view_) + 1;
+        while (position + 5 <= file_size_ && memcmp(view_ + position, "FRAME", 5) == 0) {
+            const uint8_t* line_end = static_cast<const uint8_t*>(
+                memchr(view_ + position, '\n', file_size_ - position));
+            if (!line_end) {
+                break;
+            }
+            size_t data = static_cast<size_t>(line_end - view_) + 1;
+            if (data + frame_size_ > file_size_) {
+                break;  // Truncated last frame
+            }
+            frame_offsets_.push_back(data);
+            position = data + frame_size_;
+        }
+
+        if (frame_offsets_.empty()) {
+            std::cerr << "Y4M file has no complete frames" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool IndexRaw(int width, int height) {
+        if (width <= 0 || height <= 0 || (width & 1) || (height & 1)) {
+            std::cerr << "Raw replay needs an even frame size" << std::endl;
+            return false;
+        }
+        width_ = width;
+        height_ = height;
+        frame_size_ = static_cast<size_t>(width_) * height_ *
+                      (format_ == ReplayFormat::kBgra ? 4 : 1);
+        if (format_ == ReplayFormat::kNv12) {
+            frame_size_ = frame_size_ * 3 / 2;
+        }
+
+        size_t count = file_size_ / frame_size_;
+        if (count == 0) {
+            std::cerr << "Replay file is smaller than one frame" << std::endl;
+            return false;
+        }
+        if (file_size_ % frame_size_ != 0) {
+            std::cerr << "Replay file has " << (file_size_ % frame_size_)
+                      << " trailing bytes, ignoring them" << std::endl;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            frame_offsets_.push_back(i * frame_size_);
+        }
+        return true;
+    }
+
+    // Recorder dump: header, then records of
+    // [8: timestamp] [4: count] [count * 16: rects] [packed BGRA pixels of each rect]
+    bool IndexDump() {
+        const size_t header_size = sizeof(kDumpMagic) + 8;
+        if (file_size_ < header_size) {
+            std::cerr << "Frame dump header is truncated" << std::endl;
+            return false;
+        }
+        width_ = static_cast<int>(ReadLE(view_ + sizeof(kDumpMagic), 4));
+        height_ = static_cast<int>(ReadLE(view_ + sizeof(kDumpMagic) + 4, 4));
+        if (width_ <= 0 || height_ <= 0) {
+            std::cerr << "Frame dump has no frame size" << std::endl;
+            return false;
+        }
+
+        size_t position = header_size;
+        while (position + 12 <= file_size_) {
+            size_t count = static_cast<size_t>(ReadLE(view_ + position + 8, 4));
+            size_t rects_end = position + 12 + count * 16;
+            if (rects_end > file_size_) {
+                break;
+            }
+
+            std::vector<RECT> rects;
+            size_t pixel_bytes = 0;
+            bool valid = true;
+            for (size_t i = 0; i < count; ++i) {
+                const uint8_t* field = view_ + position + 12 + i * 16;
+                RECT rect = { static_cast<LONG>(ReadLE(field, 4)), static_cast<LONG>(ReadLE(field + 4, 4)),
+                              static_cast<LONG>(ReadLE(field + 8, 4)), static_cast<LONG>(ReadLE(field + 12, 4)) };
+                if (rect.left < 0 || rect.top < 0 || rect.right > width_ || rect.bottom > height_ ||
+                    rect.right <= rect.left || rect.bottom <= rect.top) {
+                    valid = false;
+                    break;
+                }
+                pixel_bytes += static_cast<size_t>(rect.right - rect.left) * (rect.bottom - rect.top) * 4;
+                rects.push_back(rect);
+            }
+            if (!valid || rects_end + pixel_bytes > file_size_) {
+                break;  // Corrupt or truncated (recording cut off) record
+            }
+
+            dirty_rects_[frame_offsets_.size()] = std::move(rects);
+            frame_offsets_.push_back(rects_end);
+            position = rects_end + pixel_bytes;
+        }
+
+        if (frame_offsets_.empty() || dirty_rects_[0].empty()) {
+            std::cerr << "Frame dump has no complete first frame" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool LoadDirtyRects(const std::wstring& path) {
+        std::ifstream in(path);
+        if (!in) {
+            std::wcerr << L"Failed to open dirty-rect track " << path << std::endl;
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t comment = line.find('#');
+            if (comment != std::string::npos) {
+                line.erase(comment);
+            }
+            std::istringstream fields(line);
+            size_t index = 0;
+            if (!(fields >> index)) {
+                continue;
+            }
+
+            std::vector<RECT>& rects = dirty_rects_[index];
+            int x = 0, y = 0, w = 0, h = 0;
+            while (fields >> x >> y >> w >> h) {
+                // Even-aligned so NV12 chroma rows/columns are copied whole
+                RECT rect = { (std::max)(0, x) & ~1, (std::max)(0, y) & ~1,
+                              (std::min)(width_, (x + w + 1) & ~1), (std::min)(height_, (y + h + 1) & ~1) };
+                if (rect.right > rect.left && rect.bottom > rect.top) {
+                    rects.push_back(rect);
+                }
+            }
+        }
+
+        has_dirty_track_ = true;
+        std::cout << "Dirty-rect track: " << dirty_rects_.size() << " changed frames" << std::endl;
+        return true;
+    }
+
+    // Copy one rectangle of a file frame into the mapped staging texture.
+    // For NV12 the chroma plane follows the luma plane at RowPitch * height.
+    void UploadRect(const uint8_t* frame, const RECT& rect, const D3D11_MAPPED_SUBRESOURCE& mapped) {
+        uint8_t* dst = static_cast<uint8_t*>(mapped.pData);
+        size_t pitch = mapped.RowPitch;
+        int rect_width = rect.right - rect.left;
+
+        if (format_ == ReplayFormat::kBgra) {
+            for (int y = rect.top; y < rect.bottom; ++y) {
+                memcpy(dst + y * pitch + rect.left * 4,
+                       frame + (static_cast<size_t>(y) * width_ + rect.left) * 4,
+                       static_cast<size_t>(rect_width) * 4);
+            }
+            return;
+        }
+
+        for (int y = rect.top; y < rect.bottom; ++y) {
+            memcpy(dst + y * pitch + rect.left,
+                   frame + static_cast<size_t>(y) * width_ + rect.left, rect_width);
+        }
+
+        uint8_t* dst_uv = dst + pitch * height_;
+        const uint8_t* src_chroma = frame + static_cast<size_t>(width_) * height_;
+        if (format_ == ReplayFormat::kNv12) {
+            for (int y = rect.top / 2; y < rect.bottom / 2; ++y) {
+                memcpy(dst_uv + y * pitch + rect.left,
+                       src_chroma + static_cast<size_t>(y) * width_ + rect.left, rect_width);
+            }
+            return;
+        }
+
+        // Y4M 4:2:0 is planar (I420); NV12 interleaves U and V
+        size_t chroma_width = width_ / 2;
+        const uint8_t* src_u = src_chroma;
+        const uint8_t* src_v = src_chroma + chroma_width * (height_ / 2);
+        for (int y = rect.top / 2; y < rect.bottom / 2; ++y) {
+            uint8_t* row = dst_uv + y * pitch;
+            for (int x = rect.left / 2; x < rect.right / 2; ++x) {
+                row[x * 2] = src_u[y * chroma_width + x];
+                row[x * 2 + 1] = src_v[y * chroma_width + x];
+            }
+        }
+    }
+
+    // Draw the latency probe pattern (see kProbeCells) for `counter` into the
+    // mapped staging texture; returns the rectangle it covers
+    RECT StampCounter(const D3D11_MAPPED_SUBRESOURCE& mapped, uint32_t counter) {
+        uint8_t* dst = static_cast<uint8_t*>(mapped.pData);
+        size_t pitch = mapped.RowPitch;
+        int cell = ProbeCellSize(width_);
+
+        for (int i = 0; i < kProbeCells; ++i) {
+            bool white = i == 0 || (i >= 2 && ((counter >> (31 - (i - 2))) & 1));
+            int left = i * cell;
+            for (int y = 0; y < cell; ++y) {
+                if (is_nv12()) {
+                    memset(dst + y * pitch + left, white ? 235 : 16, cell);
+                } else {
+                    uint8_t* row = dst + y * pitch + left * 4;
+                    for (int x = 0; x < cell; ++x) {
+                        uint8_t level = white ? 0xFF : 0x00;
+                        row[x * 4] = row[x * 4 + 1] = row[x * 4 + 2] = level;
+                        row[x * 4 + 3] = 0xFF;
+                    }
+                }
+            }
+            if (is_nv12()) {
+                for (int y = 0; y < cell / 2; ++y) {
+                    memset(dst + pitch * height_ + y * pitch + left, 128, cell);  // Neutral chroma
+                }
+            }
+        }
+
+        RECT rect = { 0, 0, kProbeCells * cell, cell };
+        return rect;
+    }
+
+    // Dump pixels are packed per rectangle
+    void UploadPackedRect(const uint8_t* pixels, const RECT& rect, const D3D11_MAPPED_SUBRESOURCE& mapped) {
+        uint8_t* dst = static_cast<uint8_t*>(mapped.pData);
+        size_t row_bytes = static_cast<size_t>(rect.right - rect.left) * 4;
+        for (int y = rect.top; y < rect.bottom; ++y) {
+            memcpy(dst + y * mapped.RowPitch + rect.left * 4, pixels, row_bytes);
+            pixels += row_bytes;
+        }
+    }
+
+    HANDLE file_;
+    HANDLE mapping_;
+    const uint8_t* view_;                   // Whole file, read-only
+    size_t file_size_;
+    ReplayFormat format_;
+    int width_;
+    int height_;
+    size_t frame_size_;                     // Bytes of pixel data per frame
+    std::vector<size_t> frame_offsets_;     // File offset of each frame's pixel data
+    std::unordered_map<size_t, std::vector<RECT>> dirty_rects_;  // Frame index -> changed rects
+    bool has_dirty_track_;
+    size_t next_frame_;
+    uint64_t frames_played_;                // Frames delivered, across loops
+    uint64_t loops_;                        // Times playback wrapped to the first frame
+    uint64_t content_frame_;                // File timeline position of the last frame
+    bool loop_;
+    bool finished_;
+    bool stamp_counter_;                    // Draw the latency probe counter
+    ID3D11Device* device_;
+    ID3D11DeviceContext* context_;
+    ID3D11Texture2D* staging_;              // CPU-written upload surface
+    ID3D11Texture2D* frame_texture_;        // Frame handed to the pipeline
+    bool needs_full_upload_;                // Frame texture content is undefined
+    bool changed_full_;                     // Last frame was uploaded whole
+    std::vector<RECT> changed_rects_;       // Otherwise, the rects it uploaded
+};
+
+// libavcodec's software H.264 decoder, set up for low delay: one thread and
+// pictures out as soon as they are decodable, so decoder buffering does not
+// show up in measurements
+class H264Decoder {
+public:
+    H264Decoder()
+        : codec_ctx_(nullptr)
+        , packet_(nullptr)
+        , picture_(nullptr) {
+    }
+
+    ~H264Decoder() {
+        Shutdown();
+    }
+
+    bool Initialize() {
+        Shutdown();
+        const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+        if (!codec) {
+            std::cerr << "FFmpeg: H.264 decoder not found" << std::endl;
+            return false;
+        }
+        codec_ctx_ = avcodec_alloc_context3(codec);
+        packet_ = av_packet_alloc();
+        picture_ = av_frame_alloc();
+        if (!codec_ctx_ || !packet_ || !picture_) {
+            std::cerr << "FFmpeg: failed to allocate decoder state" << std::endl;
+            Shutdown();
+            return false;
+        }
+
+        codec_ctx_->thread_count = 1;
+        codec_ctx_->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        if (avcodec_open2(codec_ctx_, codec, nullptr) < 0) {
+            std::cerr << "FFmpeg: failed to open H.264 decoder" << std::endl;
+            Shutdown();
+            return false;
+        }
+        return true;
+    }
+
+    void Shutdown() {
+        if (picture_) {
+            av_frame_free(&picture_);
+        }
+        if (packet_) {
+            av_packet_free(&packet_);
+        }
+        if (codec_ctx_) {
+            avcodec_free_context(&codec_ctx_);
+        }
+    }
+
+    // Feed one Annex B access unit; pts comes back on its picture
+    bool Send(const uint8_t* data, size_t size, int64_t pts) {
+        if (!codec_ctx_ || av_new_packet(packet_, static_cast<int>(size)) < 0) {
+            return false;
+        }
+        memcpy(packet_->data, data, size);
+        packet_->pts = pts;
+        int ret = avcodec_send_packet(codec_ctx_, packet_);
+        av_packet_unref(packet_);
+        return ret >= 0;
+    }
+
+    // Next decoded picture, valid until the following call (nullptr = none yet)
+    const AVFrame* Receive() {
+        av_frame_unref(picture_);
+        return avcodec_receive_frame(codec_ctx_, picture_) == 0 ? picture_ : nullptr;
+    }
+
+private:
+    AVCodecContext* codec_ctx_;
+    AVPacket* packet_;
+    AVFrame* picture_;
+};
+
+// Decoder in the loop for closed-loop latency measurement. The replay
+// source stamps each frame with a counter (see kProbeCells) and the capture
+// thread records when it did; every access unit written to the pipe is
+// copied to a decode thread here (so decoding never delays the pipe writer)
+// and decoded with libavcodec's software H.264 decoder, and the counter read
+// back from the luma plane. The difference is the latency from capture to a
+// decoded picture, including conversion, encoding, queueing and pacing.
+// Counter gaps are frames that never reached the client (superseded in the
+// mailbox, shed, lost to a reconnect), repeats are re-sent frames.
+class LatencyProbe {
+public:
+    LatencyProbe()
+        : stopping_(false)
+        , source_width_(0)
+        , source_height_(0)
+        , last_counter_(0)
+        , has_last_(false)
+        , frames_(0)
+        , dropped_(0)
+        , duplicated_(0)
+        , unreadable_(0)
+        , latency_us_(0)
+        , latency_total_us_(0)
+        , latency_max_us_(0) {
+        for (int i = 0; i < kProbeHistory; ++i) {
+            captured_counter_[i] = 0;
+            captured_us_[i] = 0;
+        }
+    }
+
+    bool Initialize(int source_width, int source_height) {
+        if (ProbeCellSize(source_width) < kProbeMinCell || source_height < kProbeMinCell) {
+            std::cerr << "Latency probe: source is too small for the counter pattern" << std::endl;
+            return false;
+        }
+        source_width_ = source_width;
+        source_height_ = source_height;
+        if (!decoder_.Initialize()) {
+            return false;
+        }
+        decode_thread_ = std::thread(&LatencyProbe::DecodeLoop, this);
+        return true;
+    }
+
+    ~LatencyProbe() {
+        Shutdown();
+    }
+
+    // Decodes what is still queued, then stops the decode thread
+    void Shutdown() {
+        if (decode_thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            decode_thread_.join();
+        }
+    }
+
+    // Capture thread: the replay source has stamped `counter`
+    void MarkCaptured(uint32_t counter) {
+        int slot = static_cast<int>(counter % kProbeHistory);
+        captured_us_[slot] = NowUs();
+        captured_counter_[slot] = counter;
+    }
+
+    // Pipe thread: hand a copy of one written access unit to the decode thread
+    void Submit(const uint8_t* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            units_.emplace_back(data, data + size);
+        }
+        wake_.notify_one();
+    }
+
+    uint64_t frames() const { return frames_; }
+    uint64_t dropped() const { return dropped_; }
+    uint64_t duplicated() const { return duplicated_; }
+    uint64_t unreadable() const { return unreadable_; }
+    uint64_t latency_us() const { return latency_us_; }
+    uint64_t latency_avg_us() const { return frames_ ? latency_total_us_ / frames_ : 0; }
+    uint64_t latency_max_us() const { return latency_max_us_; }
+
+private:
+    static uint64_t NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Decode each access unit as the client would
+    void DecodeLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] { return stopping_ || !units_.empty(); });
+            if (units_.empty()) {
+                break;  // Stopping and drained
+            }
+            std::vector<uint8_t> unit = std::move(units_.front());
+            units_.pop_front();
+            lock.unlock();
+
+            if (decoder_.Send(unit.data(), unit.size(), AV_NOPTS_VALUE)) {
+                while (const AVFrame* picture = decoder_.Receive()) {
+                    OnPicture(*picture);
+                }
+            } else {
+                unreadable_++;
+            }
+
+            lock.lock();
+        }
+    }
+
+    void OnPicture(const AVFrame& picture) {
+        uint64_t decoded_us = NowUs();
+        uint32_t counter = 0;
+        if (!ReadCounter(picture, &counter)) {
+            unreadable_++;
+            return;
+        }
+
+        if (has_last_ && counter == last_counter_) {
+            duplicated_++;
+        } else if (has_last_ && counter > last_counter_) {
+            dropped_ += counter - last_counter_ - 1;
+        }
+        last_counter_ = counter;
+        has_last_ = true;
+
+        int slot = static_cast<int>(counter % kProbeHistory);
+        if (captured_counter_[slot] != counter || captured_us_[slot] == 0) {
+            return;  // Capture time already overwritten
+        }
+        uint64_t latency = decoded_us - captured_us_[slot];
+        latency_us_ = latency;
+        latency_total_us_ += latency;
+        if (latency > latency_max_us_) {
+            latency_max_us_ = latency;
+        }
+        frames_++;
+    }
+
+    // Locate the source's pattern in the picture (scaled and letterboxed like
+    // the converter does) and threshold the middle of each cell
+    bool ReadCounter(const AVFrame& picture, uint32_t* counter) const {
+        if (!picture.data[0] || picture.width <= 0 || picture.height <= 0) {
+            return false;
+        }
+        RECT dst = ComputeLetterboxRect(source_width_, source_height_, picture.width, picture.height);
+        double scale = static_cast<double>(dst.right - dst.left) / source_width_;
+        double cell = ProbeCellSize(source_width_) * scale;
+        int sample = static_cast<int>(cell / 2);
+        if (sample < 2) {
+            return false;  // Scaled below what survives chroma subsampling and blocking
+        }
+
+        uint32_t value = 0;
+        for (int i = 0; i < kProbeCells; ++i) {
+            int x0 = dst.left + static_cast<int>((i + 0.25) * cell);
+            int y0 = dst.top + static_cast<int>(0.25 * cell);
+            uint32_t sum = 0;
+            for (int y = y0; y < y0 + sample; ++y) {
+                const uint8_t* row = picture.data[0] + static_cast<ptrdiff_t>(y) * picture.linesize[0];
+                for (int x = x0; x < x0 + sample; ++x) {
+                    sum += row[x];
+                }
+            }
+            bool white = sum / (sample * sample) >= 128;
+            if ((i == 0 && !white) || (i == 1 && white)) {
+                return false;  // Markers missing: not a stamped frame
+            }
+            if (i >= 2) {
+                value = (value << 1) | (white ? 1u : 0u);
+            }
+        }
+        *counter = value;
+        return true;
+    }
+
+    H264Decoder decoder_;                   // Decode thread only
+    std::thread decode_thread_;
+    std::mutex mutex_;                      // Protects units_ and stopping_
+    std::condition_variable wake_;
+    std::deque<std::vector<uint8_t>> units_; // Written access units not decoded yet
+    bool stopping_;
+    int source_width_;                      // Frame size the pattern was drawn at
+    int source_height_;
+    uint32_t last_counter_;                 // Last counter read back
+    bool has_last_;
+    std::atomic<uint32_t> captured_counter_[kProbeHistory];  // Counter stamped in each slot
+    std::atomic<uint64_t> captured_us_[kProbeHistory];       // When it was captured
+    std::atomic<uint64_t> frames_;          // Pictures with a measured latency
+    std::atomic<uint64_t> dropped_;         // Counters that never decoded
+    std::atomic<uint64_t> duplicated_;      // Counters decoded again
+    std::atomic<uint64_t> unreadable_;      // Undecodable access units or unstamped pictures
+    std::atomic<uint64_t> latency_us_;      // Latest capture-to-decoded latency
+    std::atomic<uint64_t> latency_total_us_;
+    std::atomic<uint64_t> latency_max_us_;
+};
+
+// Records a session for offline reproduction: the frames fed to the
+// converter as a sparse dump (only the changed rectangles of each frame, see
+// kDumpMagic) that the replay source plays back directly, plus the emitted
+// bitstream (Annex B) and a per-access-unit timing track.
+//
+// Frames are read back through a small ring of staging textures so the
+// capture thread never waits on the GPU, and all file writes happen on a
+// writer thread behind a bounded queue. When the queue backs up a frame is
+// dropped and the next one is written whole; the bitstream skips to the next
+// IDR. Recording stops once max_bytes have been written.
+class CaptureRecorder {
+public:
+    CaptureRecorder()
+        : max_bytes_(0)
+        , written_bytes_(0)
+        , queued_bytes_(0)
+        , stopping_(false)
+        , limit_reached_(false)
+        , frame_width_(0)
+        , frame_height_(0)
+        , frames_enabled_(true)
+        , need_full_frame_(true)
+        , awaiting_keyframe_(true)
+        , next_slot_(0)
+        , frames_recorded_(0)
+        , frames_dropped_(0)
+        , units_recorded_(0) {
+        for (HANDLE& file : files_) {
+            file = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    ~CaptureRecorder() {
+        Shutdown();
+    }
+
+    // Creates <base>.scd (frame dump), <base>.h264 and <base>.timing.txt
+    bool Open(const std::wstring& base_path, uint64_t max_bytes) {
+        static const wchar_t* kExtensions[kFileCount] = { L".scd", L".h264", L".timing.txt" };
+        for (int i = 0; i < kFileCount; ++i) {
+            std::wstring path = base_path + kExtensions[i];
+            files_[i] = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                                    CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (files_[i] == INVALID_HANDLE_VALUE) {
+                std::wcerr << L"Failed to create " << path << L". Error: " << GetLastError() << std::endl;
+                Shutdown();
+                return false;
+            }
+        }
+
+        max_bytes_ = max_bytes;
+        writer_ = std::thread(&CaptureRecorder::WriterLoop, this);
+        std::wcout << L"Recording to " << base_path << L".* (limit "
+                   << (max_bytes_ >> 20) << L" MB)" << std::endl;
+        return true;
+    }
+
+    // Drains pending readbacks and queued writes, then closes the files
+    void Shutdown() {
+        ReleaseDevice();
+        if (writer_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_one();
+            writer_.join();
+            std::cout << "Recording stopped: " << frames_recorded_ << " frames ("
+                      << frames_dropped_ << " dropped), " << units_recorded_
+                      << " access units, " << (written_bytes_ >> 20) << " MB" << std::endl;
+        }
+        for (HANDLE& file : files_) {
+            if (file != INVALID_HANDLE_VALUE) {
+                CloseHandle(file);
+                file = INVALID_HANDLE_VALUE;
+            }
+        }
+    }
+
+    // Queue a readback of `texture`. full: the whole frame changed; otherwise
+    // only `rects` (texture coordinates) changed since the previous frame.
+    void RecordFrame(ID3D11DeviceContext* context, ID3D11Texture2D* texture,
+                     bool full, const std::vector<RECT>& rects, uint64_t timestamp) {
+        if (!frames_enabled_ || limit_reached_) {
+            return;
+        }
+
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+        if (desc.Format != DXGI_FORMAT_B8G8R8A8_UNORM) {
+            std::cout << "Frame dump only supports BGRA sources, recording bitstream only" << std::endl;
+            frames_enabled_ = false;
+            return;
+        }
+        if (frame_width_ == 0) {
+            frame_width_ = static_cast<int>(desc.Width);
+            frame_height_ = static_cast<int>(desc.Height);
+            std::vector<uint8_t> header(kDumpMagic, kDumpMagic + sizeof(kDumpMagic));
+            AppendLE(header, static_cast<uint64_t>(frame_width_), 4);
+            AppendLE(header, static_cast<uint64_t>(frame_height_), 4);
+            Enqueue(kFrames, std::move(header), false);
+        } else if (static_cast<int>(desc.Width) != frame_width_ ||
+                   static_cast<int>(desc.Height) != frame_height_) {
+            // A dump has one frame size; keep the bitstream going
+            std::cout << "Capture size changed, frame dump stopped" << std::endl;
+            frames_enabled_ = false;
+            ReleaseDevice();
+            return;
+        }
+
+        // Oldest slot first: it was copied kSlots-1 frames ago, so mapping it rarely waits
+        Slot& slot = slots_[next_slot_];
+        next_slot_ = (next_slot_ + 1) % kSlots;
+        if (slot.pending) {
+            CollectSlot(context, slot);
+        }
+        if (!slot.texture) {
+            ID3D11Device* device = nullptr;
+            texture->GetDevice(&device);
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.BindFlags = 0;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            desc.MiscFlags = 0;
+            HRESULT hr = device->CreateTexture2D(&desc, nullptr, &slot.texture);
+            device->Release();
+            if (FAILED(hr)) {
+                std::cerr << "Failed to create recorder staging texture: 0x" << std::hex << hr << std::dec << std::endl;
+                frames_enabled_ = false;
+                return;
+            }
+        }
+
+        // The whole frame is copied so a dropped frame can be followed by a full one
+        context->CopyResource(slot.texture, texture);
+        slot.full = full;
+        slot.rects = rects;
+        slot.timestamp = timestamp;
+        slot.pending = true;
+    }
+
+    void RecordBitstream(const EncodedFrame& frame) {
+        if (limit_reached_ || frame.is_cursor || frame.is_audio) {
+            return;
+        }
+        if (awaiting_keyframe_) {
+            if (!frame.is_keyframe) {
+                return;
+            }
+            awaiting_keyframe_ = false;
+        }
+
+        std::string timing = std::to_string(frame.timestamp) + " " + std::to_string(frame.data.size()) +
+                             (frame.is_keyframe ? " 1\n" : " 0\n");
+        if (!Enqueue(kBitstream, std::vector<uint8_t>(frame.data), false)) {
+            awaiting_keyframe_ = true;
+            return;
+        }
+        Enqueue(kTiming, std::vector<uint8_t>(timing.begin(), timing.end()), false);
+        ++units_recorded_;
+    }
+
+    // Staging textures belong to the device; collect what is in flight first
+    void ReleaseDevice() {
+        for (Slot& slot : slots_) {
+            if (slot.texture) {
+                if (slot.pending) {
+                    ID3D11DeviceContext* context = nullptr;
+                    ID3D11Device* device = nullptr;
+                    slot.texture->GetDevice(&device);
+                    device->GetImmediateContext(&context);
+                    device->Release();
+                    CollectSlot(context, slot);
+                    context->Release();
+                }
+                slot.texture->Release();
+                slot.texture = nullptr;
+            }
+            slot.pending = false;
+        }
+        next_slot_ = 0;
+        need_full_frame_ = true;
+    }
+
+private:
+    enum { kFrames, kBitstream, kTiming, kFileCount };
+    static const int kSlots = 3;                         // Readback latency in frames
+    static const size_t kMaxQueuedBytes = 256u << 20;    // Writer backlog before frames drop
+
+    struct Slot {
+        ID3D11Texture2D* texture;
+        bool pending;
+        bool full;
+        std::vector<RECT> rects;
+        uint64_t timestamp;
+
+        Slot() : texture(nullptr), pending(false), full(false), timestamp(0) {}
+    };
+
+    struct Chunk {
+        int file;
+        std::vector<uint8_t> data;
+    };
+
+    // Frame record: [8: timestamp_us] [4: rect count] [count * 16: left, top, right, bottom]
+    //               [BGRA pixels of each rect, rows packed, in rect order]
+    void CollectSlot(ID3D11DeviceContext* context, Slot& slot) {
+        slot.pending = false;
+
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        HRESULT hr = context->Map(slot.texture, 0, D3D11_MAP_READ, 0, &mapped);
+        if (FAILED(hr)) {
+            need_full_frame_ = true;
+            ++frames_dropped_;
+            return;
+        }
+
+        std::vector<RECT> full_frame(1, RECT{ 0, 0, frame_width_, frame_height_ });
+        bool write_full = slot.full || need_full_frame_;
+        const std::vector<RECT>& rects = write_full ? full_frame : slot.rects;
+
+        size_t pixel_bytes = 0;
+        for (const RECT& rect : rects) {
+            pixel_bytes += static_cast<size_t>(rect.right - rect.left) * (rect.bottom - rect.top) * 4;
+        }
+        std::vector<uint8_t> record;
+        record.reserve(12 + rects.size() * 16 + pixel_bytes);
+        AppendLE(record, slot.timestamp, 8);
+        AppendLE(record, rects.size(), 4);
+        for (const RECT& rect : rects) {
+            AppendLE(record, static_cast<uint32_t>(rect.left), 4);
+            AppendLE(record, static_cast<uint32_t>(rect.top), 4);
+            AppendLE(record, static_cast<uint32_t>(rect.right), 4);
+            AppendLE(record, static_cast<uint32_t>(rect.bottom), 4);
+        }
+        const uint8_t* pixels = static_cast<const uint8_t*>(mapped.pData);
+        for (const RECT& rect : rects) {
+            size_t row_bytes = static_cast<size_t>(rect.right - rect.left) * 4;
+            for (int y = rect.top; y < rect.bottom; ++y) {
+                const uint8_t* row = pixels + y * mapped.RowPitch + rect.left * 4;
+                record.insert(record.end(), row, row + row_bytes);
+            }
+        }
+        context->Unmap(slot.texture, 0);
+
+        if (Enqueue(kFrames, std::move(record), true)) {
+            need_full_frame_ = false;
+            ++frames_recorded_;
+        } else {
+            need_full_frame_ = true;  // The next record cannot be a delta on a missing one
+            ++frames_dropped_;
+        }
+    }
+
+    bool Enqueue(int file, std::vector<uint8_t>&& data, bool droppable) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (limit_reached_) {
+                return false;
+            }
+            if (written_bytes_ + queued_bytes_ + data.size() > max_bytes_) {
+                std::cout << "Recording limit reached" << std::endl;
+                limit_reached_ = true;
+                return false;
+            }
+            if (droppable && queued_bytes_ + data.size() > kMaxQueuedBytes) {
+                return false;
+            }
+            queued_bytes_ += data.size();
+            chunks_.push_back(Chunk{ file, std::move(data) });
+        }
+        wake_.notify_one();
+        return true;
+    }
+
+    void WriterLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] { return stopping_ || !chunks_.empty(); });
+            if (chunks_.empty()) {
+                break;  // Stopping and drained
+            }
+            Chunk chunk = std::move(chunks_.front());
+            chunks_.pop_front();
+            lock.unlock();
+
+            DWORD bytes_written = 0;
+            if (!WriteFile(files_[chunk.file], chunk.data.data(), static_cast<DWORD>(chunk.data.size()),
+                           &bytes_written, nullptr)) {
+                std::cerr << "Recorder write failed. Error: " << GetLastError() << std::endl;
+            }
+
+            lock.lock();
+            queued_bytes_ -= chunk.data.size();
+            written_bytes_ += bytes_written;
+        }
+    }
+
+    HANDLE files_[kFileCount];
+    std::thread writer_;
+    std::mutex mutex_;                       // Protects everything down to limit_reached_
+    std::condition_variable wake_;
+    std::deque<Chunk> chunks_;
+    uint64_t max_bytes_;
+    uint64_t written_bytes_;
+    uint64_t queued_bytes_;
+    bool stopping_;
+    std::atomic<bool> limit_reached_;        // Also read without the lock as a fast path
+    int frame_width_;                        // Dump frame size (fixed for one recording)
+    int frame_height_;
+    bool frames_enabled_;
+    bool need_full_frame_;                   // Next frame record must cover the whole frame
+    bool awaiting_keyframe_;                 // Bitstream resumes at the next IDR
+    Slot slots_[kSlots];
+    int next_slot_;
+    uint64_t frames_recorded_;
+    uint64_t frames_dropped_;
+    uint64_t units_recorded_;
+};
+
+// Finds scrolled areas that duplication reports only as dirty rects (browsers
+// and terminals rarely produce move rects). A CPU shadow of the capture region
+// is kept current from each frame's changed rectangles; before a large
+// changed rectangle is copied in, it is compared with the shadow using one
+// hash per row (vertical scroll) and per column (horizontal scroll). The
+// shift most rows agree on, if enough of the rectangle matches under it,
+// becomes a move rect.
+//
+// The changed rectangles are read back synchronously, so the cost follows
+// the amount of change; flat rows and columns (one color) match any shift and
+// do not vote. NV12 frames (YUV replay) are compared on luma alone.
+class ScrollDetector {
+public:
+    ScrollDetector()
+        : staging_(nullptr)
+        , format_(DXGI_FORMAT_UNKNOWN)
+        , width_(0)
+        , height_(0)
+        , shadow_valid_(false) {
+    }
+
+    ~ScrollDetector() {
+        ReleaseDevice();
+    }
+
+    // Bring the shadow up to date with texture (capture region coordinates)
+    // and append the shifts found inside the changed rectangles to moves.
+    // Rectangles in skip already have a move rect from duplication.
+    void Analyze(ID3D11DeviceContext* context, ID3D11Texture2D* texture, bool full,
+                 const std::vector<RECT>& changed, const std::vector<RECT>& skip,
+                 std::vector<DXGI_OUTDUPL_MOVE_RECT>& moves) {
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+        if (desc.Format != DXGI_FORMAT_B8G8R8A8_UNORM && desc.Format != DXGI_FORMAT_NV12) {
+            return;
+        }
+        if (!staging_ || desc.Format != format_ ||
+            static_cast<int>(desc.Width) != width_ || static_cast<int>(desc.Height) != height_) {
+            ReleaseDevice();
+            ID3D11Device* device = nullptr;
+            texture->GetDevice(&device);
+            desc.MipLevels = 1;
+            desc.ArraySize = 1;
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.BindFlags = 0;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            desc.MiscFlags = 0;
+            HRESULT hr = device->CreateTexture2D(&desc, nullptr, &staging_);
+            device->Release();
+            if (FAILED(hr)) {
+                std::cerr << "Failed to create scroll detector staging texture: 0x" << std::hex << hr << std::dec << std::endl;
+                return;
+            }
+            format_ = desc.Format;
+            width_ = static_cast<int>(desc.Width);
+            height_ = static_cast<int>(desc.Height);
+            shadow_.assign(static_cast<size_t>(width_) * height_, 0);
+            if (format_ == DXGI_FORMAT_NV12) {
+                luma_.assign(static_cast<size_t>(width_) * height_, 0);
+            }
+        }
+
+        std::vector<RECT> full_frame(1, RECT{ 0, 0, width_, height_ });
+        bool copy_full = full || !shadow_valid_;
+        const std::vector<RECT>& rects = copy_full ? full_frame : changed;
+        if (rects.empty()) {
+            return;
+        }
+        if (copy_full) {
+            context->CopyResource(staging_, texture);
+        } else {
+            for (RECT rect : rects) {
+                if (format_ == DXGI_FORMAT_NV12) {
+                    // NV12 copies must cover whole 2x2 chroma blocks
+                    rect.left &= ~1;
+                    rect.top &= ~1;
+                    rect.right = (std::min)(width_, (rect.right + 1) & ~1);
+                    rect.bottom = (std::min)(height_, (rect.bottom + 1) & ~1);
+                }
+                D3D11_BOX box = { static_cast<UINT>(rect.left), static_cast<UINT>(rect.top), 0,
+                                  static_cast<UINT>(rect.right), static_cast<UINT>(rect.bottom), 1 };
+                context->CopySubresourceRegion(staging_, 0, rect.left, rect.top, 0, texture, 0, &box);
+            }
+        }
+
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        if (FAILED(context->Map(staging_, 0, D3D11_MAP_READ, 0, &mapped))) {
+            shadow_valid_ = false;
+            return;
+        }
+        const uint8_t* pixels = static_cast<const uint8_t*>(mapped.pData);
+        UINT pitch = mapped.RowPitch;
+        if (format_ == DXGI_FORMAT_NV12) {
+            // Widen the luma plane to one word per pixel so both formats share the hashing
+            for (const RECT& rect : rects) {
+                for (int y = rect.top; y < rect.bottom; ++y) {
+                    const uint8_t* row = pixels + y * mapped.RowPitch;
+                    uint32_t* out = &luma_[static_cast<size_t>(y) * width_];
+                    for (int x = rect.left; x < rect.right; ++x) {
+                        out[x] = row[x];
+                    }
+                }
+            }
+            pixels = reinterpret_cast<const uint8_t*>(luma_.data());
+            pitch = static_cast<UINT>(width_) * 4;
+        }
+
+        if (shadow_valid_) {
+            for (const RECT& rect : rects) {
+                bool described = false;
+                for (const RECT& known : skip) {
+                    described = described || EqualRect(&known, &rect);
+                }
+                if (!described && rect.right - rect.left >= kMinScrollSize &&
+                    rect.bottom - rect.top >= kMinScrollSize) {
+                    DetectShift(pixels, pitch, rect, moves);
+                }
+            }
+        }
+
+        for (const RECT& rect : rects) {
+            size_t row_bytes = static_cast<size_t>(rect.right - rect.left) * 4;
+            for (int y = rect.top; y < rect.bottom; ++y) {
+                memcpy(&shadow_[static_cast<size_t>(y) * width_ + rect.left],
+                       pixels + y * pitch + rect.left * 4, row_bytes);
+            }
+        }
+        context->Unmap(staging_, 0);
+        shadow_valid_ = true;
+    }
+
+    // Device objects go with the device; the next frame refills the shadow
+    void ReleaseDevice() {
+        if (staging_) {
+            staging_->Release();
+            staging_ = nullptr;
+        }
+        shadow_valid_ = false;
+    }
+
+    // The region moved: the shadow shows other pixels and would read as a shift
+    void Invalidate() {
+        shadow_valid_ = false;
+    }
+
+private:
+    static const int kMinScrollSize = 64;   // Smaller rectangles are not worth a readback pass
+    static const int kMinVotes = 8;         // Distinct rows that must agree on a shift
+
+    // FNV-1a over whole pixels; 0 marks a flat line
+    static const uint64_t kHashBasis = 1469598103934665603ULL;
+    static const uint64_t kHashPrime = 1099511628211ULL;
+
+    static uint64_t FinishHash(uint64_t hash, bool flat) {
+        if (flat) {
+            return 0;
+        }
+        return hash == 0 ? 1 : hash;
+    }
+
+    void DetectShift(const uint8_t* pixels, UINT pitch, const RECT& rect,
+                     std::vector<DXGI_OUTDUPL_MOVE_RECT>& moves) {
+        int w = rect.right - rect.left;
+        int h = rect.bottom - rect.top;
+
+        // Row hashes, before (shadow) and after (frame)
+        std::vector<uint64_t> old_rows(h), new_rows(h);
+        for (int y = 0; y < h; ++y) {
+            const uint32_t* old_row = &shadow_[static_cast<size_t>(rect.top + y) * width_ + rect.left];
+            const uint32_t* new_row = reinterpret_cast<const uint32_t*>(
+                pixels + (rect.top + y) * pitch) + rect.left;
+            uint64_t old_hash = kHashBasis, new_hash = kHashBasis;
+            bool old_flat = true, new_flat = true;
+            for (int x = 0; x < w; ++x) {
+                old_hash = (old_hash ^ old_row[x]) * kHashPrime;
+                new_hash = (new_hash ^ new_row[x]) * kHashPrime;
+                old_flat = old_flat && old_row[x] == old_row[0];
+                new_flat = new_flat && new_row[x] == new_row[0];
+            }
+            old_rows[y] = FinishHash(old_hash, old_flat);
+            new_rows[y] = FinishHash(new_hash, new_flat);
+        }
+
+        int begin = 0, end = 0;
+        int dy = BestShift(old_rows, new_rows, &begin, &end);
+        if (dy != 0) {
+            DXGI_OUTDUPL_MOVE_RECT move = {};
+            move.SourcePoint = { rect.left, rect.top + begin - dy };
+            move.DestinationRect = { rect.left, rect.top + begin, rect.right, rect.top + end };
+            moves.push_back(move);
+            return;
+        }
+
+        // Column hashes, accumulated row by row to stay in cache order
+        std::vector<uint64_t> old_cols(w, kHashBasis), new_cols(w, kHashBasis);
+        std::vector<uint32_t> old_first(w), new_first(w);
+        std::vector<char> old_flat(w, 1), new_flat(w, 1);
+        for (int y = 0; y < h; ++y) {
+            const uint32_t* old_row = &shadow_[static_cast<size_t>(rect.top + y) * width_ + rect.left];
+            const uint32_t* new_row = reinterpret_cast<const uint32_t*>(
+                pixels + (rect.top + y) * pitch) + rect.left;
+            for (int x = 0; x < w; ++x) {
+                if (y == 0) {
+                    old_first[x] = old_row[x];
+                    new_first[x] = new_row[x];
+                }
+                old_cols[x] = (old_cols[x] ^ old_row[x]) * kHashPrime;
+                new_cols[x] = (new_cols[x] ^ new_row[x]) * kHashPrime;
+                old_flat[x] &= old_row[x] == old_first[x];
+                new_flat[x] &= new_row[x] == new_first[x];
+            }
+        }
+        for (int x = 0; x < w; ++x) {
+            old_cols[x] = FinishHash(old_cols[x], old_flat[x] != 0);
+            new_cols[x] = FinishHash(new_cols[x], new_flat[x] != 0);
+        }
+
+        int dx = BestShift(old_cols, new_cols, &begin, &end);
+        if (dx != 0) {
+            DXGI_OUTDUPL_MOVE_RECT move = {};
+            move.SourcePoint = { rect.left + begin - dx, rect.top };
+            move.DestinationRect = { rect.left + begin, rect.top, rect.left + end, rect.bottom };
+            moves.push_back(move);
+        }
+    }
+
+    // The shift d with after[i] == before[i - d] for most lines, or 0. Each
+    // non-flat line votes with the position of its unique match; the winner
+    // must then hold for three quarters of the overlap [begin, end).
+    static int BestShift(const std::vector<uint64_t>& before, const std::vector<uint64_t>& after,
+                         int* begin, int* end) {
+        int count = static_cast<int>(before.size());
+        std::unordered_map<uint64_t, int> index;
+        for (int i = 0; i < count; ++i) {
+            if (before[i] != 0) {
+                auto entry = index.emplace(before[i], i);
+                if (!entry.second) {
+                    entry.first->second = -1;  // Repeated line, ambiguous
+                }
+            }
+        }
+
+        std::unordered_map<int, int> votes;
+        int voters = 0;
+        for (int i = 0; i < count; ++i) {
+            if (after[i] == 0) {
+                continue;
+            }
+            ++voters;
+            auto match = index.find(after[i]);
+            if (match != index.end() && match->second >= 0 && match->second != i) {
+                ++votes[i - match->second];
+            }
+        }
+
+        int shift = 0, best = 0;
+        for (const auto& vote : votes) {
+            if (vote.second > best) {
+                shift = vote.first;
+                best = vote.second;
+            }
+        }
+        if (best < kMinVotes || best * 3 < voters) {
+            return 0;
+        }
+
+        *begin = (std::max)(0, shift);
+        *end = count + (std::min)(0, shift);
+        int matched = 0;
+        for (int i = *begin; i < *end; ++i) {
+            matched += after[i] == before[i - shift] ? 1 : 0;
+        }
+        if (*end - *begin < kMinScrollSize / 2 || matched * 4 < (*end - *begin) * 3) {
+            return 0;
+        }
+        return shift;
+    }
+
+    ID3D11Texture2D* staging_;               // CPU-readable copy of the changed rectangles
+    DXGI_FORMAT format_;                     // BGRA, or NV12 (luma only)
+    int width_;                              // Capture region size the shadow was built for
+    int height_;
+    std::vector<uint32_t> shadow_;           // Previous frame, BGRA or luma per word
+    std::vector<uint32_t> luma_;             // NV12: current frame's luma, widened like the shadow
+    bool shadow_valid_;                      // Shadow holds the previous frame
+};
+
+// Estimates each frame's complexity ahead of encoding and spots scene cuts.
+// Works on a 1/8-scale luma plane: BGRA frames are reduced on the GPU (mip
+// chain) and only the small level is read back; NV12 frames read back the
+// luma plane and box-filter it on the CPU. Spatial complexity is the mean
+// absolute neighbour gradient, temporal complexity the mean absolute
+// difference to the previous frame. A scene cut needs a temporal spike over
+// the running average and a changed luma histogram, so fast motion over
+// the same content does not count.
+class FrameAnalyzer {
+public:
+    FrameAnalyzer()
+        : mip_texture_(nullptr)
+        , mip_view_(nullptr)
+        , staging_(nullptr)
+        , frame_width_(0)
+        , frame_height_(0)
+        , frame_format_(DXGI_FORMAT_UNKNOWN)
+        , width_(0)
+        , height_(0)
+        , previous_histogram_()
+        , has_previous_(false)
+        , average_temporal_(0.0)
+        , spatial_(0.0)
+        , temporal_(0.0)
+        , scene_cut_(false) {
+    }
+
+    ~FrameAnalyzer() {
+        ReleaseDevice();
+    }
+
+    // Measure texture against the previous analysed frame (waits for the GPU)
+    bool Analyze(ID3D11DeviceContext* context, ID3D11Texture2D* texture) {
+        D3D11_TEXTURE2D_DESC desc = {};
+        texture->GetDesc(&desc);
+        if (static_cast<int>(desc.Width) != frame_width_ || static_cast<int>(desc.Height) != frame_height_ ||
+            desc.Format != frame_format_) {
+            ReleaseDevice();
+            if (!CreateResources(texture, desc)) {
+                ReleaseDevice();
+                return false;
+            }
+        }
+
+        scene_cut_ = false;
+        if (!ReadLuma(context, texture)) {
+            return false;
+        }
+        Measure();
+        return true;
+    }
+
+    double spatial() const { return spatial_; }
+    double temporal() const { return temporal_; }
+    bool scene_cut() const { return scene_cut_; }
+
+    // Device objects go with the device; the next frame starts a new history
+    void ReleaseDevice() {
+        if (mip_view_) {
+            mip_view_->Release();
+            mip_view_ = nullptr;
+        }
+        if (mip_texture_) {
+            mip_texture_->Release();
+            mip_texture_ = nullptr;
+        }
+        if (staging_) {
+            staging_->Release();
+            staging_ = nullptr;
+        }
+        frame_width_ = 0;
+        frame_height_ = 0;
+        frame_format_ = DXGI_FORMAT_UNKNOWN;
+        has_previous_ = false;
+        average_temporal_ = 0.0;
+    }
+
+private:
+    static const int kScale = 8;                 // Analysis plane is 1/kScale per dimension
+    static const int kMipLevel = 3;              // 2^kMipLevel == kScale
+    static const int kHistogramBins = 32;
+
+    // Scene cut thresholds (luma levels per pixel, histogram share)
+    static constexpr double kCutMinDifference = 12.0;
+    static constexpr double kCutRatio = 3.0;     // Over the running temporal average
+    static constexpr double kCutHistogramChange = 0.25;
+
+    bool CreateResources(ID3D11Texture2D* texture, const D3D11_TEXTURE2D_DESC& frame_desc) {
+        if (frame_desc.Width < 2 * kScale || frame_desc.Height < 2 * kScale ||
+            (frame_desc.Format != DXGI_FORMAT_B8G8R8A8_UNORM && frame_desc.Format != DXGI_FORMAT_NV12)) {
+            return false;
+        }
+        ID3D11Device* device = nullptr;
+        texture->GetDevice(&device);
+
+        D3D11_TEXTURE2D_DESC desc = frame_desc;
+        desc.ArraySize = 1;
+        desc.SampleDesc.Count = 1;
+        desc.SampleDesc.Quality = 0;
+        HRESULT hr = S_OK;
+        if (frame_desc.Format == DXGI_FORMAT_B8G8R8A8_UNORM) {
+            desc.MipLevels = kMipLevel + 1;
+            desc.Usage = D3D11_USAGE_DEFAULT;
+            desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+            desc.CPUAccessFlags = 0;
+            desc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
+            hr = device->CreateTexture2D(&desc, nullptr, &mip_texture_);
+            if (SUCCEEDED(hr)) {
+                hr = device->CreateShaderResourceView(mip_texture_, nullptr, &mip_view_);
+            }
+            desc.Width = (std::max)(1u, frame_desc.Width >> kMipLevel);
+            desc.Height = (std::max)(1u, frame_desc.Height >> kMipLevel);
+        }
+        if (SUCCEEDED(hr)) {
+            // Small mip level (BGRA) or the whole frame (NV12)
+            desc.MipLevels = 1;
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.BindFlags = 0;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            desc.MiscFlags = 0;
+            hr = device->CreateTexture2D(&desc, nullptr, &staging_);
+        }
+        device->Release();
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create pre-analysis textures: 0x" << std::hex << hr << std::dec << std::endl;
+            return false;
+        }
+
+        frame_width_ = static_cast<int>(frame_desc.Width);
+        frame_height_ = static_cast<int>(frame_desc.Height);
+        frame_format_ = frame_desc.Format;
+        width_ = frame_width_ / kScale;
+        height_ = frame_height_ / kScale;
+        luma_.assign(static_cast<size_t>(width_) * height_, 0);
+        previous_.assign(luma_.size(), 0);
+        return true;
+    }
+
+    bool ReadLuma(ID3D11DeviceContext* context, ID3D11Texture2D* texture) {
+        if (frame_format_ == DXGI_FORMAT_B8G8R8A8_UNORM) {
+            context->CopySubresourceRegion(mip_texture_, 0, 0, 0, 0, texture, 0, nullptr);
+            context->GenerateMips(mip_view_);
+            context->CopySubresourceRegion(staging_, 0, 0, 0, 0, mip_texture_, kMipLevel, nullptr);
+        } else {
+            context->CopyResource(staging_, texture);
+        }
+
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        HRESULT hr = context->Map(staging_, 0, D3D11_MAP_READ, 0, &mapped);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to map pre-analysis texture: 0x" << std::hex << hr << std::dec << std::endl;
+            return false;
+        }
+        const uint8_t* pixels = static_cast<const uint8_t*>(mapped.pData);
+
+        if (frame_format_ == DXGI_FORMAT_B8G8R8A8_UNORM) {
+            // BT.601 limited range, as the video processor produces
+            for (int y = 0; y < height_; ++y) {
+                const uint8_t* row = pixels + y * mapped.RowPitch;
+                uint8_t* out = &luma_[static_cast<size_t>(y) * width_];
+                for (int x = 0; x < width_; ++x) {
+                    const uint8_t* bgra = row + x * 4;
+                    out[x] = static_cast<uint8_t>(((66 * bgra[2] + 129 * bgra[1] + 25 * bgra[0] + 128) >> 8) + 16);
+                }
+            }
+        } else {
+            // 8x8 box filter over the luma plane
+            std::vector<uint32_t> sums(width_);
+            for (int y = 0; y < height_; ++y) {
+                std::fill(sums.begin(), sums.end(), 0u);
+                for (int row = 0; row < kScale; ++row) {
+                    SumGroupsOf8(pixels + (y * kScale + row) * mapped.RowPitch, width_, sums.data());
+                }
+                uint8_t* out = &luma_[static_cast<size_t>(y) * width_];
+                for (int x = 0; x < width_; ++x) {
+                    out[x] = static_cast<uint8_t>((sums[x] + kScale * kScale / 2) / (kScale * kScale));
+                }
+            }
+        }
+        context->Unmap(staging_, 0);
+        return true;
+    }
+
+    void Measure() {
+        size_t pixels = luma_.size();
+
+        uint64_t gradient = 0;
+        uint64_t gradient_count = 0;
+        for (int y = 0; y < height_; ++y) {
+            const uint8_t* row = &luma_[static_cast<size_t>(y) * width_];
+            gradient += SumAbsDiff(row, row + 1, width_ - 1);
+            gradient_count += width_ - 1;
+            if (y + 1 < height_) {
+                gradient += SumAbsDiff(row, row + width_, width_);
+                gradient_count += width_;
+            }
+        }
+        spatial_ = gradient_count ? static_cast<double>(gradient) / gradient_count : 0.0;
+
+        uint32_t histogram[kHistogramBins] = {};
+        for (uint8_t value : luma_) {
+            ++histogram[value * kHistogramBins / 256];
+        }
+
+        if (has_previous_) {
+            temporal_ = static_cast<double>(SumAbsDiff(luma_.data(), previous_.data(), static_cast<int>(pixels))) / pixels;
+            uint64_t moved = 0;
+            for (int i = 0; i < kHistogramBins; ++i) {
+                moved += histogram[i] > previous_histogram_[i] ? histogram[i] - previous_histogram_[i]
+                                                               : previous_histogram_[i] - histogram[i];
+            }
+            double histogram_change = static_cast<double>(moved) / (2.0 * pixels);
+            scene_cut_ = temporal_ > (std::max)(kCutMinDifference, kCutRatio * average_temporal_) &&
+                         histogram_change > kCutHistogramChange;
+            // A cut is not part of the scene's motion level
+            if (!scene_cut_) {
+                average_temporal_ = 0.9 * average_temporal_ + 0.1 * temporal_;
+            }
+        } else {
+            temporal_ = 0.0;
+        }
+
+        luma_.swap(previous_);
+        std::copy(histogram, histogram + kHistogramBins, previous_histogram_);
+        has_previous_ = true;
+    }
+
+    ID3D11Texture2D* mip_texture_;           // Frame copy with its mip chain (BGRA)
+    ID3D11ShaderResourceView* mip_view_;     // For GenerateMips
+    ID3D11Texture2D* staging_;               // CPU-readable small mip (BGRA) or frame (NV12)
+    int frame_width_;                        // Frame size/format the resources were made for
+    int frame_height_;
+    DXGI_FORMAT frame_format_;
+    int width_;                              // Analysis plane size
+    int height_;
+    std::vector<uint8_t> luma_;              // Current analysis plane
+    std::vector<uint8_t> previous_;          // Previous analysis plane
+    uint32_t previous_histogram_[kHistogramBins];
+    bool has_previous_;
+    double average_temporal_;                // Running temporal complexity, cuts excluded
+    double spatial_;
+    double temporal_;
+    bool scene_cut_;
+};
+
+HRESULT CreateH264Encoder(IMFTransform** out_encoder) {
+    if (!out_encoder) return E_POINTER;
+    *out_encoder = nullptr;
+
+    IMFActivate** activates = nullptr;
+    UINT32 count = 0;
+    MFT_REGISTER_TYPE_INFO out_type = { MFMediaType_Video, MFVideoFormat_H264 };
+    HRESULT hr = MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER,
+                   MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
+                   nullptr, &out_type, &activates, &count);
+    if (SUCCEEDED(hr) && count > 0) {
+        hr = activates[0]->ActivateObject(IID_PPV_ARGS(out_encoder));
+    }
+
+    for (UINT32 i = 0; i < count; ++i) {
+        activates[i]->Release();
+    }
+    CoTaskMemFree(activates);
+
+    if (SUCCEEDED(hr) && *out_encoder) {
+        return hr;
+    }
+
+    // Fallback to software encoder if no hardware MFT is available.
+    hr = CoCreateInstance(CLSID_CMSH264EncoderMFT, nullptr, CLSCTX_INPROC_SERVER,
+                          IID_PPV_ARGS(out_encoder));
+    return hr;
+}
+
+bool SetH264OutputType(IMFTransform* encoder, UINT32 width, UINT32 height, UINT32 fps) {
+    if (!encoder) return false;
+
+    IMFMediaType* type = nullptr;
+    HRESULT hr = MFCreateMediaType(&type);
+    if (FAILED(hr)) return false;
+
+    type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+    type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264);
+    type->SetUINT32(MF_MT_AVG_BITRATE, 5000000);
+    type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+    MFSetAttributeSize(type, MF_MT_FRAME_SIZE, width, height);
+    MFSetAttributeRatio(type, MF_MT_FRAME_RATE, fps, 1);
+    MFSetAttributeRatio(type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+    type->SetUINT32(MF_MT_MPEG2_PROFILE, 66); // Baseline
+
+    hr = encoder->SetOutputType(0, type, MFT_SET_TYPE_TEST_ONLY);
+    if (SUCCEEDED(hr)) {
+        hr = encoder->SetOutputType(0, type, 0);
+    }
+    type->Release();
+
+    if (FAILED(hr)) {
+        std::cerr << "SetOutputType failed: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SetH264InputType(IMFTransform* encoder, UINT32 width, UINT32 height, UINT32 fps) {
+    if (!encoder) return false;
+
+    auto try_type = [&](bool add_sample_size) -> HRESULT {
+        IMFMediaType* type = nullptr;
+        HRESULT hr = MFCreateMediaType(&type);
+        if (FAILED(hr)) return hr;
+
+        type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
+        type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+        MFSetAttributeSize(type, MF_MT_FRAME_SIZE, width, height);
+        MFSetAttributeRatio(type, MF_MT_FRAME_RATE, fps, 1);
+        MFSetAttributeRatio(type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+
+        if (add_sample_size) {
+            type->SetUINT32(MF_MT_FIXED_SIZE_SAMPLES, TRUE);
+            type->SetUINT32(MF_MT_SAMPLE_SIZE, width * height * 3 / 2);
+        }
+
+        hr = encoder->SetInputType(0, type, MFT_SET_TYPE_TEST_ONLY);
+        if (SUCCEEDED(hr)) {
+            hr = encoder->SetInputType(0, type, 0);
+        }
+        type->Release();
+        return hr;
+    };
+
+    HRESULT hr = try_type(false);
+    if (SUCCEEDED(hr)) return true;
+
+    hr = try_type(true);
+    if (SUCCEEDED(hr)) return true;
+
+    std::cerr << "SetInputType failed: 0x" << std::hex << hr << std::endl;
+    return false;
+}
+ScreenCaptureEncoder::ScreenCaptureEncoder()
+    : d3d_device_(nullptr)              // NULL until InitializeD3D11() succeeds
+    , d3d_context_(nullptr)
+    , composite_texture_(nullptr)
+    , dxgi_manager_(nullptr)
     , reset_token_(0)
     , color_converter_(nullptr)
     , ffmpeg_encoder_(nullptr)
+    , cursor_(nullptr)
+    , cursor_mode_(CursorMode::kComposite)
+    , cursor_resend_(false)
+    , replay_(nullptr)
+    , recorder_(nullptr)
+    , budget_boost_until_()
+    , frame_rects_full_(true)
+    , force_full_frame_(false)
+    , last_cursor_rect_()
     , pipe_handle_(INVALID_HANDLE_VALUE)  // Invalid handle value from Windows
+    , client_connected_(false)
+    , force_keyframe_(false)
+    , awaiting_keyframe_(true)
+    , failed_component_(PipelineComponent::kNone)
+    , encode_failed_component_(PipelineComponent::kNone)
+    , consecutive_encode_failures_(0)
+    , pending_fault_(static_cast<int>(PipelineComponent::kNone))
     , width_(1920)                         // Default 1080p width
     , height_(1080)                        // Default 1080p height
+    , encode_size_((1920ULL << 32) | 1080)
     , fps_(60)                             // Default 60 FPS
+    , source_width_(1920)
+    , source_height_(1080)
+    , duplication_width_(0)
+    , duplication_height_(0)
+    , pending_width_(0)
+    , pending_height_(0)
+    , frames_since_keyframe_(0)
+    , follow_source_resolution_(false)
+    , capture_timing_(CaptureTiming::kPoll)
+    , last_vblank_qpc_()
+    , idle_fps_(0)
+    , idle_rate_(false)
+    , has_pending_control_(false)
+    , pending_region_(false)
+    , capture_region_()
+    , active_region_()
+    , capture_window_(nullptr)
+    , pending_window_(nullptr)
+    , has_pending_window_(false)
+    , pending_record_limit_(0)
+    , has_pending_record_(false)
+    , output_origin_()
+    , region_texture_(nullptr)
+    , bitrate_(5000000)                     // 5 Mbps
+    , keyframe_interval_(0)
+    , temporal_layers_(1)
+    , frames_captured_(0)
+    , frames_encoded_(0)
+    , frames_sent_(0)
+    , frames_dropped_(0)
+    , frames_shed_(0)
+    , frames_paced_(0)
+    , pace_time_us_(0)
+    , largest_write_(0)
+    , send_delay_us_(0)
+    , send_delay_max_us_(0)
+    , send_delay_frames_(0)
+    , bytes_sent_(0)
+    , composite_frames_(0)
+    , composite_time_us_(0)
+    , frames_superseded_(0)
+    , frames_rejoined_(0)
+    , frames_repeated_(0)
+    , join_latency_us_(0)
+    , acquire_latency_us_(0)
+    , acquire_latency_frames_(0)
+    , vblank_phase_us_(0)
+    , vblank_phase_max_us_(0)
+    , vblank_phase_frames_(0)
+    , moves_duplication_(0)
+    , moves_detected_(0)
+    , motion_time_us_(0)
+    , motion_frames_(0)
+    , scene_cuts_(0)
+    , analysis_time_us_(0)
+    , analysis_frames_(0)
+    , last_spatial_(0.0)
+    , last_temporal_(0.0)
+    , frame_ring_(kFrameRingSize)
+    , mailbox_frame_(-1)
+    , held_frame_(-1)
+    , join_pending_(false)
+    , drain_pts_(-1)
     , frame_duration_(0)
     , running_(false)                      // Not running initially
+    , pace_rate_kbps_(0)
+    , pace_burst_bytes_(64 * 1024.0)
+    , pace_tokens_(64 * 1024.0)
+    , nal_filter_mask_(0)
+    , timing_sei_(false)
+    , timing_sei_sequence_(0)
+    , start_monotonic_us_(0)
+    , start_unix_us_(0)
+    , latency_probe_enabled_(false)
+    , sweep_mode_(false)
+    , sweep_staging_(nullptr)
+    , sweep_copied_(false)
 {
+    for (auto& bytes : nal_bytes_stripped_) {
+        bytes = 0;
+    }
+}
+
+// Destructor - Cleanup is handled in Stop()
+ScreenCaptureEncoder::~ScreenCaptureEncoder() {
+    Stop();  // Ensure everything is cleaned up
+}
+
+// Main initialization function - sets up all subsystems
+bool ScreenCaptureEncoder::Initialize(int width, int height, int fps, const std::wstring& pipe_name) {
+    width_ = width;
+    height_ = height;
+    fps_ = fps;
+    pipe_name_ = pipe_name;
+    
+    // Calculate frame duration in 100-nanosecond units (Media Foundation uses this)
+    // Example: 60 FPS = 16.67ms = 166,667 * 100ns
+    frame_duration_ = 10000000ULL / fps_;  // 10,000,000 = 1 second in 100ns units
+    keyframe_interval_ = tuning_.gop > 0 ? tuning_.gop : fps_ * 2;  // IDR every 2 seconds by default
+    
+    // A file source has no pointer to draw or send
+    if (!replay_settings_.path.empty() && cursor_mode_ != CursorMode::kNone) {
+        std::cout << "Replay source: cursor disabled" << std::endl;
+        cursor_mode_ = CursorMode::kNone;
+    }
+    
+    // The probe reads back the pipe output; an offline sweep has none
+    if (sweep_mode_ && latency_probe_enabled_) {
+        std::cout << "Encoder sweep: latency probe disabled" << std::endl;
+        latency_probe_enabled_ = false;
+    }
+    
+    // The probe's counter is drawn by the replay source at the frame origin
+    if (latency_probe_enabled_) {
+        if (replay_settings_.path.empty() || capture_window_ ||
+            capture_region_.right > capture_region_.left) {
+            std::cerr << "Latency probe needs a replay source without a region or window" << std::endl;
+            return false;
+        }
+        replay_settings_.stamp_counter = true;
+    }
+    
+    // Initialize COM (Component Object Model) - required for DirectX and Media Foundation
+    // COINIT_MULTITHREADED allows COM objects to be called from any thread
+    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to initialize COM: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    
+    // Initialize Media Foundation - required for video encoding
+    // MFStartup must be called before using any MF APIs
+    hr = MFStartup(MF_VERSION);  // MF_VERSION ensures version compatibility
+    if (FAILED(hr)) {
+        std::cerr << "Failed to initialize Media Foundation: 0x" << std::hex << hr << std::endl;
+        CoUninitialize();  // Cleanup COM if MF fails
+        return false;
+    }
+    
+    // Initialize each subsystem in order
+    if (!InitializeD3D11()) {
+        std::cerr << "Failed to initialize D3D11" << std::endl;
+        return false;
+    }
+    
+    if (!InitializeDuplication()) {
+        std::cerr << "Failed to initialize desktop duplication" << std::endl;
+        return false;
+    }
+    
+    // Converter input follows the real desktop (or capture region) size,
+    // which may differ from the requested encode size. Only the region is taken
+    // from the window here; the converter is built once, below, at that size.
+    RECT window_bounds = {};
+    if (GetCaptureWindowBounds(&window_bounds)) {
+        capture_region_ = window_bounds;
+    }
+    active_region_ = ClampRegion(capture_region_, duplication_width_, duplication_height_);
+    source_width_ = active_region_.right - active_region_.left;
+    source_height_ = active_region_.bottom - active_region_.top;
+    if (follow_source_resolution_) {
+        width_ = source_width_ & ~1;
+        height_ = source_height_ & ~1;
+    }
+    PublishEncodeSize();
+    
+    std::cout << "Initializing video encoder..." << std::endl;
+    if (!InitializeColorConverter()) {
+        std::cerr << "Failed to initialize color converter" << std::endl;
+        return false;
+    }
+    
+    if (!InitializeVideoEncoder()) {
+        std::cerr << "Failed to initialize video encoder" << std::endl;
+        return false;
+    }
+    
+    // The sweep encodes offline; waiting here for a client would block it forever
+    if (!sweep_mode_ && !InitializeNamedPipe()) {
+        std::cerr << "Failed to initialize named pipe" << std::endl;
+        return false;
+    }
+    
+    if (latency_probe_enabled_) {
+        latency_probe_ = std::make_unique<LatencyProbe>();
+        if (!latency_probe_->Initialize(duplication_width_, duplication_height_)) {
+            std::cerr << "Failed to initialize latency probe" << std::endl;
+            return false;
+        }
+    }
+    
+    std::cout << "Initialization complete!" << std::endl;
+    return true;
+}
+
+// Initialize Direct3D 11 device and context
+bool ScreenCaptureEncoder::InitializeD3D11() {
+    // Feature levels to try (DirectX version support)
+    // D3D_FEATURE_LEVEL_11_0 = DirectX 11.0 (most common)
+    D3D_FEATURE_LEVEL feature_levels[] = {
+        D3D_FEATURE_LEVEL_11_0  // We need at least D3D11 for desktop duplication
+    };
+    
+    D3D_FEATURE_LEVEL feature_level_out;  // Will receive actual feature level
+    
+    // Duplication only works on the adapter that drives the output, so create
+    // the device on the adapter of the first requested output
+    IDXGIAdapter1* adapter = nullptr;
+    IDXGIOutput* first_output = nullptr;
+    if (FindOutput(output_indices_.empty() ? 0 : output_indices_[0], &adapter, &first_output)) {
+        first_output->Release();
+    }
+    
+    // Create D3D11 device and immediate context
+    // D3D_DRIVER_TYPE_UNKNOWN is required when an explicit adapter is given;
+    // without one, D3D_DRIVER_TYPE_HARDWARE uses the default adapter (primary GPU)
+    // D3D11_CREATE_DEVICE_BGRA_SUPPORT = support BGRA format (needed for desktop capture)
+    UINT device_flags = D3D11_CREATE_DEVICE_BGRA_SUPPORT | D3D11_CREATE_DEVICE_VIDEO_SUPPORT;
+    HRESULT hr = D3D11CreateDevice(
+        adapter,                           // Adapter owning the output (or default)
+        adapter ? D3D_DRIVER_TYPE_UNKNOWN : D3D_DRIVER_TYPE_HARDWARE,
+        nullptr,                           // No software rasterizer DLL
+        device_flags,                     // Support BGRA + video processing
+        feature_levels,                    // Array of feature levels to try
+        1,                                 // Number of feature levels in array
+        D3D11_SDK_VERSION,                // SDK version
+        &d3d_device_,                     // OUT: receives device pointer
+        &feature_level_out,               // OUT: receives actual feature level
+        &d3d_context_                     // OUT: receives context pointer
+    );
+    
+    if (adapter) {
+        adapter->Release();
+    }
+    
+    if (FAILED(hr)) {
+        std::cerr << "D3D11CreateDevice failed: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+
+    // Create DXGI device manager for Media Foundation MFTs (hardware path).
+    hr = MFCreateDXGIDeviceManager(&reset_token_, &dxgi_manager_);
+    if (FAILED(hr)) {
+        std::cerr << "MFCreateDXGIDeviceManager failed: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+
+    hr = dxgi_manager_->ResetDevice(d3d_device_, reset_token_);
+    if (FAILED(hr)) {
+        std::cerr << "DXGIDeviceManager ResetDevice failed: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    
+    // Capture and encode threads share the immediate context
+    ID3D11Multithread* multithread = nullptr;
+    if (SUCCEEDED(d3d_context_->QueryInterface(IID_PPV_ARGS(&multithread)))) {
+        multithread->SetMultithreadProtected(TRUE);
+        multithread->Release();
+    } else {
+        std::cerr << "ID3D11Multithread unavailable" << std::endl;
+        return false;
+    }
+    
+    cursor_ = std::make_unique<CursorCompositor>();
+    cursor_->Initialize(d3d_device_, d3d_context_);
+    
+    std::cout << "D3D11 device created successfully" << std::endl;
+    return true;
+}
+
+// Initialize Desktop Duplication API for screen capture
+bool ScreenCaptureEncoder::InitializeDuplication() {
+    // Replay stands in for duplication, including its resets
+    if (!replay_settings_.path.empty()) {
+        if (!replay_) {
+            replay_ = std::make_unique<ReplaySource>();
+        }
+        if (!replay_->is_open() && !replay_->Open(replay_settings_)) {
+            return false;
+        }
+        if (!replay_->AttachDevice(d3d_device_, d3d_context_)) {
+            return false;
+        }
+        duplication_width_ = replay_->width();
+        duplication_height_ = replay_->height();
+        output_origin_ = {};
+        return true;
+    }
+    
+    // Get DXGI device from D3D11 device
+    // QueryInterface converts d3d_device_ to IDXGIDevice interface
+    IDXGIDevice* dxgi_device = nullptr;
+    HRESULT hr = d3d_device_->QueryInterface(__uuidof(IDXGIDevice), 
+                                             reinterpret_cast<void**>(&dxgi_device));
+    if (FAILED(hr)) {
+        std::cerr << "Failed to get DXGI device: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    
+    // Get DXGI adapter (represents physical GPU)
+    IDXGIAdapter* dxgi_adapter = nullptr;
+    hr = dxgi_device->GetAdapter(&dxgi_adapter);  // Get parent adapter
+    dxgi_device->Release();  // Release DXGI device (no longer needed)
+    
+    if (FAILED(hr)) {
+        std::cerr << "Failed to get DXGI adapter: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    
+    DXGI_ADAPTER_DESC device_adapter_desc = {};
+    dxgi_adapter->GetDesc(&device_adapter_desc);
+    dxgi_adapter->Release();  // Release adapter (no longer needed)
+    
+    // Output 0 is the primary monitor
+    std::vector<UINT> indices = output_indices_;
+    if (indices.empty()) {
+        indices.push_back(0);
+    }
+    
+    DXGI_OUTDUPL_DESC dupl_desc = {};
+    for (UINT index : indices) {
+        IDXGIAdapter1* output_adapter = nullptr;
+        IDXGIOutput* dxgi_output = nullptr;
+        if (!FindOutput(index, &output_adapter, &dxgi_output)) {
+            std::cerr << "Failed to get DXGI output " << index << std::endl;
+            ReleaseDuplication();
+            return false;
+        }
+        
+        DXGI_ADAPTER_DESC1 output_adapter_desc = {};
+        output_adapter->GetDesc1(&output_adapter_desc);
+        output_adapter->Release();
+        
+        // Outputs on another GPU would need a cross-adapter copy per frame
+        if (output_adapter_desc.AdapterLuid.LowPart != device_adapter_desc.AdapterLuid.LowPart ||
+            output_adapter_desc.AdapterLuid.HighPart != device_adapter_desc.AdapterLuid.HighPart) {
+            std::cerr << "Output " << index << " is on a different adapter, skipping" << std::endl;
+            dxgi_output->Release();
+            continue;
+        }
+        
+        DXGI_OUTPUT_DESC output_desc = {};
+        dxgi_output->GetDesc(&output_desc);
+        
+        // Query for IDXGIOutput1 interface (needed for duplication)
+        IDXGIOutput1* dxgi_output1 = nullptr;
+        hr = dxgi_output->QueryInterface(__uuidof(IDXGIOutput1), 
+                                         reinterpret_cast<void**>(&dxgi_output1));
+        
+        if (FAILED(hr)) {
+            dxgi_output->Release();
+            std::cerr << "Failed to get IDXGIOutput1: 0x" << std::hex << hr << std::endl;
+            ReleaseDuplication();
+            return false;
+        }
+        
+        // Create desktop duplication output
+        // This gives us a handle to capture frames from the desktop
+        DuplicatedOutput output;
+        output.desktop_rect = output_desc.DesktopCoordinates;
+        output.output = dxgi_output;  // Kept for vblank waits, released in ReleaseDuplication
+        hr = dxgi_output1->DuplicateOutput(d3d_device_, &output.duplication);
+        dxgi_output1->Release();  // Release output1
+        
+        if (FAILED(hr)) {
+            dxgi_output->Release();
+            std::cerr << "DuplicateOutput failed: 0x" << std::hex << hr << std::endl;
+            std::cerr << "This can fail if another process is already capturing or in a game" << std::endl;
+            ReleaseDuplication();
+            return false;
+        }
+        
+        output.duplication->GetDesc(&dupl_desc);
+        output.refresh_rate = dupl_desc.ModeDesc.RefreshRate;
+        if (indices.size() > 1 && dupl_desc.Rotation != DXGI_MODE_ROTATION_IDENTITY &&
+            dupl_desc.Rotation != DXGI_MODE_ROTATION_UNSPECIFIED) {
+            std::cerr << "Output " << index << " is rotated; composited image will be unrotated" << std::endl;
+        }
+        outputs_.push_back(output);
+    }
+    
+    if (outputs_.empty()) {
+        std::cerr << "No capturable outputs" << std::endl;
+        return false;
+    }
+    
+    if (outputs_.size() == 1) {
+        // Current desktop mode; changes after a mode switch (reported as ACCESS_LOST)
+        duplication_width_ = static_cast<int>(dupl_desc.ModeDesc.Width);
+        duplication_height_ = static_cast<int>(dupl_desc.ModeDesc.Height);
+        output_origin_.x = outputs_[0].desktop_rect.left;
+        output_origin_.y = outputs_[0].desktop_rect.top;
+    } else {
+        // Composite covers the bounding box of all outputs in desktop layout
+        RECT bounds = outputs_[0].desktop_rect;
+        for (const auto& output : outputs_) {
+            UnionRect(&bounds, &bounds, &output.desktop_rect);
+        }
+        output_origin_.x = bounds.left;
+        output_origin_.y = bounds.top;
+        duplication_width_ = (bounds.right - bounds.left) & ~1;
+        duplication_height_ = (bounds.bottom - bounds.top) & ~1;
+        
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = duplication_width_;
+        desc.Height = duplication_height_;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+        hr = d3d_device_->CreateTexture2D(&desc, nullptr, &composite_texture_);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create composite texture: 0x" << std::hex << hr << std::endl;
+            ReleaseDuplication();
+            return false;
+        }
+        
+        // Areas not covered by any output (mismatched monitor sizes) stay black
+        ID3D11RenderTargetView* rtv = nullptr;
+        if (SUCCEEDED(d3d_device_->CreateRenderTargetView(composite_texture_, nullptr, &rtv))) {
+            const float black[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+            d3d_context_->ClearRenderTargetView(rtv, black);
+            rtv->Release();
+        }
+    }
+    
+    std::cout << "Desktop duplication initialized successfully ("
+              << outputs_.size() << " output(s), "
+              << duplication_width_ << "x" << duplication_height_ << ")" << std::endl;
+    return true;
+}
+
+// Initialize GPU video processor used for RGB32 -> NV12 conversion
+bool ScreenCaptureEncoder::InitializeColorConverter() {
+    HRESULT hr;
+
+    // A rebuilt converter means a changed source; the next frame is recorded whole
+    force_full_frame_ = true;
+
+    std::cout << "[Encoder] Initializing GPU pipeline..." << std::endl;
+
+    // Create GPU video processor (RGB32 -> NV12)
+    hr = CoCreateInstance(CLSID_VideoProcessorMFT, nullptr, CLSCTX_INPROC_SERVER,
+                          IID_PPV_ARGS(&color_converter_));
+    if (FAILED(hr)) {
+        std::cerr << "Failed to create video processor MFT: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    std::cout << "[Encoder] Video processor MFT created" << std::endl;
+
+    IMFAttributes* cc_attrs = nullptr;
+    if (SUCCEEDED(color_converter_->GetAttributes(&cc_attrs)) && cc_attrs) {
+        cc_attrs->SetUINT32(MF_SA_D3D11_AWARE, TRUE);
+        cc_attrs->Release();
+    }
+    color_converter_->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER,
+                                     reinterpret_cast<ULONG_PTR>(dxgi_manager_));
+    std::cout << "[Encoder] Video processor D3D manager set" << std::endl;
+
+    IMFMediaType* rgb_type = nullptr;
+    hr = MFCreateMediaType(&rgb_type);
+    if (FAILED(hr)) return false;
+    rgb_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+    // YUV replay files are uploaded as NV12; the processor then only scales
+    bool nv12_input = replay_ && replay_->is_nv12();
+    rgb_type->SetGUID(MF_MT_SUBTYPE, nv12_input ? MFVideoFormat_NV12 : MFVideoFormat_RGB32);
+    rgb_type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+    MFSetAttributeSize(rgb_type, MF_MT_FRAME_SIZE, source_width_, source_height_);
+    MFSetAttributeRatio(rgb_type, MF_MT_FRAME_RATE, fps_, 1);
+    MFSetAttributeRatio(rgb_type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+
+    hr = color_converter_->SetInputType(0, rgb_type, 0);
+    rgb_type->Release();
+    if (FAILED(hr)) {
+        std::cerr << "Failed to set color converter input type: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    std::cout << "[Encoder] Video processor input type set" << std::endl;
+
+    IMFMediaType* nv12_type = nullptr;
+    hr = MFCreateMediaType(&nv12_type);
+    if (FAILED(hr)) return false;
+    nv12_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+    nv12_type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
+    nv12_type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+    MFSetAttributeSize(nv12_type, MF_MT_FRAME_SIZE, width_, height_);
+    MFSetAttributeRatio(nv12_type, MF_MT_FRAME_RATE, fps_, 1);
+    MFSetAttributeRatio(nv12_type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+
+    hr = color_converter_->SetOutputType(0, nv12_type, 0);
+    nv12_type->Release();
+    if (FAILED(hr)) {
+        std::cerr << "Failed to set color converter output type: 0x" << std::hex << hr << std::endl;
+        return false;
+    }
+    std::cout << "[Encoder] Video processor output type set" << std::endl;
+
+    ConfigureConverterRects();
+
+    color_converter_->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0);
+    color_converter_->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, 0);
+    return true;
+}
+
+// Keep the source aspect ratio when it differs from the encode size.
+// Takes effect on the next ProcessOutput, so it can be changed while streaming.
+void ScreenCaptureEncoder::ConfigureConverterRects() {
+    if (!color_converter_) {
+        return;
+    }
+
+    IMFVideoProcessorControl* vp_control = nullptr;
+    HRESULT hr = color_converter_->QueryInterface(IID_PPV_ARGS(&vp_control));
+    if (FAILED(hr)) {
+        std::cerr << "Video processor control unavailable: 0x" << std::hex << hr << std::dec << std::endl;
+        return;
+    }
+
+    // The region has already been cropped out by CropToRegion
+    RECT src = { 0, 0, source_width_, source_height_ };
+    int src_width = source_width_;
+    int src_height = source_height_;
+    RECT dst = ComputeLetterboxRect(src_width, src_height, width_, height_);
+    MFARGB black = { 0, 0, 0, 255 };
+    vp_control->SetBorderColor(&black);
+    vp_control->SetSourceRectangle(&src);
+    vp_control->SetDestinationRectangle(&dst);
+    vp_control->Release();
+
+    if (src_width != width_ || src_height != height_) {
+        std::cout << "[Encoder] Scaling " << src_width << "x" << src_height
+                  << " into " << (dst.right - dst.left) << "x" << (dst.bottom - dst.top)
+                  << " of " << width_ << "x" << height_ << std::endl;
+    }
+}
+
+// Initialize H.264 video encoder (NVENC via FFmpeg)
+bool ScreenCaptureEncoder::InitializeVideoEncoder() {
+    ffmpeg_encoder_ = std::make_unique<FfmpegNvencEncoder>();
+    if (!ffmpeg_encoder_->Initialize(d3d_device_, d3d_context_, width_, height_, fps_,
+                                     bitrate_, keyframe_interval_, temporal_layers_, tuning_)) {
+        std::cerr << "Failed to initialize FFmpeg NVENC encoder" << std::endl;
+        return false;
+    }
+
+    std::cout << "Video encoder initialized successfully (NVENC via FFmpeg)" << std::endl;
+    return true;
+}
+
+
+// Initialize named pipe for IPC with Go process
+bool ScreenCaptureEncoder::InitializeNamedPipe() {
+    // Create named pipe
+    // Format: \\.\pipe\PipeName
+    pipe_handle_ = CreateNamedPipeW(
+        pipe_name_.c_str(),                  // Pipe name
+        PIPE_ACCESS_OUTBOUND,                // Write-only access
+        PIPE_TYPE_BYTE | PIPE_WAIT,          // Byte-type, blocking mode
+        1,                                    // Max instances
+        65536,                                // Output buffer size (64KB)
+        0,                                    // Input buffer size (0 for outbound)
+        0,                                    // Default timeout
+        nullptr                               // Default security attributes
+    );
+    
+    if (pipe_handle_ == INVALID_HANDLE_VALUE) {
+        std::cerr << "Failed to create named pipe. Error: " << GetLastError() << std::endl;
+        return false;
+    }
+    
+    std::wcout << L"Named pipe created: " << pipe_name_ << std::endl;
+    
+    if (!WaitForClient()) {
+        CloseHandle(pipe_handle_);
+        pipe_handle_ = INVALID_HANDLE_VALUE;
+        return false;
+    }
+    
+    return true;
+}
+
+// Wait for a client (Go process) to connect to the pipe.
+// Used for the first connection and again after every disconnect; the
+// capture and encoder objects stay alive the whole time.
+bool ScreenCaptureEncoder::WaitForClient() {
+    std::cout << "Waiting for Go process to connect..." << std::endl;
+    
+    // This blocks until a client calls CreateFile on the pipe
+    // (Stop() cancels it, or connects a throwaway client, see JoinPipeThread)
+    BOOL connected = ConnectNamedPipe(pipe_handle_, nullptr);
+    if (!connected && GetLastError() != ERROR_PIPE_CONNECTED) {
+        DWORD error = GetLastError();
+        if (error != ERROR_OPERATION_ABORTED) {
+            std::cerr << "Failed to connect pipe. Error: " << error << std::endl;
+        }
+        return false;
+    }
+    
+    // Anything still queued was encoded for the previous client
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        std::queue<EncodedFrame>().swap(frame_queue_);
+    }
+    
+    // New client needs SPS/PPS + IDR before any P-frame is useful,
+    // and the current cursor shape before any cursor position
+    awaiting_keyframe_ = true;
+    force_keyframe_ = true;
+    cursor_resend_ = true;
+    client_connected_ = true;
+    join_time_ = std::chrono::steady_clock::now();
+    
+    // Wake the encoder: the mailbox or held frame becomes the new client's IDR
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex_);
+        join_pending_ = true;
+    }
+    ring_cv_.notify_one();
+    
+    std::cout << "Go process connected to pipe!" << std::endl;
+    return true;
+}
+
+// Drop the current client and return the pipe to the listening state
+void ScreenCaptureEncoder::DisconnectClient() {
+    client_connected_ = false;
+    
+    size_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        dropped = frame_queue_.size();
+        std::queue<EncodedFrame>().swap(frame_queue_);
+    }
+    frames_dropped_ += dropped;
+    
+    DisconnectNamedPipe(pipe_handle_);
+    std::cout << "Go process disconnected, dropped " << dropped << " queued frames" << std::endl;
+}
+
+// Start capture threads
+bool ScreenCaptureEncoder::Start() {
+    if (running_) {
+        std::cerr << "Already running!" << std::endl;
+        return false;
+    }
+    
+    running_ = true;  // Set atomic flag
+    start_time_ = std::chrono::high_resolution_clock::now();  // Record start time
+    
+    // Anchors for absolute capture times (timing SEI)
+    LARGE_INTEGER qpc_now = {}, qpc_frequency = {};
+    QueryPerformanceCounter(&qpc_now);
+    QueryPerformanceFrequency(&qpc_frequency);
+    start_monotonic_us_ = qpc_frequency.QuadPart != 0
+        ? static_cast<uint64_t>(qpc_now.QuadPart / qpc_frequency.QuadPart * 1000000 +
+                                qpc_now.QuadPart % qpc_frequency.QuadPart * 1000000 / qpc_frequency.QuadPart)
+        : 0;
+    start_unix_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    
+    free_frames_.clear();
+    mailbox_frame_ = -1;
+    held_frame_ = -1;
+    join_pending_ = false;
+    for (int i = 0; i < kFrameRingSize; ++i) {
+        free_frames_.push_back(i);
+    }
+    
+    // Launch capture thread
+    // std::thread constructor calls CaptureLoop() in a new thread
+    capture_thread_ = std::thread(&ScreenCaptureEncoder::CaptureLoop, this);
+    
+    // Launch encode thread (consumes the frame ring)
+    encode_thread_ = std::thread(&ScreenCaptureEncoder::EncodeLoop, this);
+    
+    // Launch pipe writing thread
+    pipe_thread_ = std::thread(&ScreenCaptureEncoder::PipeWriteLoop, this);
+    
+    // Launch control pipe thread
+    control_thread_ = std::thread(&ScreenCaptureEncoder::ControlLoop, this);
+    
+    std::cout << "Capture started!" << std::endl;
+    return true;
+}
+
+// Stop capture threads
+void ScreenCaptureEncoder::Stop() {
+    // Without threads (after RunEncoderSweep) there is still a device to tear down
+    if (!running_ && !d3d_device_) {
+        return;  // Already stopped
+    }
+    
+    running_ = false;  // Clear atomic flag (threads will exit)
+    
+    // Wait for threads to finish
+    if (capture_thread_.joinable()) {
+        capture_thread_.join();  // Block until thread exits
+    }
+    
+    ring_cv_.notify_all();  // Wake the encode thread
+    if (encode_thread_.joinable()) {
+        encode_thread_.join();
+    }
+
+    if (pipe_thread_.joinable()) {
+        // The pipe thread may be blocked in ConnectNamedPipe or WriteFile
+        JoinPipeThread(pipe_thread_, pipe_name_);
+    }
+
+    if (control_thread_.joinable()) {
+        // Blocked in ConnectNamedPipe or ReadFile on the control pipe
+        JoinPipeThread(control_thread_, pipe_name_ + L"_control");
+    }
+    
+    // Flush the recording before the device goes away
+    if (recorder_) {
+        recorder_->Shutdown();
+        recorder_.reset();
+    }
+    
+    if (latency_probe_) {
+        latency_probe_->Shutdown();
+        std::cout << "Latency probe: " << latency_probe_->frames() << " frames, avg "
+                  << latency_probe_->latency_avg_us() << " us, max " << latency_probe_->latency_max_us()
+                  << " us, " << latency_probe_->dropped() << " dropped, "
+                  << latency_probe_->duplicated() << " duplicated" << std::endl;
+        latency_probe_.reset();
+    }
+    
+    // Cleanup encoder and GPU objects
+    ReleaseVideoEncoder();
+    ReleaseColorConverter();
+    ReleaseDuplication();
+    ReleaseD3D11();
+    
+    if (pipe_handle_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe_handle_);  // Close pipe
+        pipe_handle_ = INVALID_HANDLE_VALUE;
+    }
+    
+    MFShutdown();      // Shutdown Media Foundation
+    CoUninitialize();  // Shutdown COM
+    
+    std::cout << "Capture stopped and cleaned up" << std::endl;
+}
+
+void ScreenCaptureEncoder::ReleaseVideoEncoder() {
+    if (ffmpeg_encoder_) {
+        ffmpeg_encoder_->Shutdown();
+        ffmpeg_encoder_.reset();
+    }
+}
+
+void ScreenCaptureEncoder::ReleaseColorConverter() {
+    if (color_converter_) {
+        color_converter_->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, 0);
+        color_converter_->Release();
+        color_converter_ = nullptr;
+    }
+}
+
+void ScreenCaptureEncoder::ReleaseDuplication() {
+    if (replay_) {
+        replay_->ReleaseDevice();
+    }
+    
+    for (auto& output : outputs_) {
+        if (output.duplication) {
+            if (output.holds_frame) {
+                output.duplication->ReleaseFrame();  // Release any held frame
+            }
+            output.duplication->Release();
+        }
+        if (output.output) {
+            output.output->Release();
+        }
+    }
+    outputs_.clear();
+    
+    if (composite_texture_) {
+        composite_texture_->Release();
+        composite_texture_ = nullptr;
+    }
+}
+
+void ScreenCaptureEncoder::ReleaseD3D11() {
+    if (cursor_) {
+        cursor_->Shutdown();
+        cursor_.reset();
+    }
+    
+    if (region_texture_) {
+        region_texture_->Release();
+        region_texture_ = nullptr;
+    }
+    
+    ReleaseFrameRing();
+    
+    if (recorder_) {
+        recorder_->ReleaseDevice();  // Keeps recording on the new device
+    }
+    if (scroll_detector_) {
+        scroll_detector_->ReleaseDevice();
+    }
+    if (analyzer_) {
+        analyzer_->ReleaseDevice();
+    }
+    
+    if (d3d_context_) {
+        d3d_context_->Release();
+        d3d_context_ = nullptr;
+    }
+    
+    if (d3d_device_) {
+        d3d_device_->Release();
+        d3d_device_ = nullptr;
+    }
+
+    if (dxgi_manager_) {
+        dxgi_manager_->Release();
+        dxgi_manager_ = nullptr;
+    }
+}
+
+void ScreenCaptureEncoder::SetFollowSourceResolution(bool follow) {
+    follow_source_resolution_ = follow;
+}
+
+// The desktop (or capture region) changed size. The converter is rebuilt right away so frames
+// keep flowing (scaled/letterboxed into the current encode size); the
+// encoder itself is only reopened at the next IDR to avoid an extra keyframe.
+bool ScreenCaptureEncoder::HandleSourceResize(int source_width, int source_height) {
+    auto start = std::chrono::steady_clock::now();
+    std::cout << "Capture source resized " << source_width_ << "x" << source_height_
+              << " -> " << source_width << "x" << source_height << std::endl;
+    
+    source_width_ = source_width;
+    source_height_ = source_height;
+    
+    ReleaseColorConverter();
+    if (!InitializeColorConverter()) {
+        encode_failed_component_ = PipelineComponent::kColorConverter;
+        return false;
+    }
+    
+    int target_width = source_width & ~1;
+    int target_height = source_height & ~1;
+    if (follow_source_resolution_ && (target_width != width_ || target_height != height_)) {
+        pending_width_ = target_width;
+        pending_height_ = target_height;
+    } else {
+        pending_width_ = 0;
+        pending_height_ = 0;
+    }
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    std::cout << "Converter reconfigured in " << elapsed.count() << " us" << std::endl;
+    return true;
+}
+
+// Called right before the frame that would start a new GOP. The new encoder's
+// first frame is an IDR carrying the new SPS/PPS.
+bool ScreenCaptureEncoder::ApplyPendingResize() {
+    auto start = std::chrono::steady_clock::now();
+    
+    width_ = pending_width_;
+    height_ = pending_height_;
+    pending_width_ = 0;
+    pending_height_ = 0;
+    PublishEncodeSize();
+    
+    ReleaseVideoEncoder();
+    ReleaseColorConverter();
+    if (!InitializeColorConverter()) {
+        encode_failed_component_ = PipelineComponent::kColorConverter;
+        return false;
+    }
+    if (!InitializeVideoEncoder()) {
+        encode_failed_component_ = PipelineComponent::kEncoder;
+        return false;
+    }
+    frames_since_keyframe_ = 0;
+    
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    std::cout << "Encoder reopened at " << width_ << "x" << height_
+              << " in " << elapsed.count() << " us" << std::endl;
+    return true;
+}
+
+void ScreenCaptureEncoder::PublishEncodeSize() {
+    encode_size_ = (static_cast<uint64_t>(static_cast<uint32_t>(width_)) << 32) | static_cast<uint32_t>(height_);
+}
+
+void ScreenCaptureEncoder::EncodeSize(int* width, int* height) const {
+    uint64_t size = encode_size_;
+    *width = static_cast<int>(size >> 32);
+    *height = static_cast<int>(size & 0xFFFFFFFF);
+}
+
+void ScreenCaptureEncoder::SetCaptureTiming(CaptureTiming timing) {
+    capture_timing_ = timing;
+}
+
+void ScreenCaptureEncoder::SetIdleFrameRate(int idle_fps) {
+    idle_fps_ = (std::max)(0, idle_fps);
+}
+
+void ScreenCaptureEncoder::SetTemporalLayers(int layers) {
+    temporal_layers_ = (std::min)(3, (std::max)(1, layers));
+}
+
+void ScreenCaptureEncoder::SetEncoderTuning(const EncoderTuning& tuning) {
+    tuning_ = tuning;
+}
+
+void ScreenCaptureEncoder::SetTimingSei(bool enabled) {
+    timing_sei_ = enabled;
+}
+
+void ScreenCaptureEncoder::SetLatencyProbe(bool enabled) {
+    latency_probe_enabled_ = enabled;
+}
+
+void ScreenCaptureEncoder::SetSweepMode(bool enabled) {
+    sweep_mode_ = enabled;
+}
+
+void ScreenCaptureEncoder::SetNalFilter(uint32_t drop_mask) {
+    // Slices, IDR slices and parameter sets are never dropped
+    const uint32_t kRequired = (1u << 1) | (1u << 5) | (1u << 7) | (1u << 8);
+    nal_filter_mask_ = drop_mask & ~kRequired;
+}
+
+void ScreenCaptureEncoder::SetPacing(int rate_kbps, int burst_kb) {
+    pace_rate_kbps_ = (std::max)(0, rate_kbps);
+    pace_burst_bytes_ = (std::max)(static_cast<double>(kPaceChunkBytes), burst_kb * 1024.0);
+    pace_tokens_ = pace_burst_bytes_;
+}
+
+void ScreenCaptureEncoder::SetPreAnalysis(bool enabled) {
+    if (enabled) {
+        analyzer_ = std::make_unique<FrameAnalyzer>();
+    } else {
+        analyzer_.reset();
+    }
+}
+
+void ScreenCaptureEncoder::SetMotionHints(bool enabled) {
+    if (enabled) {
+        scroll_detector_ = std::make_unique<ScrollDetector>();
+    } else {
+        scroll_detector_.reset();
+    }
+}
+
+void ScreenCaptureEncoder::SetOutputs(const std::vector<UINT>& output_indices) {
+    output_indices_ = output_indices;
+}
+
+void ScreenCaptureEncoder::ListOutputs() {
+    IDXGIFactory1* factory = nullptr;
+    if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), reinterpret_cast<void**>(&factory)))) {
+        std::cerr << "CreateDXGIFactory1 failed" << std::endl;
+        return;
+    }
+    
+    UINT global_index = 0;
+    IDXGIAdapter1* adapter = nullptr;
+    for (UINT a = 0; factory->EnumAdapters1(a, &adapter) != DXGI_ERROR_NOT_FOUND; ++a) {
+        DXGI_ADAPTER_DESC1 adapter_desc = {};
+        adapter->GetDesc1(&adapter_desc);
+        
+        IDXGIOutput* output = nullptr;
+        for (UINT o = 0; adapter->EnumOutputs(o, &output) != DXGI_ERROR_NOT_FOUND; ++o) {
+            DXGI_OUTPUT_DESC desc = {};
+            output->GetDesc(&desc);
+            const RECT& r = desc.DesktopCoordinates;
+            std::wcout << L"  [" << global_index++ << L"] " << desc.DeviceName
+                       << L" " << (r.right - r.left) << L"x" << (r.bottom - r.top)
+                       << L" at " << r.left << L"," << r.top
+                       << L" (" << adapter_desc.Description << L")" << std::endl;
+            output->Release();
+        }
+        adapter->Release();
+    }
+    factory->Release();
+}
+
+void ScreenCaptureEncoder::BenchmarkNalRewrite() {
+    // 400 KB IDR-sized packets; a pool of them (~25 MB) is cycled so every
+    // pass starts from cold buffers, as packets fresh out of the encoder are
+    const size_t kPacketSize = 400 * 1024;
+    const int kPoolSize = 64;
+    const int kPasses = 512;
+    
+    std::cout << "NAL length-prefix conversion, " << kPacketSize / 1024 << " KB packets, GB/s "
+                 "(including the copy into EncodedFrame)" << std::endl;
+    std::cout << "nals\tprefix\tappend_based\tencoder_path" << std::endl;
+    
+    uint32_t seed = 12345;
+    for (int length_size : { 4, 2 }) {
+        for (size_t nals : { 1, 8, 64 }) {
+            // 2-byte prefixes cap NALs at 64 KB
+            size_t nal_size = kPacketSize / nals - length_size;
+            if (length_size == 2 && nal_size > 0xFFFF) {
+                continue;
+            }
+            std::vector<std::vector<uint8_t>> pool(kPoolSize);
+            for (auto& packet : pool) {
+                for (size_t n = 0; n < nals; ++n) {
+                    for (int b = length_size - 1; b >= 0; --b) {
+                        packet.push_back(static_cast<uint8_t>(nal_size >> (8 * b)));
+                    }
+                    for (size_t i = 0; i < nal_size; ++i) {
+                        seed = seed * 1664525 + 1013904223;
+                        packet.push_back(static_cast<uint8_t>(seed >> 24) | 0x01);  // No zero runs
+                    }
+                }
+            }
+            
+            // What EncodeFrame did before: append start codes and NALs one at a
+            // time into the frame's empty vector, growing it as it goes
+            auto start = std::chrono::steady_clock::now();
+            for (int pass = 0; pass < kPasses; ++pass) {
+                const std::vector<uint8_t>& packet = pool[pass % kPoolSize];
+                EncodedFrame frame;
+                ConvertLengthPrefixedAppend(packet.data(), packet.size(), length_size, frame.data);
+            }
+            double append_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            
+            // What EncodeFrame does: rewrite in the packet (4-byte) or one exact-size
+            // conversion straight into the frame (1/2-byte). Restoring the prefixes is
+            // not timed.
+            std::chrono::steady_clock::duration in_place_time{};
+            for (int pass = 0; pass < kPasses; ++pass) {
+                std::vector<uint8_t>& packet = pool[pass % kPoolSize];
+                if (length_size == 4) {
+                    for (size_t offset = 0; offset < packet.size(); offset += 4 + nal_size) {
+                        for (int b = 3; b >= 0; --b) {
+                            packet[offset + 3 - b] = static_cast<uint8_t>(nal_size >> (8 * b));
+                        }
+                    }
+                }
+                auto pass_start = std::chrono::steady_clock::now();
+                EncodedFrame frame;
+                if (length_size == 4) {
+                    RewriteLengthPrefixedInPlace(packet.data(), packet.size());
+                    frame.data.assign(packet.begin(), packet.end());
+                } else {
+                    ConvertLengthPrefixedToAnnexB(packet.data(), packet.size(), length_size, frame.data);
+                }
+                in_place_time += std::chrono::steady_clock::now() - pass_start;
+            }
+            double in_place_s = std::chrono::duration<double>(in_place_time).count();
+            
+            double bytes = static_cast<double>(kPacketSize) * kPasses;
+            std::cout << nals << "\t" << length_size << "\t" << std::fixed << std::setprecision(1)
+                      << bytes / append_s / 1e9 << "\t" << bytes / in_place_s / 1e9 << std::endl;
+        }
+    }
+}
+
+void ScreenCaptureEncoder::SetCursorMode(CursorMode mode) {
+    cursor_mode_ = mode;
+}
+
+void ScreenCaptureEncoder::SetReplaySource(const ReplaySettings& settings) {
+    replay_settings_ = settings;
+}
+
+void ScreenCaptureEncoder::StartRecording(const std::wstring& base_path, uint64_t max_bytes) {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    pending_record_path_ = base_path;
+    pending_record_limit_ = max_bytes;
+    has_pending_record_ = true;
+}
+
+void ScreenCaptureEncoder::StopRecording() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    pending_record_path_.clear();
+    has_pending_record_ = true;
+}
+
+void ScreenCaptureEncoder::SetCaptureRegion(const RECT& region) {
+    capture_region_ = region;
+}
+
+void ScreenCaptureEncoder::SetCaptureWindow(HWND window) {
+    capture_window_ = window;
+}
+
+void ScreenCaptureEncoder::UpdateCaptureRegion(const RECT& region) {
+    RECT previous = active_region_;
+    capture_region_ = region;
+    active_region_ = ClampRegion(capture_region_, duplication_width_, duplication_height_);
+    
+    // Dirty rects describe the desktop, not what moved inside the region: the
+    // recorder, scroll shadow and activity check restart from a whole frame
+    if (!EqualRect(&previous, &active_region_)) {
+        force_full_frame_ = true;
+        if (scroll_detector_) {
+            scroll_detector_->Invalidate();
+        }
+    }
+    
+    // A move only changes the copy offset; a new size needs a new converter
+    // (and, when following the source, a new encoder at the next IDR)
+    int region_width = active_region_.right - active_region_.left;
+    int region_height = active_region_.bottom - active_region_.top;
+    if (region_width != source_width_ || region_height != source_height_) {
+        HandleSourceResize(region_width, region_height);
+    }
+}
+
+bool ScreenCaptureEncoder::GetCaptureWindowBounds(RECT* bounds) {
+    if (!capture_window_) {
+        return false;
+    }
+    
+    if (!IsWindow(capture_window_)) {
+        std::cout << "Capture window closed, keeping last region" << std::endl;
+        capture_window_ = nullptr;
+        return false;
+    }
+    if (IsIconic(capture_window_)) {
+        return false;  // Minimized: keep the last region instead of collapsing to nothing
+    }
+    
+    // Extended frame bounds exclude the invisible resize borders GetWindowRect includes
+    if (FAILED(DwmGetWindowAttribute(capture_window_, DWMWA_EXTENDED_FRAME_BOUNDS,
+                                     bounds, sizeof(*bounds)))) {
+        if (!GetWindowRect(capture_window_, bounds)) {
+            return false;
+        }
+    }
+    OffsetRect(bounds, -output_origin_.x, -output_origin_.y);
+    return true;
+}
+
+void ScreenCaptureEncoder::TrackCaptureWindow() {
+    RECT bounds = {};
+    if (!GetCaptureWindowBounds(&bounds)) {
+        return;
+    }
+    
+    if (!EqualRect(&bounds, &capture_region_)) {
+        if (!outputs_.empty()) {
+            std::lock_guard<std::mutex> pipeline_lock(pipeline_mutex_);
+            UpdateCaptureRegion(bounds);
+        } else {
+            capture_region_ = bounds;  // Applied once duplication reports the desktop size
+        }
+    }
+}
+
+ID3D11Texture2D* ScreenCaptureEncoder::CropToRegion(ID3D11Texture2D* desktop_texture) {
+    int region_width = active_region_.right - active_region_.left;
+    int region_height = active_region_.bottom - active_region_.top;
+    if (region_width == duplication_width_ && region_height == duplication_height_) {
+        desktop_texture->AddRef();
+        return desktop_texture;
+    }
+    
+    if (region_texture_) {
+        D3D11_TEXTURE2D_DESC existing = {};
+        region_texture_->GetDesc(&existing);
+        if (static_cast<int>(existing.Width) != region_width ||
+            static_cast<int>(existing.Height) != region_height) {
+            region_texture_->Release();
+            region_texture_ = nullptr;
+        }
+    }
+    
+    if (!region_texture_) {
+        D3D11_TEXTURE2D_DESC desc = {};
+        desktop_texture->GetDesc(&desc);
+        desc.Width = region_width;
+        desc.Height = region_height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = desc.Format == DXGI_FORMAT_NV12  // NV12 replay
+                             ? D3D11_BIND_SHADER_RESOURCE
+                             : D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+        desc.CPUAccessFlags = 0;
+        desc.MiscFlags = 0;
+        
+        HRESULT hr = d3d_device_->CreateTexture2D(&desc, nullptr, &region_texture_);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create region texture: 0x" << std::hex << hr << std::dec << std::endl;
+            return nullptr;
+        }
+    }
+    
+    // GPU copy of just the region; the rest of the desktop is never touched
+    D3D11_BOX box = {};
+    box.left = active_region_.left;
+    box.top = active_region_.top;
+    box.right = active_region_.right;
+    box.bottom = active_region_.bottom;
+    box.front = 0;
+    box.back = 1;
+    d3d_context_->CopySubresourceRegion(region_texture_, 0, 0, 0, 0, desktop_texture, 0, &box);
+    
+    region_texture_->AddRef();
+    return region_texture_;
+}
+
+void ScreenCaptureEncoder::InjectFault(PipelineComponent component) {
+    pending_fault_ = static_cast<int>(component);
+}
+
+// Re-create one component. Components that hold references to the one being
+// replaced are rebuilt as well (everything GPU-side hangs off the device).
+bool ScreenCaptureEncoder::ResetComponent(PipelineComponent component) {
+    switch (component) {
+    case PipelineComponent::kDuplication:
+        ReleaseDuplication();
+        return InitializeDuplication();
+        
+    case PipelineComponent::kColorConverter:
+        ReleaseColorConverter();
+        return InitializeColorConverter();
+        
+    case PipelineComponent::kEncoder:
+        ReleaseVideoEncoder();
+        return InitializeVideoEncoder();
+        
+    case PipelineComponent::kDevice:
+        ReleaseVideoEncoder();
+        ReleaseColorConverter();
+        ReleaseDuplication();
+        ReleaseD3D11();
+        return InitializeD3D11() &&
+               InitializeDuplication() &&
+               InitializeColorConverter() &&
+               InitializeVideoEncoder();
+        
+    case PipelineComponent::kNone:
+        break;
+    }
+    return true;
+}
+
+// Recovery state machine:
+//   failed component -> retry with backoff -> (after kMaxComponentRetries) device reset
+// A removed device always escalates straight to a device reset. The pipe,
+// frame queue and threads are untouched, so the client just sees an IDR.
+bool ScreenCaptureEncoder::RecoverPipeline(PipelineComponent failed) {
+    const int kMaxComponentRetries = 5;
+    const int kMaxBackoffMs = 500;
+    
+    static const char* kComponentNames[] = {
+        "none", "duplication", "color converter", "encoder", "device"
+    };
+    
+    auto recovery_start = std::chrono::steady_clock::now();
+    PipelineComponent component = failed;
+    int attempt = 0;
+    
+    while (running_) {
+        if (d3d_device_ && d3d_device_->GetDeviceRemovedReason() != S_OK) {
+            component = PipelineComponent::kDevice;
+        }
+        
+        std::cout << "Recovering " << kComponentNames[static_cast<int>(component)]
+                  << " (attempt " << (attempt + 1) << ")" << std::endl;
+        
+        if (ResetComponent(component)) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - recovery_start);
+            std::cout << "Recovered " << kComponentNames[static_cast<int>(component)]
+                      << " in " << elapsed.count() << " ms" << std::endl;
+            
+            failed_component_ = PipelineComponent::kNone;
+            encode_failed_component_ = PipelineComponent::kNone;
+            consecutive_encode_failures_ = 0;
+            
+            // A new encoder has no references; a new duplication or converter
+            // leaves the encoder's references intact
+            if (component == PipelineComponent::kEncoder || component == PipelineComponent::kDevice) {
+                force_keyframe_ = true;
+                frames_since_keyframe_ = 0;
+            }
+            return true;
+        }
+        
+        ++attempt;
+        if (component != PipelineComponent::kDevice && attempt >= kMaxComponentRetries) {
+            std::cerr << "Escalating to device reset" << std::endl;
+            component = PipelineComponent::kDevice;
+            attempt = 0;
+        }
+        
+        // Access lost during UAC/secure desktop keeps failing until the
+        // user returns, so back off instead of spinning
+        int backoff_ms = (std::min)(10 << (std::min)(attempt, 6), kMaxBackoffMs);
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+    }
+    
+    return false;
 }
 
-// Destructor - Cleanup is handled in Stop()
-ScreenCaptureEncoder::~ScreenCaptureEncoder() {
-    Stop();  // Ensure everything is cleaned up
+// Main capture loop (runs in separate thread)
+void ScreenCaptureEncoder::CaptureLoop() {
+    std::cout << "Capture loop started" << std::endl;
+    
+    uint64_t frame_count = 0;
+    auto next_capture_time = std::chrono::steady_clock::now();  // Event-driven fps cap
+    
+    LARGE_INTEGER qpc_frequency = {};
+    QueryPerformanceFrequency(&qpc_frequency);
+    
+    ApplyControlChanges();  // Publishes the initial settings
+    
+    while (running_) {
+        // Control changes and window moves are only applied between frames
+        ApplyControlChanges();
+        TrackCaptureWindow();
+        
+        // Event-driven: hold off until the next frame slot. Updates in the meantime
+        // accumulate in the duplication and are picked up in one acquire.
+        // (Replay has no source events and keeps the fixed frame interval.)
+        if (capture_timing_ == CaptureTiming::kEvent && !replay_) {
+            auto wait = next_capture_time - std::chrono::steady_clock::now();
+            if (wait > std::chrono::steady_clock::duration::zero()) {
+                std::this_thread::sleep_for(wait);
+            }
+        }
+        
+        // Vblank: capture right after the refresh DWM composes the desktop for,
+        // so every tick sees the same phase of the game's present cycle
+        bool vblank_tick = capture_timing_ == CaptureTiming::kVblank && !replay_;
+        if (vblank_tick) {
+            WaitForCaptureVblank();
+        }
+        
+        // Capture frame
+        ID3D11Texture2D* acquired_texture = nullptr;
+        DXGI_OUTDUPL_FRAME_INFO frame_info = {};
+        
+        bool cursor_only = false;
+        if (CaptureFrame(&acquired_texture, &frame_info)) {
+            // Stamp once the acquire has returned: in event mode it blocks
+            // until the desktop changes (up to 100 ms), and this value becomes
+            // the frame's pts, send delay base and timing SEI
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::high_resolution_clock::now() - start_time_);
+            uint64_t timestamp = elapsed.count();
+            
+            // How long the newest desktop update waited before we picked it up
+            if (!replay_ && frame_info.LastPresentTime.QuadPart != 0 && qpc_frequency.QuadPart != 0) {
+                LARGE_INTEGER qpc_now = {};
+                QueryPerformanceCounter(&qpc_now);
+                
+                // Phase error: how far after its vblank the tick's frame was acquired
+                if (vblank_tick && last_vblank_qpc_.QuadPart != 0) {
+                    uint64_t phase_us = static_cast<uint64_t>(
+                        (qpc_now.QuadPart - last_vblank_qpc_.QuadPart) * 1000000 / qpc_frequency.QuadPart);
+                    vblank_phase_us_ += phase_us;
+                    vblank_phase_frames_++;
+                    if (phase_us > vblank_phase_max_us_) {
+                        vblank_phase_max_us_ = phase_us;
+                    }
+                }
+                
+                LONGLONG waited = qpc_now.QuadPart - frame_info.LastPresentTime.QuadPart;
+                if (waited >= 0) {
+                    acquire_latency_us_ += static_cast<uint64_t>(waited * 1000000 / qpc_frequency.QuadPart);
+                    acquire_latency_frames_++;
+                }
+            }
+            
+            if (latency_probe_) {
+                latency_probe_->MarkCaptured(static_cast<uint32_t>(replay_->frames_played() - 1));
+            }
+            
+            // Unpaced replay runs faster than real time; stamp content time instead
+            if (replay_ && replay_settings_.unpaced) {
+                timestamp = replay_->content_frame() * 1000000ULL / fps_;
+            }
+            
+            // With client-side cursors a pointer-only update needs no encode at all
+            if (cursor_mode_ == CursorMode::kMetadata) {
+                cursor_only = frame_info.LastPresentTime.QuadPart == 0;
+                if (client_connected_) {
+                    QueueCursorUpdates(frame_info, timestamp);
+                }
+            }
+            
+            // Frames keep going to the mailbox without a client (the encode
+            // thread leaves them there), so a client that joins gets the
+            // current desktop as its IDR without waiting for the next change
+            if (!cursor_only) {
+                if (force_full_frame_.exchange(false)) {
+                    frame_rects_full_ = true;
+                }
+                
+                // Draw the pointer on an owned copy of the desktop
+                ID3D11Texture2D* composed_texture = nullptr;
+                if (cursor_ && cursor_mode_ == CursorMode::kComposite) {
+                    composed_texture = cursor_->Compose(acquired_texture, active_region_,
+                                                        frame_info.LastPresentTime.QuadPart != 0);
+                }
+                
+                // Only the capture region goes through conversion and encoding
+                // (the composed canvas already is just the region)
+                ID3D11Texture2D* source_texture = composed_texture;
+                if (source_texture) {
+                    source_texture->AddRef();
+                } else {
+                    source_texture = CropToRegion(acquired_texture);
+                }
+                std::vector<RECT> changes;
+                if (source_texture && (recorder_ || scroll_detector_)) {
+                    CollectRegionChanges(composed_texture != nullptr, changes);
+                }
+                if (source_texture && recorder_) {
+                    RecordSourceFrame(source_texture, changes, timestamp);
+                }
+                if (source_texture && scroll_detector_) {
+                    DetectMotion(source_texture, changes);
+                }
+                
+                // Conversion and encoding happen on the encode thread from an owned copy
+                if (source_texture) {
+                    bool active = idle_fps_ == 0 ||
+                                  IsActiveFrame(frame_info, composed_texture != nullptr);
+                    QueueCapturedFrame(source_texture, timestamp, active);
+                }
+                if (source_texture) {
+                    source_texture->Release();
+                }
+                if (composed_texture) {
+                    composed_texture->Release();
+                }
+            }
+            acquired_texture->Release();
+            
+            // Release the frame back to desktop duplication
+            ReleaseCapturedFrame();
+            
+            frame_count++;
+            frames_captured_++;
+            
+            // Frame slots stay on a grid so bursts are capped at fps on average;
+            // after an idle period the next frame is taken immediately
+            if (!cursor_only) {
+                auto now = std::chrono::steady_clock::now();
+                next_capture_time += std::chrono::microseconds(frame_duration_ / 10);
+                if (next_capture_time < now) {
+                    next_capture_time = now;
+                }
+            }
+        }
+        
+        // One bad frame is not worth a rebuild; a converter/encoder that keeps
+        // failing is. Duplication and device failures are acted on immediately.
+        const int kMaxEncodeFailures = 3;
+        bool encode_stuck = consecutive_encode_failures_ >= kMaxEncodeFailures;
+        if (failed_component_ == PipelineComponent::kDuplication ||
+            failed_component_ == PipelineComponent::kDevice || encode_stuck) {
+            PipelineComponent failed = failed_component_;
+            if (failed == PipelineComponent::kNone) {
+                failed = encode_failed_component_;
+            }
+            if (failed == PipelineComponent::kNone) {
+                failed = PipelineComponent::kEncoder;
+            }
+            
+            // The encode thread waits until the pipeline is whole again
+            std::lock_guard<std::mutex> pipeline_lock(pipeline_mutex_);
+            if (!RecoverPipeline(failed)) {
+                break;  // Stopped while recovering
+            }
+            
+            // Mode changes surface as ACCESS_LOST; the new duplication tells us the new size
+            UpdateCaptureRegion(capture_region_);
+            continue;
+        }
+        
+        // Pointer updates go out at input rate and unpaced replay as fast as
+        // the encoder allows; everything else is paced to the frame rate
+        if (cursor_only || (replay_ && replay_settings_.unpaced && !replay_->finished())) {
+            continue;
+        }
+        
+        // Event-driven capture is paced by the frame slots above, vblank capture
+        // by the display
+        if (capture_timing_ != CaptureTiming::kPoll && !replay_) {
+            continue;
+        }
+        
+        // Sleep to maintain target FPS
+        // frame_duration_ is in 100ns units, we need milliseconds
+        uint64_t frame_duration_ms = frame_duration_ / 10000;
+        std::this_thread::sleep_for(std::chrono::milliseconds(frame_duration_ms));
+    }
+    
+    std::cout << "Capture loop ended. Frames captured: " << frame_count << std::endl;
 }
 
-// Main initialization function - sets up all subsystems
-bool ScreenCaptureEncoder::Initialize(int width, int height, int fps, const std::wstring& pipe_name) {
-    width_ = width;
-    height_ = height;
-    fps_ = fps;
-    pipe_name_ = pipe_name;
+// Encode loop: converts and encodes the newest captured frame while the
+// capture thread acquires the next one
+void ScreenCaptureEncoder::EncodeLoop() {
+    std::cout << "Encode loop started" << std::endl;
     
-    // Calculate frame duration in 100-nanosecond units (Media Foundation uses this)
-    // Example: 60 FPS = 16.67ms = 166,667 * 100ns
-    frame_duration_ = 10000000ULL / fps_;  // 10,000,000 = 1 second in 100ns units
+    // Frames wait in the mailbox while nobody is listening, so a joining
+    // client starts from the freshest image; with nothing new since the last
+    // encode it gets the held frame again
+    auto has_work = [this] {
+        return client_connected_ && (mailbox_frame_ >= 0 || (join_pending_ && held_frame_ >= 0));
+    };
     
-    // Initialize COM (Component Object Model) - required for DirectX and Media Foundation
-    // COINIT_MULTITHREADED allows COM objects to be called from any thread
-    HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-    if (FAILED(hr)) {
-        std::cerr << "Failed to initialize COM: 0x" << std::hex << hr << std::endl;
-        return false;
+    // B-frame layers keep the last frames in the encoder until more arrive. When
+    // capture goes quiet for a frame interval, the held frame is encoded again
+    // (an almost free skip picture) until the held frames have come out.
+    auto needs_drain = [this] {
+        return client_connected_ && drain_pts_ >= 0 && held_frame_ >= 0 && mailbox_frame_ < 0;
+    };
+    
+    while (running_) {
+        bool repeat = false;
+        {
+            std::unique_lock<std::mutex> lock(ring_mutex_);
+            auto timeout = needs_drain() ? std::chrono::milliseconds(1000 / (std::max)(fps_, 1))
+                                           : std::chrono::milliseconds(100);
+            ring_cv_.wait_for(lock, timeout, [&] { return has_work() || !running_; });
+            if (!has_work()) {
+                if (!running_ || !needs_drain()) {
+                    continue;
+                }
+                repeat = true;
+            }
+            
+            // Idle rate: small changes wait for the next idle slot while newer
+            // frames keep replacing them; an active frame (or a join) goes through at
+            // once, and a drain repeat has no mailbox frame to gate
+            if (!repeat && !join_pending_ && idle_rate_ && mailbox_frame_ >= 0 &&
+                !frame_ring_[mailbox_frame_].active &&
+                std::chrono::steady_clock::now() < next_idle_encode_) {
+                ring_cv_.wait_until(lock, next_idle_encode_, [this] {
+                    return !running_ || join_pending_ || (mailbox_frame_ >= 0 && frame_ring_[mailbox_frame_].active);
+                });
+                continue;
+            }
+        }
+        
+        // Reconfiguration and recovery hold the pipeline (and may release the ring),
+        // so the slot is only taken once the pipeline is ours
+        std::lock_guard<std::mutex> pipeline_lock(pipeline_mutex_);
+        int slot = -1;
+        {
+            std::lock_guard<std::mutex> lock(ring_mutex_);
+            if (repeat ? !needs_drain() : !has_work()) {
+                continue;  // Dropped by a device reset, or the client left
+            }
+            if (repeat) {
+                slot = held_frame_;
+                held_frame_ = -1;
+                frame_ring_[slot].timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::high_resolution_clock::now() - start_time_).count();
+                frame_ring_[slot].active = false;
+                frame_ring_[slot].moves.clear();  // Already sent with the original
+                frames_repeated_++;
+            } else if (mailbox_frame_ >= 0) {
+                slot = mailbox_frame_;
+                mailbox_frame_ = -1;
+            } else {
+                slot = held_frame_;
+                held_frame_ = -1;
+                frame_ring_[slot].timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::high_resolution_clock::now() - start_time_).count();
+                frames_rejoined_++;
+            }
+            join_pending_ = false;
+        }
+        
+        if (idle_fps_ > 0 && !repeat) {
+            UpdateRateGovernor(frame_ring_[slot].active);
+        }
+        ProcessCapturedFrame(frame_ring_[slot]);
+        
+        // Drained once the last real frame has come out of the encoder (a
+        // reopened encoder dropped it; repeats then run until the window is clear)
+        if (!ffmpeg_encoder_) {
+            drain_pts_ = -1;
+        } else {
+            if (!repeat) {
+                drain_pts_ = ffmpeg_encoder_->LastPts();
+            }
+            if (ffmpeg_encoder_->LastOutputPts() >= drain_pts_) {
+                drain_pts_ = -1;
+            }
+        }
+        
+        std::lock_guard<std::mutex> lock(ring_mutex_);
+        if (held_frame_ >= 0) {
+            free_frames_.push_back(held_frame_);
+        }
+        held_frame_ = slot;
     }
     
-    // Initialize Media Foundation - required for video encoding
-    // MFStartup must be called before using any MF APIs
-    hr = MFStartup(MF_VERSION);  // MF_VERSION ensures version compatibility
-    if (FAILED(hr)) {
-        std::cerr << "Failed to initialize Media Foundation: 0x" << std::hex << hr << std::endl;
-        CoUninitialize();  // Cleanup COM if MF fails
-        return false;
+    std::cout << "Encode loop ended" << std::endl;
+}
+
+bool ScreenCaptureEncoder::QueueCapturedFrame(ID3D11Texture2D* texture, uint64_t timestamp, bool active) {
+    int slot = -1;
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex_);
+        if (free_frames_.empty()) {
+            return false;  // Not reachable with kFrameRingSize slots
+        }
+        slot = free_frames_.back();
+        free_frames_.pop_back();
     }
     
-    // Initialize each subsystem in order
-    if (!InitializeD3D11()) {
-        std::cerr << "Failed to initialize D3D11" << std::endl;
-        return false;
+    CapturedFrame& frame = frame_ring_[slot];
+    D3D11_TEXTURE2D_DESC desc = {};
+    texture->GetDesc(&desc);
+    if (frame.texture) {
+        D3D11_TEXTURE2D_DESC existing = {};
+        frame.texture->GetDesc(&existing);
+        if (existing.Width != desc.Width || existing.Height != desc.Height || existing.Format != desc.Format) {
+            frame.texture->Release();
+            frame.texture = nullptr;
+        }
+    }
+    if (!frame.texture) {
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = desc.Format == DXGI_FORMAT_NV12  // NV12 replay
+                             ? D3D11_BIND_SHADER_RESOURCE
+                             : D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+        desc.CPUAccessFlags = 0;
+        desc.MiscFlags = 0;
+        HRESULT hr = d3d_device_->CreateTexture2D(&desc, nullptr, &frame.texture);
+        if (FAILED(hr)) {
+            std::cerr << "Failed to create frame ring texture: 0x" << std::hex << hr << std::dec << std::endl;
+            std::lock_guard<std::mutex> lock(ring_mutex_);
+            free_frames_.push_back(slot);
+            return false;
+        }
     }
     
-    if (!InitializeDuplication()) {
-        std::cerr << "Failed to initialize desktop duplication" << std::endl;
-        return false;
+    // GPU copy; the source (duplication frame) can be released as soon as it is queued
+    d3d_context_->CopyResource(frame.texture, texture);
+    frame.timestamp = timestamp;
+    frame.source_width = static_cast<int>(desc.Width);
+    frame.source_height = static_cast<int>(desc.Height);
+    frame.active = active;
+    frame.moves.swap(frame_moves_);
+    frame_moves_.clear();
+    
+    // Latest frame wins: an older frame the encoder has not started on is
+    // replaced, so encoding always starts from the freshest image
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex_);
+        if (mailbox_frame_ >= 0) {
+            // The replaced frame's changes are part of the newer image
+            frame.active = frame.active || frame_ring_[mailbox_frame_].active;
+            frame.moves.clear();  // Relative to a frame that will not be encoded
+            free_frames_.push_back(mailbox_frame_);
+            frames_superseded_++;
+        }
+        mailbox_frame_ = slot;
     }
+    ring_cv_.notify_one();
+    return true;
+}
+
+// Active: the whole frame changed (or the change is unknown), the drawn pointer
+// moved, or at least kActiveChangeFraction of the captured area changed.
+// Caret blinks, clocks and spinners stay below that.
+bool ScreenCaptureEncoder::IsActiveFrame(const DXGI_OUTDUPL_FRAME_INFO& frame_info, bool pointer_drawn) {
+    const double kActiveChangeFraction = 0.005;
     
-    std::cout << "Initializing video encoder..." << std::endl;
-    if (!InitializeVideoEncoder()) {
-        std::cerr << "Failed to initialize video encoder" << std::endl;
-        return false;
+    if (frame_rects_full_) {
+        return true;
+    }
+    if (pointer_drawn && frame_info.LastMouseUpdateTime.QuadPart != 0) {
+        return true;
     }
     
-    if (!InitializeNamedPipe()) {
-        std::cerr << "Failed to initialize named pipe" << std::endl;
-        return false;
+    uint64_t changed = 0;
+    for (const RECT& rect : frame_dirty_rects_) {
+        RECT clipped = {};
+        if (IntersectRect(&clipped, &rect, &active_region_)) {
+            changed += static_cast<uint64_t>(clipped.right - clipped.left) * (clipped.bottom - clipped.top);
+        }
     }
+    uint64_t total = static_cast<uint64_t>(active_region_.right - active_region_.left) *
+                     (active_region_.bottom - active_region_.top);
+    return total == 0 || changed >= total * kActiveChangeFraction;
+}
+
+void ScreenCaptureEncoder::UpdateRateGovernor(bool active) {
+    const auto kIdleAfter = std::chrono::seconds(1);
     
-    std::cout << "Initialization complete!" << std::endl;
-    return true;
+    auto now = std::chrono::steady_clock::now();
+    if (active) {
+        last_activity_ = now;
+        if (idle_rate_) {
+            idle_rate_ = false;
+            std::cout << "Rate governor: activity, full rate" << std::endl;
+        }
+    } else if (!idle_rate_ && now - last_activity_ >= kIdleAfter) {
+        idle_rate_ = true;
+        std::cout << "Rate governor: idle, " << idle_fps_ << " fps" << std::endl;
+    }
+    
+    if (idle_rate_) {
+        next_idle_encode_ = now + std::chrono::microseconds(1000000 / idle_fps_);
+    }
 }
 
-// Initialize Direct3D 11 device and context
-bool ScreenCaptureEncoder::InitializeD3D11() {
-    // Feature levels to try (DirectX version support)
-    // D3D_FEATURE_LEVEL_11_0 = DirectX 11.0 (most common)
-    D3D_FEATURE_LEVEL feature_levels[] = {
-        D3D_FEATURE_LEVEL_11_0  // We need at least D3D11 for desktop duplication
-    };
+void ScreenCaptureEncoder::ProcessCapturedFrame(const CapturedFrame& frame) {
+    // Frames queued before a region/desktop resize no longer match the converter input
+    D3D11_TEXTURE2D_DESC desc = {};
+    frame.texture->GetDesc(&desc);
+    if (static_cast<int>(desc.Width) != source_width_ || static_cast<int>(desc.Height) != source_height_) {
+        return;
+    }
+    if (!color_converter_ || !ffmpeg_encoder_) {
+        ++consecutive_encode_failures_;  // Rebuilt by the capture thread's recovery
+        return;
+    }
     
-    D3D_FEATURE_LEVEL feature_level_out;  // Will receive actual feature level
+    if (analyzer_) {
+        ApplyPreAnalysis(frame);
+    }
     
-    // Create D3D11 device and immediate context
-    // nullptr = use default adapter (primary GPU)
-    // D3D_DRIVER_TYPE_HARDWARE = use GPU hardware acceleration
-    // D3D11_CREATE_DEVICE_BGRA_SUPPORT = support BGRA format (needed for desktop capture)
-    UINT device_flags = D3D11_CREATE_DEVICE_BGRA_SUPPORT | D3D11_CREATE_DEVICE_VIDEO_SUPPORT;
-    HRESULT hr = D3D11CreateDevice(
-        nullptr,                           // Use default adapter (primary GPU)
-        D3D_DRIVER_TYPE_HARDWARE,         // Use hardware GPU (not software emulation)
-        nullptr,                           // No software rasterizer DLL
-        device_flags,                     // Support BGRA + video processing
-        feature_levels,                    // Array of feature levels to try
-        1,                                 // Number of feature levels in array
-        D3D11_SDK_VERSION,                // SDK version
-        &d3d_device_,                     // OUT: receives device pointer
-        &feature_level_out,               // OUT: receives actual feature level
-        &d3d_context_                     // OUT: receives context pointer
-    );
+    // A pending resize rides on the next IDR (forced or end of GOP)
+    int gop_size = ffmpeg_encoder_->GopSize();
+    if (pending_width_ != 0 &&
+        (force_keyframe_ || (gop_size > 0 && frames_since_keyframe_ + 1 >= gop_size))) {
+        if (!ApplyPendingResize()) {
+            ++consecutive_encode_failures_;
+            return;
+        }
+    }
+    if (force_keyframe_.exchange(false)) {
+        ffmpeg_encoder_->RequestKeyframe();
+    }
     
-    if (FAILED(hr)) {
-        std::cerr << "D3D11CreateDevice failed: 0x" << std::hex << hr << std::endl;
-        return false;
+    // Hints describe the change from the previous frame in capture order; with
+    // layers, packets leave in decode order and the previous frame may be shed
+    if (!frame.moves.empty() && temporal_layers_ == 1) {
+        QueueMotionHints(frame);
+    }
+    if (EncodeVideoFrame(frame.texture, frame.timestamp)) {
+        consecutive_encode_failures_ = 0;
+        encode_failed_component_ = PipelineComponent::kNone;
+    } else {
+        ++consecutive_encode_failures_;
     }
+}
 
-    // Create DXGI device manager for Media Foundation MFTs (hardware path).
-    hr = MFCreateDXGIDeviceManager(&reset_token_, &dxgi_manager_);
-    if (FAILED(hr)) {
-        std::cerr << "MFCreateDXGIDeviceManager failed: 0x" << std::hex << hr << std::endl;
-        return false;
+// Scene cuts get the IDR: the picture changes completely anyway, so an IDR
+// there costs little extra, and it restarts the GOP instead of one landing
+// mid-scene later. The bitrate is raised for half a second so the IDR and the
+// frames that follow it are not starved by CBR.
+void ScreenCaptureEncoder::ApplyPreAnalysis(const CapturedFrame& frame) {
+    auto start = std::chrono::steady_clock::now();
+    bool analysed = analyzer_->Analyze(d3d_context_, frame.texture);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    analysis_time_us_ += elapsed.count();
+    analysis_frames_++;
+    
+    // The boost lasts half a second of wall time, however few frames that is
+    // (event capture and the idle governor encode only on changes)
+    auto now = std::chrono::steady_clock::now();
+    if (budget_boost_until_ != std::chrono::steady_clock::time_point() && now >= budget_boost_until_) {
+        budget_boost_until_ = std::chrono::steady_clock::time_point();
+        ffmpeg_encoder_->SetBitrate(bitrate_);
+    }
+    if (!analysed) {
+        return;
+    }
+    last_spatial_ = analyzer_->spatial();
+    last_temporal_ = analyzer_->temporal();
+    
+    // Flashing content must not turn into a stream of IDRs
+    int min_spacing = (std::max)(1, fps_ / 2);
+    if (analyzer_->scene_cut() && frames_since_keyframe_ >= min_spacing) {
+        scene_cuts_++;
+        force_keyframe_ = true;
+        budget_boost_until_ = now + std::chrono::milliseconds(500);
+        ffmpeg_encoder_->SetBitrate(static_cast<int>(static_cast<int64_t>(bitrate_) * 3 / 2));
     }
+}
 
-    hr = dxgi_manager_->ResetDevice(d3d_device_, reset_token_);
-    if (FAILED(hr)) {
-        std::cerr << "DXGIDeviceManager ResetDevice failed: 0x" << std::hex << hr << std::endl;
-        return false;
+void ScreenCaptureEncoder::ReleaseFrameRing() {
+    std::lock_guard<std::mutex> lock(ring_mutex_);
+    for (auto& frame : frame_ring_) {
+        if (frame.texture) {
+            frame.texture->Release();
+            frame.texture = nullptr;
+        }
+    }
+    
+    // The mailbox and held frames referenced old textures; their slots are free again
+    if (mailbox_frame_ >= 0) {
+        free_frames_.push_back(mailbox_frame_);
+        mailbox_frame_ = -1;
+    }
+    if (held_frame_ >= 0) {
+        free_frames_.push_back(held_frame_);
+        held_frame_ = -1;
+    }
+}
+
+// Pipe writing loop (sends frames to Go process)
+void ScreenCaptureEncoder::PipeWriteLoop() {
+    std::cout << "Pipe write loop started" << std::endl;
+    
+    // Lowest temporal layer being shed (0 = none). Once a layer is shed, frames
+    // at or above it may reference the missing one, so it stays shed until the
+    // next base-layer frame whatever the backlog does in between.
+    int shed_from_layer = 0;
+    
+    while (running_) {
+        if (!client_connected_) {
+            auto wait_start = std::chrono::steady_clock::now();
+            if (!WaitForClient()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - wait_start);
+            std::cout << "Client reconnected after " << waited.count() << " ms" << std::endl;
+        }
+        
+        EncodedFrame frame;
+        bool has_frame = false;
+        size_t backlog = 0;
+        
+        // Check queue for frames
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);  // Lock mutex
+            if (!frame_queue_.empty()) {
+                frame = frame_queue_.front();  // Copy front frame
+                frame_queue_.pop();             // Remove from queue
+                has_frame = true;
+                backlog = frame_queue_.size();
+            }
+        }  // Mutex automatically unlocked when lock_guard goes out of scope
+        
+        if (has_frame) {
+            // Frames encoded before the reconnect IDR cannot be decoded by the new client
+            if (awaiting_keyframe_ && !frame.is_audio && !frame.is_cursor) {
+                if (!frame.is_keyframe) {
+                    frames_dropped_++;
+                    continue;
+                }
+                awaiting_keyframe_ = false;
+                join_latency_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - join_time_).count();
+            }
+            
+            // A backed-up client loses the top temporal layer first (half the
+            // frame rate), then the next; what remains still decodes
+            if (!frame.is_audio && !frame.is_cursor && !frame.is_motion) {
+                if (frame.temporal_layer == 0) {
+                    shed_from_layer = 0;
+                } else if (backlog >= kShedBacklog * static_cast<size_t>(temporal_layers_ - frame.temporal_layer) &&
+                           (shed_from_layer == 0 || frame.temporal_layer < shed_from_layer)) {
+                    shed_from_layer = frame.temporal_layer;
+                }
+                if (shed_from_layer > 0 && frame.temporal_layer >= shed_from_layer) {
+                    frames_shed_++;
+                    continue;
+                }
+            }
+            
+            if (SendFrameToPipe(frame)) {
+                frames_sent_++;
+                bytes_sent_ += frame.data.size();
+                if (!frame.is_audio && !frame.is_cursor && !frame.is_motion) {
+                    auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::high_resolution_clock::now() - start_time_);
+                    uint64_t delay = static_cast<uint64_t>((std::max)(0LL, static_cast<long long>(now.count()) -
+                                                                           static_cast<long long>(frame.timestamp)));
+                    send_delay_us_ += delay;
+                    send_delay_frames_++;
+                    if (delay > send_delay_max_us_) {
+                        send_delay_max_us_ = delay;
+                    }
+                    if (latency_probe_) {
+                        latency_probe_->Submit(frame.data.data(), frame.data.size());
+                    }
+                }
+            } else if (!client_connected_) {
+                DisconnectClient();
+            }
+        } else {
+            // No frames, sleep briefly
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
     }
     
-    std::cout << "D3D11 device created successfully" << std::endl;
-    return true;
+    std::cout << "Pipe write loop ended" << std::endl;
 }
 
-// Initialize Desktop Duplication API for screen capture
-bool ScreenCaptureEncoder::InitializeDuplication() {
-    // Get DXGI device from D3D11 device
-    // QueryInterface converts d3d_device_ to IDXGIDevice interface
-    IDXGIDevice* dxgi_device = nullptr;
-    HRESULT hr = d3d_device_->QueryInterface(__uuidof(IDXGIDevice), 
-                                             reinterpret_cast<void**>(&dxgi_device));
-    if (FAILED(hr)) {
-        std::cerr << "Failed to get DXGI device: 0x" << std::hex << hr << std::endl;
+// Capture one frame from desktop
+bool ScreenCaptureEncoder::CaptureFrame(ID3D11Texture2D** out_texture, DXGI_OUTDUPL_FRAME_INFO* frame_info) {
+    PipelineComponent fault = static_cast<PipelineComponent>(
+        pending_fault_.exchange(static_cast<int>(PipelineComponent::kNone)));
+    if (fault == PipelineComponent::kDuplication || fault == PipelineComponent::kDevice) {
+        std::cout << "Injected capture fault" << std::endl;
+        failed_component_ = fault;
         return false;
     }
-    
-    // Get DXGI adapter (represents physical GPU)
-    IDXGIAdapter* dxgi_adapter = nullptr;
-    hr = dxgi_device->GetAdapter(&dxgi_adapter);  // Get parent adapter
-    dxgi_device->Release();  // Release DXGI device (no longer needed)
-    
-    if (FAILED(hr)) {
-        std::cerr << "Failed to get DXGI adapter: 0x" << std::hex << hr << std::endl;
-        return false;
+    if (fault != PipelineComponent::kNone) {
+        pending_fault_ = static_cast<int>(fault);  // Consumed by EncodeVideoFrame
     }
     
-    // Get output (monitor) - 0 is primary monitor
-    IDXGIOutput* dxgi_output = nullptr;
-    hr = dxgi_adapter->EnumOutputs(0, &dxgi_output);  // Enumerate output 0 (primary)
-    dxgi_adapter->Release();  // Release adapter (no longer needed)
+    frame_dirty_rects_.clear();
+    frame_move_rects_.clear();
+    frame_moves_.clear();
+    frame_rects_full_ = false;
     
-    if (FAILED(hr)) {
-        std::cerr << "Failed to get DXGI output: 0x" << std::hex << hr << std::endl;
-        return false;
+    if (replay_) {
+        // The replay texture stands in for the desktop, so its rects are in captured coordinates
+        if (!replay_->NextFrame(out_texture, frame_info)) {
+            return false;
+        }
+        frame_rects_full_ = replay_->changed_full();
+        frame_dirty_rects_ = replay_->changed_rects();
+        return true;
+    }
+    if (outputs_.size() > 1) {
+        return CaptureComposite(out_texture, frame_info);
+    }
+    // On a vblank tick the composed frame follows within a fraction of the refresh;
+    // a frame that misses that window belongs to the next tick
+    UINT timeout_ms = 100;
+    if (capture_timing_ == CaptureTiming::kVblank && outputs_[0].refresh_rate.Numerator != 0) {
+        timeout_ms = (std::max)(1u, 500u * outputs_[0].refresh_rate.Denominator /
+                                    outputs_[0].refresh_rate.Numerator);
+    }
+    return AcquireOutputFrame(outputs_[0], timeout_ms, frame_info, out_texture);
+}
+
+void ScreenCaptureEncoder::WaitForCaptureVblank() {
+    if (outputs_.empty() || !outputs_[0].output) {
+        return;
     }
     
-    // Query for IDXGIOutput1 interface (needed for duplication)
-    IDXGIOutput1* dxgi_output1 = nullptr;
-    hr = dxgi_output->QueryInterface(__uuidof(IDXGIOutput1), 
-                                     reinterpret_cast<void**>(&dxgi_output1));
-    dxgi_output->Release();  // Release base output
+    // Every Nth refresh, so the tick rate is the refresh rate divided down to at most fps
+    const DXGI_RATIONAL& refresh = outputs_[0].refresh_rate;
+    double refresh_hz = refresh.Denominator != 0 && refresh.Numerator != 0
+                            ? static_cast<double>(refresh.Numerator) / refresh.Denominator
+                            : 60.0;
+    // Rounded up so the tick rate never exceeds fps (144 Hz at 60 fps ticks
+    // every 3rd refresh, 48 fps); the slack keeps 59.94 Hz at 60 fps on every refresh
+    int divider = (std::max)(1, static_cast<int>(std::ceil(refresh_hz / fps_ - 0.01)));
     
-    if (FAILED(hr)) {
-        std::cerr << "Failed to get IDXGIOutput1: 0x" << std::hex << hr << std::endl;
-        return false;
+    for (int i = 0; i < divider; ++i) {
+        if (FAILED(outputs_[0].output->WaitForVBlank())) {
+            // Display off or output gone: keep ticking at the frame interval
+            std::this_thread::sleep_for(std::chrono::milliseconds(frame_duration_ / 10000));
+            break;
+        }
     }
+    QueryPerformanceCounter(&last_vblank_qpc_);
+}
+
+bool ScreenCaptureEncoder::AcquireOutputFrame(DuplicatedOutput& output, UINT timeout_ms,
+                                              DXGI_OUTDUPL_FRAME_INFO* frame_info,
+                                              ID3D11Texture2D** out_texture) {
+    IDXGIResource* desktop_resource = nullptr;
     
-    // Create desktop duplication output
-    // This gives us a handle to capture frames from the desktop
-    hr = dxgi_output1->DuplicateOutput(d3d_device_, &desktop_duplication_);
-    dxgi_output1->Release();  // Release output1
+    // Acquire next frame
+    // This blocks until a new frame is available or timeout occurs
+    HRESULT hr = output.duplication->AcquireNextFrame(
+        timeout_ms,         // Timeout in milliseconds
+        frame_info,         // OUT: frame info (metadata)
+        &desktop_resource   // OUT: resource containing frame
+    );
     
-    if (FAILED(hr)) {
-        std::cerr << "DuplicateOutput failed: 0x" << std::hex << hr << std::endl;
-        std::cerr << "This can fail if another process is already capturing or in a game" << std::endl;
+    if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
+        // No new frame available (desktop hasn't changed)
         return false;
     }
     
-    std::cout << "Desktop duplication initialized successfully" << std::endl;
-    return true;
-}
-
-// Initialize H.264 video encoder using Media Foundation
-bool ScreenCaptureEncoder::InitializeVideoEncoder() {
-    HRESULT hr;
-
-    std::cout << "[Encoder] Initializing GPU pipeline..." << std::endl;
-
-    // Create GPU video processor (RGB32 -> NV12)
-    hr = CoCreateInstance(CLSID_VideoProcessorMFT, nullptr, CLSCTX_INPROC_SERVER,
-                          IID_PPV_ARGS(&color_converter_));
-    if (FAILED(hr)) {
-        std::cerr << "Failed to create video processor MFT: 0x" << std::hex << hr << std::endl;
+    if (hr == DXGI_ERROR_ACCESS_LOST || hr == E_ACCESSDENIED) {
+        // Mode change, fullscreen switch or secure desktop (UAC):
+        // the duplication must be re-created
+        std::cout << "Desktop duplication lost: 0x" << std::hex << hr << std::dec << std::endl;
+        failed_component_ = PipelineComponent::kDuplication;
         return false;
     }
-    std::cout << "[Encoder] Video processor MFT created" << std::endl;
-
-    IMFAttributes* cc_attrs = nullptr;
-    if (SUCCEEDED(color_converter_->GetAttributes(&cc_attrs)) && cc_attrs) {
-        cc_attrs->SetUINT32(MF_SA_D3D11_AWARE, TRUE);
-        cc_attrs->Release();
-    }
-    color_converter_->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER,
-                                     reinterpret_cast<ULONG_PTR>(dxgi_manager_));
-    std::cout << "[Encoder] Video processor D3D manager set" << std::endl;
-
-    IMFMediaType* rgb_type = nullptr;
-    hr = MFCreateMediaType(&rgb_type);
-    if (FAILED(hr)) return false;
-    rgb_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
-    rgb_type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_RGB32);
-    rgb_type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
-    MFSetAttributeSize(rgb_type, MF_MT_FRAME_SIZE, width_, height_);
-    MFSetAttributeRatio(rgb_type, MF_MT_FRAME_RATE, fps_, 1);
-    MFSetAttributeRatio(rgb_type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
-
-    hr = color_converter_->SetInputType(0, rgb_type, 0);
-    rgb_type->Release();
-    if (FAILED(hr)) {
-        std::cerr << "Failed to set color converter input type: 0x" << std::hex << hr << std::endl;
+    
+    if (hr == DXGI_ERROR_DEVICE_REMOVED || hr == DXGI_ERROR_DEVICE_RESET) {
+        std::cerr << "D3D11 device lost: 0x" << std::hex << hr << std::dec << std::endl;
+        failed_component_ = PipelineComponent::kDevice;
         return false;
     }
-    std::cout << "[Encoder] Video processor input type set" << std::endl;
-
-    IMFMediaType* nv12_type = nullptr;
-    hr = MFCreateMediaType(&nv12_type);
-    if (FAILED(hr)) return false;
-    nv12_type->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
-    nv12_type->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
-    nv12_type->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
-    MFSetAttributeSize(nv12_type, MF_MT_FRAME_SIZE, width_, height_);
-    MFSetAttributeRatio(nv12_type, MF_MT_FRAME_RATE, fps_, 1);
-    MFSetAttributeRatio(nv12_type, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
-
-    hr = color_converter_->SetOutputType(0, nv12_type, 0);
-    nv12_type->Release();
+    
     if (FAILED(hr)) {
-        std::cerr << "Failed to set color converter output type: 0x" << std::hex << hr << std::endl;
+        std::cerr << "AcquireNextFrame failed: 0x" << std::hex << hr << std::endl;
         return false;
     }
-    std::cout << "[Encoder] Video processor output type set" << std::endl;
-
-    color_converter_->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0);
-    color_converter_->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, 0);
-
-    ffmpeg_encoder_ = std::make_unique<FfmpegNvencEncoder>();
-    if (!ffmpeg_encoder_->Initialize(d3d_device_, d3d_context_, width_, height_, fps_, 5000000)) {
-        std::cerr << "Failed to initialize FFmpeg NVENC encoder" << std::endl;
-        return false;
+    output.holds_frame = true;
+    
+    // Changed areas, for the recorder's sparse frame dump, the rate governor and motion hints
+    if ((recorder_ || idle_fps_ > 0 || scroll_detector_) && frame_info->LastPresentTime.QuadPart != 0) {
+        if (frame_info->TotalMetadataBufferSize > 0) {
+            CollectDirtyRects(output, frame_info->TotalMetadataBufferSize);
+        } else {
+            frame_rects_full_ = true;
+        }
     }
-
-    std::cout << "Video encoder initialized successfully (NVENC via FFmpeg)" << std::endl;
-    return true;
-}
-
-
-// Initialize named pipe for IPC with Go process
-bool ScreenCaptureEncoder::InitializeNamedPipe() {
-    // Create named pipe
-    // Format: \\.\pipe\PipeName
-    pipe_handle_ = CreateNamedPipeW(
-        pipe_name_.c_str(),                  // Pipe name
-        PIPE_ACCESS_OUTBOUND,                // Write-only access
-        PIPE_TYPE_BYTE | PIPE_WAIT,          // Byte-type, blocking mode
-        1,                                    // Max instances
-        65536,                                // Output buffer size (64KB)
-        0,                                    // Input buffer size (0 for outbound)
-        0,                                    // Default timeout
-        nullptr                               // Default security attributes
-    );
     
-    if (pipe_handle_ == INVALID_HANDLE_VALUE) {
-        std::cerr << "Failed to create named pipe. Error: " << GetLastError() << std::endl;
-        return false;
+    // Pointer shape and position only arrive with the frame that changed them
+    if (cursor_ && cursor_mode_ != CursorMode::kNone) {
+        if (frame_info->PointerShapeBufferSize > 0) {
+            cursor_->UpdateShape(output.duplication, frame_info->PointerShapeBufferSize);
+        }
+        if (frame_info->LastMouseUpdateTime.QuadPart != 0) {
+            // Every output reports the pointer; only the one it is on says visible
+            bool visible = frame_info->PointerPosition.Visible != FALSE;
+            if (visible || output.owns_pointer) {
+                for (auto& other : outputs_) {
+                    other.owns_pointer = false;
+                }
+                output.owns_pointer = visible;
+                POINT position = {
+                    frame_info->PointerPosition.Position.x + output.desktop_rect.left - output_origin_.x,
+                    frame_info->PointerPosition.Position.y + output.desktop_rect.top - output_origin_.y
+                };
+                cursor_->UpdatePosition(visible, position);
+            }
+        }
     }
     
-    std::wcout << L"Named pipe created: " << pipe_name_ << std::endl;
-    std::cout << "Waiting for Go process to connect..." << std::endl;
+    // Query for ID3D11Texture2D interface
+    hr = desktop_resource->QueryInterface(__uuidof(ID3D11Texture2D), 
+                                          reinterpret_cast<void**>(out_texture));
+    desktop_resource->Release();  // Release resource
     
-    // Wait for client (Go process) to connect
-    // This blocks until a client calls CreateFile on the pipe
-    BOOL connected = ConnectNamedPipe(pipe_handle_, nullptr);
-    if (!connected && GetLastError() != ERROR_PIPE_CONNECTED) {
-        std::cerr << "Failed to connect pipe. Error: " << GetLastError() << std::endl;
-        CloseHandle(pipe_handle_);
-        pipe_handle_ = INVALID_HANDLE_VALUE;
+    if (FAILED(hr)) {
+        output.duplication->ReleaseFrame();
+        output.holds_frame = false;
         return false;
     }
     
-    std::cout << "Go process connected to pipe!" << std::endl;
     return true;
 }
 
-// Start capture threads
-bool ScreenCaptureEncoder::Start() {
-    if (running_) {
-        std::cerr << "Already running!" << std::endl;
-        return false;
-    }
+// Multi-output capture: wait up to one frame interval on the first output,
+// then collect whatever the other outputs have. Updated outputs are copied
+// into the composite on the GPU and their frames are released right away.
+bool ScreenCaptureEncoder::CaptureComposite(ID3D11Texture2D** out_texture,
+                                            DXGI_OUTDUPL_FRAME_INFO* frame_info) {
+    auto start = std::chrono::steady_clock::now();
+    UINT first_timeout_ms = static_cast<UINT>((std::max)(1, 1000 / fps_));
+    bool any_frame = false;
     
-    running_ = true;  // Set atomic flag
-    start_time_ = std::chrono::high_resolution_clock::now();  // Record start time
+    for (size_t i = 0; i < outputs_.size(); ++i) {
+        DuplicatedOutput& output = outputs_[i];
+        DXGI_OUTDUPL_FRAME_INFO info = {};
+        ID3D11Texture2D* texture = nullptr;
+        if (!AcquireOutputFrame(output, i == 0 ? first_timeout_ms : 0, &info, &texture)) {
+            if (failed_component_ != PipelineComponent::kNone) {
+                ReleaseCapturedFrame();
+                return false;
+            }
+            continue;
+        }
+        
+        // LastPresentTime == 0 means only the pointer changed on this output
+        if (info.LastPresentTime.QuadPart != 0) {
+            d3d_context_->CopySubresourceRegion(
+                composite_texture_, 0,
+                output.desktop_rect.left - output_origin_.x,
+                output.desktop_rect.top - output_origin_.y, 0,
+                texture, 0, nullptr);
+        }
+        texture->Release();
+        output.duplication->ReleaseFrame();
+        output.holds_frame = false;
+        
+        // Merge frame info (pointer position is tracked by AcquireOutputFrame)
+        if (!any_frame) {
+            *frame_info = info;
+        } else {
+            frame_info->AccumulatedFrames += info.AccumulatedFrames;
+            if (info.LastPresentTime.QuadPart > frame_info->LastPresentTime.QuadPart) {
+                frame_info->LastPresentTime = info.LastPresentTime;
+            }
+        }
+        if (info.LastMouseUpdateTime.QuadPart > frame_info->LastMouseUpdateTime.QuadPart) {
+            frame_info->LastMouseUpdateTime = info.LastMouseUpdateTime;
+        }
+        any_frame = true;
+    }
     
-    // Launch capture thread
-    // std::thread constructor calls CaptureLoop() in a new thread
-    capture_thread_ = std::thread(&ScreenCaptureEncoder::CaptureLoop, this);
+    if (!any_frame) {
+        return false;
+    }
     
-    // Launch pipe writing thread
-    pipe_thread_ = std::thread(&ScreenCaptureEncoder::PipeWriteLoop, this);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    composite_frames_++;
+    composite_time_us_ += elapsed.count();
     
-    std::cout << "Capture started!" << std::endl;
+    composite_texture_->AddRef();
+    *out_texture = composite_texture_;
     return true;
 }
 
-// Stop capture threads
-void ScreenCaptureEncoder::Stop() {
-    if (!running_) {
-        return;  // Already stopped
-    }
-    
-    running_ = false;  // Clear atomic flag (threads will exit)
-    
-    // Wait for threads to finish
-    if (capture_thread_.joinable()) {
-        capture_thread_.join();  // Block until thread exits
-    }
-
-    if (pipe_thread_.joinable()) {
-        pipe_thread_.join();
+// Cursor messages (payload of a pipe message with flags bit2 set):
+//   position: [1: type=1] [4: x] [4: y] [1: visible] [8: shape hash]
+//             x/y are the shape's upper-left corner in encoded video pixels
+//   shape:    see CursorCompositor::SerializeShape; sent once per shape per client
+void ScreenCaptureEncoder::QueueCursorUpdates(const DXGI_OUTDUPL_FRAME_INFO& frame_info,
+                                              uint64_t timestamp) {
+    if (!cursor_) {
+        return;
     }
     
-    // Cleanup encoder
-    if (ffmpeg_encoder_) {
-        ffmpeg_encoder_->Shutdown();
-        ffmpeg_encoder_.reset();
-    }
-
-    if (color_converter_) {
-        color_converter_->ProcessMessage(MFT_MESSAGE_COMMAND_FLUSH, 0);
-        color_converter_->Release();
-        color_converter_ = nullptr;
+    bool resend = cursor_resend_.exchange(false);
+    if (resend) {
+        sent_cursor_shapes_.clear();
     }
     
+    std::vector<EncodedFrame> messages;
     
-    if (desktop_duplication_) {
-        desktop_duplication_->ReleaseFrame();  // Release any held frame
-        desktop_duplication_->Release();
-        desktop_duplication_ = nullptr;
-    }
-    
-    if (d3d_context_) {
-        d3d_context_->Release();
-        d3d_context_ = nullptr;
+    uint64_t hash = cursor_->shape_hash();
+    if (cursor_->has_shape()) {
+        // LRU: a hit moves to the back, a miss is sent and may evict the oldest
+        auto it = std::find(sent_cursor_shapes_.begin(), sent_cursor_shapes_.end(), hash);
+        if (it != sent_cursor_shapes_.end()) {
+            sent_cursor_shapes_.erase(it);
+        } else {
+            EncodedFrame shape;
+            shape.is_cursor = true;
+            shape.timestamp = timestamp;
+            cursor_->SerializeShape(shape.data);
+            messages.push_back(std::move(shape));
+            if (sent_cursor_shapes_.size() >= kCursorShapeCache) {
+                sent_cursor_shapes_.pop_front();
+            }
+        }
+        sent_cursor_shapes_.push_back(hash);
     }
     
-    if (d3d_device_) {
-        d3d_device_->Release();
-        d3d_device_ = nullptr;
-    }
-
-    if (dxgi_manager_) {
-        dxgi_manager_->Release();
-        dxgi_manager_ = nullptr;
+    if (resend || frame_info.LastMouseUpdateTime.QuadPart != 0) {
+        // Map desktop coordinates into the encoded picture (region crop +
+        // letterbox), against the region this capture is cropped to
+        POINT position = cursor_->position();
+        int encode_width = 0, encode_height = 0;
+        EncodeSize(&encode_width, &encode_height);
+        PictureMapping mapping(active_region_.right - active_region_.left,
+                               active_region_.bottom - active_region_.top,
+                               encode_width, encode_height);
+        int32_t x = mapping.MapX(position.x - active_region_.left);
+        int32_t y = mapping.MapY(position.y - active_region_.top);
+        
+        EncodedFrame update;
+        update.is_cursor = true;
+        update.timestamp = timestamp;
+        update.data.push_back(1);
+        AppendLE(update.data, static_cast<uint32_t>(x), 4);
+        AppendLE(update.data, static_cast<uint32_t>(y), 4);
+        update.data.push_back(cursor_->visible() ? 1 : 0);
+        AppendLE(update.data, hash, 8);
+        messages.push_back(std::move(update));
     }
     
-    if (pipe_handle_ != INVALID_HANDLE_VALUE) {
-        CloseHandle(pipe_handle_);  // Close pipe
-        pipe_handle_ = INVALID_HANDLE_VALUE;
+    if (!messages.empty()) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        for (auto& message : messages) {
+            frame_queue_.push(std::move(message));
+        }
     }
-    
-    MFShutdown();      // Shutdown Media Foundation
-    CoUninitialize();  // Shutdown COM
-    
-    std::cout << "Capture stopped and cleaned up" << std::endl;
 }
 
-// Main capture loop (runs in separate thread)
-void ScreenCaptureEncoder::CaptureLoop() {
-    std::cout << "Capture loop started" << std::endl;
-    
-    uint64_t frame_count = 0;
+// Move destinations and dirty rects both mark pixels that differ from the
+// previous frame; both are in output coordinates.
+void ScreenCaptureEncoder::CollectDirtyRects(DuplicatedOutput& output, UINT metadata_size) {
+    if (metadata_buffer_.size() < metadata_size) {
+        metadata_buffer_.resize(metadata_size);
+    }
+    LONG offset_x = output.desktop_rect.left - output_origin_.x;
+    LONG offset_y = output.desktop_rect.top - output_origin_.y;
     
-    while (running_) {
-        // Calculate current timestamp
-        auto now = std::chrono::high_resolution_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - start_time_);
-        uint64_t timestamp = elapsed.count();
-        
-        // Capture frame
-        ID3D11Texture2D* acquired_texture = nullptr;
-        DXGI_OUTDUPL_FRAME_INFO frame_info = {};
-        
-        if (CaptureFrame(&acquired_texture, &frame_info)) {
-            // Encode the frame
-            EncodeVideoFrame(acquired_texture, timestamp);
-            
-            // Release the frame back to desktop duplication
-            desktop_duplication_->ReleaseFrame();
-            
-            frame_count++;
-        }
-        
-        // Sleep to maintain target FPS
-        // frame_duration_ is in 100ns units, we need milliseconds
-        uint64_t frame_duration_ms = frame_duration_ / 10000;
-        std::this_thread::sleep_for(std::chrono::milliseconds(frame_duration_ms));
+    UINT used = 0;
+    HRESULT hr = output.duplication->GetFrameMoveRects(
+        metadata_size, reinterpret_cast<DXGI_OUTDUPL_MOVE_RECT*>(metadata_buffer_.data()), &used);
+    if (FAILED(hr)) {
+        frame_rects_full_ = true;
+        return;
+    }
+    const DXGI_OUTDUPL_MOVE_RECT* moves = reinterpret_cast<const DXGI_OUTDUPL_MOVE_RECT*>(metadata_buffer_.data());
+    for (UINT i = 0; i < used / sizeof(DXGI_OUTDUPL_MOVE_RECT); ++i) {
+        DXGI_OUTDUPL_MOVE_RECT move = moves[i];
+        OffsetRect(&move.DestinationRect, offset_x, offset_y);
+        move.SourcePoint.x += offset_x;
+        move.SourcePoint.y += offset_y;
+        frame_move_rects_.push_back(move);
+        frame_dirty_rects_.push_back(move.DestinationRect);
     }
     
-    std::cout << "Capture loop ended. Frames captured: " << frame_count << std::endl;
+    hr = output.duplication->GetFrameDirtyRects(
+        metadata_size, reinterpret_cast<RECT*>(metadata_buffer_.data()), &used);
+    if (FAILED(hr)) {
+        frame_rects_full_ = true;
+        return;
+    }
+    const RECT* dirty = reinterpret_cast<const RECT*>(metadata_buffer_.data());
+    for (UINT i = 0; i < used / sizeof(RECT); ++i) {
+        RECT rect = dirty[i];
+        OffsetRect(&rect, offset_x, offset_y);
+        frame_dirty_rects_.push_back(rect);
+    }
 }
 
-// Pipe writing loop (sends frames to Go process)
-void ScreenCaptureEncoder::PipeWriteLoop() {
-    std::cout << "Pipe write loop started" << std::endl;
-    
-    while (running_) {
-        EncodedFrame frame;
-        bool has_frame = false;
-        
-        // Check queue for frames
-        {
-            std::lock_guard<std::mutex> lock(queue_mutex_);  // Lock mutex
-            if (!frame_queue_.empty()) {
-                frame = frame_queue_.front();  // Copy front frame
-                frame_queue_.pop();             // Remove from queue
-                has_frame = true;
-            }
-        }  // Mutex automatically unlocked when lock_guard goes out of scope
-        
-        if (has_frame) {
-            SendFrameToPipe(frame);
-        } else {
-            // No frames, sleep briefly
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+void ScreenCaptureEncoder::CollectRegionChanges(bool pointer_drawn, std::vector<RECT>& rects) {
+    // Changes outside the capture region do not matter
+    auto add_changed = [&](const RECT& area) {
+        RECT clipped = {};
+        if (IntersectRect(&clipped, &area, &active_region_)) {
+            OffsetRect(&clipped, -active_region_.left, -active_region_.top);
+            rects.push_back(clipped);
         }
+    };
+    for (const RECT& rect : frame_dirty_rects_) {
+        add_changed(rect);
     }
     
-    std::cout << "Pipe write loop ended" << std::endl;
+    // A drawn pointer changes the tile it left and the tile it is on now
+    if (pointer_drawn) {
+        add_changed(last_cursor_rect_);
+        last_cursor_rect_ = cursor_->drawn_rect();
+        add_changed(last_cursor_rect_);
+    }
 }
 
-// Capture one frame from desktop
-bool ScreenCaptureEncoder::CaptureFrame(ID3D11Texture2D** out_texture, DXGI_OUTDUPL_FRAME_INFO* frame_info) {
-    IDXGIResource* desktop_resource = nullptr;
-    
-    // Acquire next frame
-    // This blocks until a new frame is available or timeout occurs
-    HRESULT hr = desktop_duplication_->AcquireNextFrame(
-        100,                // Timeout in milliseconds
-        frame_info,         // OUT: frame info (metadata)
-        &desktop_resource   // OUT: resource containing frame
-    );
+void ScreenCaptureEncoder::RecordSourceFrame(ID3D11Texture2D* texture, const std::vector<RECT>& changes,
+                                             uint64_t timestamp) {
+    recorder_->RecordFrame(d3d_context_, texture, frame_rects_full_, changes, timestamp);
+}
+
+void ScreenCaptureEncoder::DetectMotion(ID3D11Texture2D* texture, const std::vector<RECT>& changes) {
+    auto start = std::chrono::steady_clock::now();
     
-    if (hr == DXGI_ERROR_WAIT_TIMEOUT) {
-        // No new frame available (desktop hasn't changed)
-        return false;
+    // Duplication's own moves, when source and destination are both inside the region
+    std::vector<RECT> described;
+    for (const DXGI_OUTDUPL_MOVE_RECT& move : frame_move_rects_) {
+        RECT source = move.DestinationRect;
+        OffsetRect(&source, move.SourcePoint.x - source.left, move.SourcePoint.y - source.top);
+        RECT inside = {};
+        if (!IntersectRect(&inside, &move.DestinationRect, &active_region_) ||
+            !EqualRect(&inside, &move.DestinationRect) ||
+            !IntersectRect(&inside, &source, &active_region_) || !EqualRect(&inside, &source)) {
+            continue;
+        }
+        DXGI_OUTDUPL_MOVE_RECT region_move = move;
+        OffsetRect(&region_move.DestinationRect, -active_region_.left, -active_region_.top);
+        region_move.SourcePoint.x -= active_region_.left;
+        region_move.SourcePoint.y -= active_region_.top;
+        frame_moves_.push_back(region_move);
+        described.push_back(region_move.DestinationRect);
     }
+    moves_duplication_ += frame_moves_.size();
     
-    if (FAILED(hr)) {
-        std::cerr << "AcquireNextFrame failed: 0x" << std::hex << hr << std::endl;
-        return false;
-    }
+    size_t reported = frame_moves_.size();
+    scroll_detector_->Analyze(d3d_context_, texture, frame_rects_full_, changes, described, frame_moves_);
+    moves_detected_ += frame_moves_.size() - reported;
     
-    // Query for ID3D11Texture2D interface
-    hr = desktop_resource->QueryInterface(__uuidof(ID3D11Texture2D), 
-                                          reinterpret_cast<void**>(out_texture));
-    desktop_resource->Release();  // Release resource
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    motion_time_us_ += elapsed.count();
+    motion_frames_++;
+}
+
+// Motion message payload (little-endian, encoded picture coordinates):
+// [1: type = 1] [4: count] count x [4: src_x] [4: src_y] [4: dst_x] [4: dst_y] [4: width] [4: height]
+// The area now at dst came from src in the previous video frame.
+void ScreenCaptureEncoder::QueueMotionHints(const CapturedFrame& frame) {
+    // Map region coordinates into the encoded picture (scaling + letterbox),
+    // against the size the frame was captured at rather than the current one
+    int encode_width = 0, encode_height = 0;
+    EncodeSize(&encode_width, &encode_height);
+    PictureMapping mapping(frame.source_width, frame.source_height, encode_width, encode_height);
     
-    if (FAILED(hr)) {
-        desktop_duplication_->ReleaseFrame();
-        return false;
+    EncodedFrame message;
+    message.is_motion = true;
+    message.timestamp = frame.timestamp;
+    message.data.push_back(1);
+    AppendLE(message.data, frame.moves.size(), 4);
+    for (const DXGI_OUTDUPL_MOVE_RECT& move : frame.moves) {
+        const RECT& rect = move.DestinationRect;
+        int32_t left = mapping.MapX(rect.left);
+        int32_t top = mapping.MapY(rect.top);
+        AppendLE(message.data, static_cast<uint32_t>(mapping.MapX(move.SourcePoint.x)), 4);
+        AppendLE(message.data, static_cast<uint32_t>(mapping.MapY(move.SourcePoint.y)), 4);
+        AppendLE(message.data, static_cast<uint32_t>(left), 4);
+        AppendLE(message.data, static_cast<uint32_t>(top), 4);
+        AppendLE(message.data, static_cast<uint32_t>(mapping.MapX(rect.right) - left), 4);
+        AppendLE(message.data, static_cast<uint32_t>(mapping.MapY(rect.bottom) - top), 4);
     }
     
-    return true;
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    frame_queue_.push(std::move(message));
+}
+
+void ScreenCaptureEncoder::ReleaseCapturedFrame() {
+    for (auto& output : outputs_) {
+        if (output.holds_frame) {
+            output.duplication->ReleaseFrame();
+            output.holds_frame = false;
+        }
+    }
 }
 
 // Encode captured texture to H.264
@@ -887,6 +5580,15 @@ bool ScreenCaptureEncoder::EncodeVideoFrame(ID3D11Texture2D* texture, uint64_t t
         return false;
     }
 
+    PipelineComponent fault = static_cast<PipelineComponent>(
+        pending_fault_.exchange(static_cast<int>(PipelineComponent::kNone)));
+    if (fault == PipelineComponent::kColorConverter || fault == PipelineComponent::kEncoder) {
+        std::cout << "Injected encode fault" << std::endl;
+        encode_failed_component_ = fault;
+        consecutive_encode_failures_ = 2;  // Next failure triggers recovery
+        return false;
+    }
+
     // Wrap the GPU texture directly in an MF sample (no CPU readback).
     IMFSample* rgb_sample = nullptr;
     HRESULT hr = MFCreateSample(&rgb_sample);
@@ -912,6 +5614,7 @@ bool ScreenCaptureEncoder::EncodeVideoFrame(ID3D11Texture2D* texture, uint64_t t
     rgb_sample->Release();
     if (FAILED(hr)) {
         std::cerr << "Color converter ProcessInput failed: 0x" << std::hex << hr << std::endl;
+        encode_failed_component_ = PipelineComponent::kColorConverter;
         return false;
     }
 
@@ -925,6 +5628,7 @@ bool ScreenCaptureEncoder::EncodeVideoFrame(ID3D11Texture2D* texture, uint64_t t
     // Option A: use FFmpeg's NV12 surfaces as the video processor output target.
     AVFrame* nv12_frame = ffmpeg_encoder_ ? ffmpeg_encoder_->AcquireFrame() : nullptr;
     if (!nv12_frame) {
+        encode_failed_component_ = PipelineComponent::kEncoder;  // Surface pool exhausted or gone
         return false;
     }
 
@@ -971,17 +5675,55 @@ bool ScreenCaptureEncoder::EncodeVideoFrame(ID3D11Texture2D* texture, uint64_t t
             return true;
         }
         std::cerr << "Color converter ProcessOutput failed: 0x" << std::hex << hr << std::endl;
+        encode_failed_component_ = PipelineComponent::kColorConverter;
         return false;
     }
 
     nv12_sample->Release();
 
+    // Encoder sweep keeps what the encoder was given, to score what it produced
+    if (sweep_staging_) {
+        D3D11_BOX box = { 0, 0, 0, static_cast<UINT>(width_), static_cast<UINT>(height_), 1 };
+        d3d_context_->CopySubresourceRegion(sweep_staging_, 0, 0, 0, 0, nv12_texture, nv12_subresource, &box);
+        sweep_copied_ = true;
+    }
+
     std::vector<EncodedFrame> out_frames;
     if (!ffmpeg_encoder_ ||
         !ffmpeg_encoder_->EncodeFrame(nv12_frame, timestamp, out_frames)) {
+        encode_failed_component_ = PipelineComponent::kEncoder;
         return false;
     }
 
+    if (nal_filter_mask_ != 0) {
+        uint64_t removed[32] = {};
+        for (auto& frame : out_frames) {
+            FilterNalUnits(frame.data, nal_filter_mask_, removed);
+        }
+        for (int type = 0; type < 32; ++type) {
+            if (removed[type] != 0) {
+                nal_bytes_stripped_[type] += removed[type];
+            }
+        }
+    }
+    
+    // After the filter, so a stripped SEI type never takes the timing SEI with it
+    if (timing_sei_) {
+        for (auto& frame : out_frames) {
+            InsertBeforeFirstSlice(frame.data, BuildTimingSei(timing_sei_sequence_++,
+                                                              start_monotonic_us_ + frame.timestamp,
+                                                              start_unix_us_ + frame.timestamp));
+        }
+    }
+    
+    for (const auto& frame : out_frames) {
+        frames_since_keyframe_ = frame.is_keyframe ? 0 : frames_since_keyframe_ + 1;
+        if (recorder_) {
+            recorder_->RecordBitstream(frame);
+        }
+    }
+    frames_encoded_ += out_frames.size();
+
     {
         std::lock_guard<std::mutex> lock(queue_mutex_);
         for (auto& frame : out_frames) {
@@ -992,70 +5734,598 @@ bool ScreenCaptureEncoder::EncodeVideoFrame(ID3D11Texture2D* texture, uint64_t t
     return true;
 }
 
+// Offline encoder sweep on the calling thread (no capture/encode/pipe threads)
+bool ScreenCaptureEncoder::RunEncoderSweep(const std::vector<EncoderTuning>& points, int max_frames) {
+    if (!replay_ || !sweep_mode_) {
+        std::cerr << "Encoder sweep needs a replay source and sweep mode" << std::endl;
+        return false;
+    }
+    
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = width_;
+    desc.Height = height_;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_NV12;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    HRESULT hr = d3d_device_->CreateTexture2D(&desc, nullptr, &sweep_staging_);
+    if (FAILED(hr)) {
+        std::cerr << "Failed to create sweep readback texture: 0x" << std::hex << hr << std::dec << std::endl;
+        return false;
+    }
+    
+    std::cout << "Encoder sweep: " << points.size() << " operating points, up to " << max_frames
+              << " frames each at " << width_ << "x" << height_ << ", " << bitrate_ / 1000 << " kbps" << std::endl;
+    // Tab-separated, one row per operating point
+    std::cout << "preset\ttune\trc\tprofile\tgop\tframes\tenc_fps\tcpu_ms\tbits_per_frame"
+                 "\tmax_packet\tpsnr_y\tssim_y\tshed_errors" << std::endl;
+    
+    // With temporal layers, shed_decoders[k - 1] sees the stream with the top k
+    // layers shed, as a backed-up client would; any undecodable access unit or
+    // corrupt picture there means shedding broke decodability
+    H264Decoder decoder;
+    H264Decoder shed_decoders[2];
+    for (const EncoderTuning& point : points) {
+        ReleaseVideoEncoder();
+        tuning_ = point;
+        keyframe_interval_ = point.gop > 0 ? point.gop : fps_ * 2;
+        std::ostringstream row;
+        row << point.preset << "\t" << point.tune << "\t" << point.rc << "\t" << point.profile
+            << "\t" << keyframe_interval_ << "\t";
+        bool opened = InitializeVideoEncoder() && decoder.Initialize();
+        for (int k = 1; opened && k < temporal_layers_; ++k) {
+            opened = shed_decoders[k - 1].Initialize();
+        }
+        if (!opened) {
+            std::cout << row.str() << "failed to open" << std::endl;
+            continue;
+        }
+        replay_->Rewind();
+        
+        // Converted input per timestamp until its picture comes out of the decoder
+        std::unordered_map<int64_t, std::vector<uint8_t>> references;
+        uint64_t encode_us = 0, cpu_us = 0, bytes = 0, packets = 0, largest = 0, shed_errors = 0;
+        double psnr_total = 0.0, ssim_total = 0.0;
+        int scored = 0;
+        
+        for (int i = 0; i < max_frames && !replay_->finished(); ++i) {
+            ID3D11Texture2D* texture = nullptr;
+            DXGI_OUTDUPL_FRAME_INFO frame_info = {};
+            if (!replay_->NextFrame(&texture, &frame_info)) {
+                continue;  // Unchanged frame in the dirty-rect track
+            }
+            uint64_t timestamp = static_cast<uint64_t>(i) * 1000000ULL / fps_;
+            
+            sweep_copied_ = false;
+            uint64_t cpu_start = ProcessCpuTimeUs();
+            auto start = std::chrono::steady_clock::now();
+            bool encoded = EncodeVideoFrame(texture, timestamp);
+            encode_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            cpu_us += ProcessCpuTimeUs() - cpu_start;
+            texture->Release();
+            if (!encoded) {
+                break;
+            }
+            
+            if (sweep_copied_) {
+                D3D11_MAPPED_SUBRESOURCE mapped = {};
+                if (SUCCEEDED(d3d_context_->Map(sweep_staging_, 0, D3D11_MAP_READ, 0, &mapped))) {
+                    std::vector<uint8_t>& luma = references[static_cast<int64_t>(timestamp)];
+                    luma.resize(static_cast<size_t>(width_) * height_);
+                    for (int y = 0; y < height_; ++y) {
+                        memcpy(luma.data() + static_cast<size_t>(y) * width_,
+                               static_cast<const uint8_t*>(mapped.pData) + y * mapped.RowPitch, width_);
+                    }
+                    d3d_context_->Unmap(sweep_staging_, 0);
+                }
+            }
+            
+            std::vector<EncodedFrame> out_frames;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                while (!frame_queue_.empty()) {
+                    out_frames.push_back(std::move(frame_queue_.front()));
+                    frame_queue_.pop();
+                }
+            }
+            for (const EncodedFrame& frame : out_frames) {
+                if (frame.is_audio || frame.is_cursor || frame.is_motion) {
+                    continue;
+                }
+                bytes += frame.data.size();
+                packets++;
+                largest = (std::max)(largest, static_cast<uint64_t>(frame.data.size()));
+                
+                for (int k = 1; k < temporal_layers_; ++k) {
+                    H264Decoder& shed = shed_decoders[k - 1];
+                    if (frame.temporal_layer >= temporal_layers_ - k) {
+                        continue;  // Shed
+                    }
+                    if (!shed.Send(frame.data.data(), frame.data.size(), static_cast<int64_t>(frame.timestamp))) {
+                        shed_errors++;
+                    }
+                    while (const AVFrame* picture = shed.Receive()) {
+                        if ((picture->flags & AV_FRAME_FLAG_CORRUPT) || picture->decode_error_flags) {
+                            shed_errors++;
+                        }
+                    }
+                }
+                
+                decoder.Send(frame.data.data(), frame.data.size(), static_cast<int64_t>(frame.timestamp));
+                while (const AVFrame* picture = decoder.Receive()) {
+                    auto it = references.find(picture->pts);
+                    if (it == references.end() || picture->width != width_ || picture->height != height_) {
+                        continue;
+                    }
+                    uint64_t sse = 0;
+                    for (int y = 0; y < height_; ++y) {
+                        sse += SumSquaredDiff(it->second.data() + static_cast<size_t>(y) * width_,
+                                              picture->data[0] + static_cast<ptrdiff_t>(y) * picture->linesize[0],
+                                              width_);
+                    }
+                    double samples = static_cast<double>(width_) * height_;
+                    psnr_total += sse == 0 ? 100.0 : 10.0 * std::log10(255.0 * 255.0 * samples / sse);
+                    ssim_total += LumaSsim(it->second.data(), width_, picture->data[0], picture->linesize[0],
+                                           width_, height_);
+                    scored++;
+                    references.erase(it);
+                }
+            }
+        }
+        
+        // Frames still inside the encoder's reorder window are left unscored
+        row << packets << "\t" << std::fixed << std::setprecision(1)
+            << (encode_us ? packets * 1000000.0 / encode_us : 0.0) << "\t"
+            << cpu_us / 1000.0 << "\t"
+            << std::setprecision(0) << (packets ? bytes * 8.0 / packets : 0.0) << "\t"
+            << largest << "\t"
+            << std::setprecision(2) << (scored ? psnr_total / scored : 0.0) << "\t"
+            << std::setprecision(4) << (scored ? ssim_total / scored : 0.0) << "\t";
+        if (temporal_layers_ > 1) {
+            row << shed_errors;
+        } else {
+            row << "-";
+        }
+        std::cout << row.str() << std::endl;
+        decoder.Shutdown();
+        for (H264Decoder& shed : shed_decoders) {
+            shed.Shutdown();
+        }
+    }
+    
+    sweep_staging_->Release();
+    sweep_staging_ = nullptr;
+    return true;
+}
+
+// Control pipe loop: one client at a time, one command per line, one response line per command
+void ScreenCaptureEncoder::ControlLoop() {
+    std::wstring control_name = pipe_name_ + L"_control";
+    HANDLE control_pipe = CreateNamedPipeW(
+        control_name.c_str(),
+        PIPE_ACCESS_DUPLEX,                              // Commands in, responses out
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+        1,                                                // Max instances
+        4096,                                             // Output buffer size
+        4096,                                             // Input buffer size
+        0,
+        nullptr
+    );
+    
+    if (control_pipe == INVALID_HANDLE_VALUE) {
+        std::cerr << "Failed to create control pipe. Error: " << GetLastError() << std::endl;
+        return;
+    }
+    std::wcout << L"Control pipe created: " << control_name << std::endl;
+    
+    while (running_) {
+        BOOL connected = ConnectNamedPipe(control_pipe, nullptr);
+        if (!connected && GetLastError() != ERROR_PIPE_CONNECTED) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        
+        std::string pending;
+        char buffer[512];
+        while (running_) {
+            DWORD bytes_read = 0;
+            if (!ReadFile(control_pipe, buffer, sizeof(buffer), &bytes_read, nullptr) || bytes_read == 0) {
+                break;  // Client went away (or Stop() cancelled the read)
+            }
+            pending.append(buffer, bytes_read);
+            
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                if (line.empty()) {
+                    continue;
+                }
+                
+                std::string response = HandleControlCommand(line) + "\n";
+                DWORD bytes_written = 0;
+                WriteFile(control_pipe, response.data(), static_cast<DWORD>(response.size()),
+                          &bytes_written, nullptr);
+            }
+        }
+        
+        DisconnectNamedPipe(control_pipe);
+    }
+    
+    CloseHandle(control_pipe);
+}
+
+// Control protocol (text, one command per line):
+//   stats                          -> counters and current settings
+//   keyframe                       -> force an IDR on the next frame
+//   set bitrate <bits/s>           -> applied in place (NVENC dynamic bitrate)
+//   set fps <n>                    -> reopens the encoder (starts with an IDR)
+//   set keyframe_interval <frames> -> reopens the encoder (starts with an IDR)
+//   set region <x> <y> <w> <h>     -> capture only a desktop rectangle (encoded at the
+//                                     region size with --follow-resolution, else scaled)
+//   set region full                -> capture the whole desktop again
+//   set window <hwnd>              -> follow a window (0 = stop following)
+//   fault <duplication|converter|encoder|device> -> exercise failure recovery
+//   record start <base path> [limit_mb]  -> record frames + bitstream (default 1024 MB)
+//   record stop                    -> flush and close the recording
+// Responses start with "ok" or "error".
+std::string ScreenCaptureEncoder::HandleControlCommand(const std::string& line) {
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
+    
+    if (command == "stats") {
+        StreamSettings settings = CurrentSettings();
+        size_t queue_depth = 0;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            queue_depth = frame_queue_.size();
+        }
+        bool mailbox_full = false;
+        {
+            std::lock_guard<std::mutex> lock(ring_mutex_);
+            mailbox_full = mailbox_frame_ >= 0;
+        }
+        
+        std::ostringstream out;
+        out << "ok"
+            << " connected=" << (client_connected_ ? 1 : 0)
+            << " captured=" << frames_captured_
+            << " encoded=" << frames_encoded_
+            << " sent=" << frames_sent_
+            << " dropped=" << frames_dropped_
+            << " shed=" << frames_shed_
+            << " paced=" << frames_paced_
+            << " pace_us=" << (frames_paced_ ? pace_time_us_ / frames_paced_ : 0)
+            << " largest_write=" << largest_write_
+            << " send_delay_us=" << (send_delay_frames_ ? send_delay_us_ / send_delay_frames_ : 0)
+            << " send_delay_max_us=" << send_delay_max_us_
+            << " bytes=" << bytes_sent_
+            << " queue=" << queue_depth
+            << " mailbox=" << (mailbox_full ? 1 : 0)
+            << " superseded=" << frames_superseded_
+            << " rejoined=" << frames_rejoined_
+            << " repeated=" << frames_repeated_
+            << " join_latency_us=" << join_latency_us_
+            << " composite_us=" << (composite_frames_ ? composite_time_us_ / composite_frames_ : 0)
+            << " acquire_latency_us=" << (acquire_latency_frames_ ? acquire_latency_us_ / acquire_latency_frames_ : 0)
+            << " vblank_phase_us=" << (vblank_phase_frames_ ? vblank_phase_us_ / vblank_phase_frames_ : 0)
+            << " vblank_phase_max_us=" << vblank_phase_max_us_
+            << " moves_duplication=" << moves_duplication_
+            << " moves_detected=" << moves_detected_
+            << " motion_us=" << (motion_frames_ ? motion_time_us_ / motion_frames_ : 0)
+            << " scene_cuts=" << scene_cuts_
+            << " spatial=" << last_spatial_
+            << " temporal=" << last_temporal_
+            << " analysis_us=" << (analysis_frames_ ? analysis_time_us_ / analysis_frames_ : 0)
+            << " rate=" << (idle_fps_ == 0 ? "fixed" : idle_rate_ ? "idle" : "full")
+            << " width=" << settings.width
+            << " height=" << settings.height
+            << " fps=" << settings.fps
+            << " bitrate=" << settings.bitrate
+            << " keyframe_interval=" << settings.keyframe_interval
+            << " layers=" << settings.temporal_layers
+            << " region=" << settings.region.left << "," << settings.region.top << ","
+            << (settings.region.right - settings.region.left) << ","
+            << (settings.region.bottom - settings.region.top);
+        // Bytes removed by the NAL filter, per NAL type
+        for (int type = 0; type < 32; ++type) {
+            if (nal_bytes_stripped_[type] != 0) {
+                out << " stripped_nal" << type << "=" << nal_bytes_stripped_[type];
+            }
+        }
+        if (latency_probe_) {
+            out << " probe_frames=" << latency_probe_->frames()
+                << " probe_latency_us=" << latency_probe_->latency_us()
+                << " probe_latency_avg_us=" << latency_probe_->latency_avg_us()
+                << " probe_latency_max_us=" << latency_probe_->latency_max_us()
+                << " probe_dropped=" << latency_probe_->dropped()
+                << " probe_duplicated=" << latency_probe_->duplicated()
+                << " probe_unreadable=" << latency_probe_->unreadable();
+        }
+        return out.str();
+    }
+    
+    if (command == "keyframe") {
+        force_keyframe_ = true;
+        return "ok";
+    }
+    
+    if (command == "fault") {
+        std::string name;
+        in >> name;
+        if (name == "duplication") {
+            InjectFault(PipelineComponent::kDuplication);
+        } else if (name == "converter") {
+            InjectFault(PipelineComponent::kColorConverter);
+        } else if (name == "encoder") {
+            InjectFault(PipelineComponent::kEncoder);
+        } else if (name == "device") {
+            InjectFault(PipelineComponent::kDevice);
+        } else {
+            return "error unknown component";
+        }
+        return "ok";
+    }
+    
+    if (command == "record") {
+        std::string action;
+        in >> action;
+        if (action == "start") {
+            std::string path;
+            if (!(in >> path)) {
+                return "error usage: record start <base path> [limit_mb] | record stop";
+            }
+            uint64_t limit_mb = 1024;
+            uint64_t value = 0;
+            if (in >> value && value > 0) {
+                if (value > (UINT64_MAX >> 20)) {
+                    return "error limit_mb too large";  // Would wrap when shifted into bytes
+                }
+                limit_mb = value;
+            }
+            StartRecording(std::wstring(path.begin(), path.end()), limit_mb << 20);
+            return "ok";
+        }
+        if (action == "stop") {
+            StopRecording();
+            return "ok";
+        }
+        return "error usage: record start <base path> [limit_mb] | record stop";
+    }
+    
+    if (command != "set") {
+        return "error unknown command";
+    }
+    
+    std::string key;
+    in >> key;
+    
+    StreamSettings change;
+    bool region = false;
+    if (key == "window") {
+        std::string handle;
+        in >> handle;
+        HWND window = reinterpret_cast<HWND>(static_cast<uintptr_t>(std::strtoull(handle.c_str(), nullptr, 0)));
+        if (window && !IsWindow(window)) {
+            return "error no such window";
+        }
+        // Picked up by TrackCaptureWindow on the capture thread
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        pending_window_ = window;
+        has_pending_window_ = true;
+        return "ok";
+    }
+    if (key == "region") {
+        std::string first;
+        in >> first;
+        if (first != "full") {
+            int x = 0, y = 0, w = 0, h = 0;
+            std::istringstream rest(first);
+            if (!(rest >> x) || !(in >> y >> w >> h) || w <= 0 || h <= 0) {
+                return "error usage: set region <x> <y> <w> <h> | full";
+            }
+            change.region = { x, y, x + w, y + h };
+        }
+        region = true;
+    } else {
+        int value = 0;
+        if (!(in >> value) || value <= 0) {
+            return "error expected a positive value";
+        }
+        if (key == "bitrate") {
+            change.bitrate = value;
+        } else if (key == "fps") {
+            change.fps = value;
+        } else if (key == "keyframe_interval" || key == "gop") {
+            change.keyframe_interval = value;
+        } else if (key == "layers") {
+            if (value > 3) {
+                return "error layers must be 1, 2 or 3";
+            }
+            change.temporal_layers = value;
+        } else {
+            return "error unknown setting";
+        }
+    }
+    
+    // Merge with anything not yet applied; the capture thread picks it up at
+    // the next frame boundary
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    if (change.bitrate) pending_control_.bitrate = change.bitrate;
+    if (change.fps) pending_control_.fps = change.fps;
+    if (change.keyframe_interval) pending_control_.keyframe_interval = change.keyframe_interval;
+    if (change.temporal_layers) pending_control_.temporal_layers = change.temporal_layers;
+    if (region) {
+        pending_control_.region = change.region;
+        pending_region_ = true;
+    }
+    has_pending_control_ = true;
+    return "ok";
+}
+
+// Runs on the capture thread between frames; holding pipeline_mutex_ keeps the
+// encode thread out, so the converter and encoder are never touched mid-frame
+// and the session is never dropped
+void ScreenCaptureEncoder::ApplyControlChanges() {
+    StreamSettings change;
+    bool region = false;
+    bool changed = false;
+    bool record_change = false;
+    std::wstring record_path;
+    uint64_t record_limit = 0;
+    {
+        std::lock_guard<std::mutex> lock(control_mutex_);
+        if (has_pending_record_) {
+            record_path = pending_record_path_;
+            record_limit = pending_record_limit_;
+            has_pending_record_ = false;
+            record_change = true;
+        }
+        if (has_pending_window_) {
+            capture_window_ = pending_window_;
+            has_pending_window_ = false;
+            if (!capture_window_) {
+                std::cout << "Control: stopped following window, keeping region" << std::endl;
+            }
+        }
+        if (has_pending_control_) {
+            change = pending_control_;
+            region = pending_region_;
+            pending_control_ = StreamSettings();
+            pending_region_ = false;
+            has_pending_control_ = false;
+            changed = true;
+        }
+    }
+    
+    // Wait for the frame being encoded; later ring frames see the new settings
+    std::unique_lock<std::mutex> pipeline_lock(pipeline_mutex_, std::defer_lock);
+    if (changed || record_change) {
+        pipeline_lock.lock();
+    }
+    
+    bool reopen_encoder = false;
+    bool rebuild_converter = false;
+    if (change.bitrate > 0 && change.bitrate != bitrate_) {
+        bitrate_ = change.bitrate;
+        if (ffmpeg_encoder_) {
+            ffmpeg_encoder_->SetBitrate(bitrate_);
+        }
+    }
+    if (change.fps > 0 && change.fps != fps_) {
+        fps_ = change.fps;
+        frame_duration_ = 10000000ULL / fps_;
+        rebuild_converter = true;  // Its media types carry MF_MT_FRAME_RATE
+        reopen_encoder = true;
+    }
+    if (change.keyframe_interval > 0 && change.keyframe_interval != keyframe_interval_) {
+        keyframe_interval_ = change.keyframe_interval;
+        reopen_encoder = true;
+    }
+    if (change.temporal_layers > 0 && change.temporal_layers != temporal_layers_) {
+        temporal_layers_ = change.temporal_layers;
+        reopen_encoder = true;
+    }
+    if (region) {
+        capture_window_ = nullptr;  // An explicit region replaces window tracking
+        UpdateCaptureRegion(change.region);
+    }
+    
+    if (record_change) {
+        if (recorder_) {
+            recorder_->Shutdown();
+            recorder_.reset();
+        }
+        if (!record_path.empty()) {
+            recorder_ = std::make_unique<CaptureRecorder>();
+            if (recorder_->Open(record_path, record_limit)) {
+                force_keyframe_ = true;  // The bitstream file starts with an IDR
+            } else {
+                recorder_.reset();
+            }
+        }
+    }
+    
+    if (rebuild_converter) {
+        ReleaseColorConverter();
+        if (!InitializeColorConverter()) {
+            encode_failed_component_ = PipelineComponent::kColorConverter;
+        }
+    }
+    if (reopen_encoder) {
+        ReleaseVideoEncoder();
+        if (!InitializeVideoEncoder()) {
+            encode_failed_component_ = PipelineComponent::kEncoder;
+        }
+        frames_since_keyframe_ = 0;
+    }
+    
+    if (changed) {
+        std::cout << "Control: bitrate=" << bitrate_ << " fps=" << fps_
+                  << " keyframe_interval=" << keyframe_interval_
+                  << " layers=" << temporal_layers_ << std::endl;
+    }
+    
+    int encode_width = 0, encode_height = 0;
+    EncodeSize(&encode_width, &encode_height);
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    active_settings_.width = encode_width;
+    active_settings_.height = encode_height;
+    active_settings_.fps = fps_;
+    active_settings_.bitrate = bitrate_;
+    active_settings_.keyframe_interval = keyframe_interval_;
+    active_settings_.temporal_layers = temporal_layers_;
+    active_settings_.region = active_region_;
+}
+
+StreamSettings ScreenCaptureEncoder::CurrentSettings() {
+    std::lock_guard<std::mutex> lock(control_mutex_);
+    return active_settings_;
+}
+
 bool ScreenCaptureEncoder::SendFrameToPipe(const EncodedFrame& frame) {
     // Protocol (little-endian):
     // [4 bytes: size] [8 bytes: timestamp_us] [1 byte: flags] [size bytes: data]
-    // flags bit0 = keyframe, bit1 = audio
+    // flags bit0 = keyframe, bit1 = audio, bit2 = cursor message, bit3 = motion hints,
+    // bits4-5 = temporal layer (0 = base; higher layers can be dropped)
+    // (cursor payloads are described in QueueCursorUpdates, motion in QueueMotionHints)
     
     uint32_t size = static_cast<uint32_t>(frame.data.size());
     uint64_t timestamp_us = frame.timestamp;
     uint8_t flags = 0;
     if (frame.is_keyframe) flags |= 0x01;
     if (frame.is_audio) flags |= 0x02;
-    DWORD bytes_written = 0;
+    if (frame.is_cursor) flags |= 0x04;
+    if (frame.is_motion) flags |= 0x08;
+    flags |= static_cast<uint8_t>((frame.temporal_layer & 0x03) << 4);
     
     // Write size
-    BOOL success = WriteFile(
-        pipe_handle_,                 // Pipe handle
-        &size,                         // Data to write
-        sizeof(size),                  // Bytes to write
-        &bytes_written,                // OUT: bytes written
-        nullptr                        // Not overlapped
-    );
-    
-    if (!success || bytes_written != sizeof(size)) {
+    if (!WritePipe(&size, sizeof(size))) {
         std::cerr << "Failed to write frame size to pipe" << std::endl;
         return false;
     }
 
     // Write timestamp (microseconds)
-    success = WriteFile(
-        pipe_handle_,
-        &timestamp_us,
-        sizeof(timestamp_us),
-        &bytes_written,
-        nullptr
-    );
-
-    if (!success || bytes_written != sizeof(timestamp_us)) {
+    if (!WritePipe(&timestamp_us, sizeof(timestamp_us))) {
         std::cerr << "Failed to write frame timestamp to pipe" << std::endl;
         return false;
     }
 
     // Write flags
-    success = WriteFile(
-        pipe_handle_,
-        &flags,
-        sizeof(flags),
-        &bytes_written,
-        nullptr
-    );
-
-    if (!success || bytes_written != sizeof(flags)) {
+    if (!WritePipe(&flags, sizeof(flags))) {
         std::cerr << "Failed to write frame flags to pipe" << std::endl;
         return false;
     }
     
     // Write data
-    success = WriteFile(
-        pipe_handle_,
-        frame.data.data(),             // Frame data
-        size,                          // Bytes to write
-        &bytes_written,
-        nullptr
-    );
-    
-    if (!success || bytes_written != size) {
+    if (!WriteFramePayload(frame)) {
         std::cerr << "Failed to write frame data to pipe" << std::endl;
         return false;
     }
@@ -1065,3 +6335,79 @@ bool ScreenCaptureEncoder::SendFrameToPipe(const EncodedFrame& frame) {
     
     return true;
 }
+
+// Frame payload onto the pipe; large video frames go through the pacer in
+// kPaceChunkBytes chunks, everything else is written at once
+bool ScreenCaptureEncoder::WriteFramePayload(const EncodedFrame& frame) {
+    const uint8_t* data = frame.data.data();
+    size_t size = frame.data.size();
+    bool video = !frame.is_audio && !frame.is_cursor && !frame.is_motion;
+    
+    if (pace_rate_kbps_ == 0 || !video || size <= kPaceChunkBytes) {
+        if (pace_rate_kbps_ > 0) {
+            // Bypassing traffic still counts against the rate
+            RefillPaceTokens(pace_rate_kbps_ * 125.0);
+            pace_tokens_ = (std::max)(-pace_burst_bytes_, pace_tokens_ - size);
+        }
+        largest_write_ = (std::max)(largest_write_.load(), static_cast<uint64_t>(size));
+        return WritePipe(data, static_cast<DWORD>(size));
+    }
+    
+    // Never slower than one frame interval, so pacing cannot build a backlog
+    int fps = (std::max)(1, CurrentSettings().fps);
+    double rate = (std::max)(pace_rate_kbps_ * 125.0, static_cast<double>(size) * fps);
+    
+    auto start = std::chrono::steady_clock::now();
+    size_t offset = 0;
+    while (offset < size) {
+        size_t chunk = (std::min)(kPaceChunkBytes, size - offset);
+        RefillPaceTokens(rate);
+        if (pace_tokens_ < chunk) {
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                static_cast<int64_t>((chunk - pace_tokens_) * 1000000.0 / rate)));
+            RefillPaceTokens(rate);
+        }
+        pace_tokens_ -= chunk;
+        if (!WritePipe(data + offset, static_cast<DWORD>(chunk))) {
+            return false;
+        }
+        offset += chunk;
+    }
+    largest_write_ = (std::max)(largest_write_.load(), static_cast<uint64_t>(kPaceChunkBytes));
+    frames_paced_++;
+    pace_time_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+// Leaky bucket: add tokens for the time since the last refill, up to the burst size
+void ScreenCaptureEncoder::RefillPaceTokens(double rate) {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - pace_refill_).count();
+    pace_refill_ = now;
+    pace_tokens_ = (std::min)(pace_burst_bytes_, pace_tokens_ + elapsed * rate);
+}
+
+// Write to the pipe; a broken/closed pipe marks the client as gone so the
+// pipe thread goes back to listening instead of failing on every frame
+bool ScreenCaptureEncoder::WritePipe(const void* data, DWORD size) {
+    DWORD bytes_written = 0;
+    BOOL success = WriteFile(
+        pipe_handle_,                 // Pipe handle
+        data,                          // Data to write
+        size,                          // Bytes to write
+        &bytes_written,                // OUT: bytes written
+        nullptr                        // Not overlapped
+    );
+    
+    if (success && bytes_written == size) {
+        return true;
+    }
+    
+    DWORD error = GetLastError();
+    if (!success && (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA ||
+                     error == ERROR_PIPE_NOT_CONNECTED || error == ERROR_OPERATION_ABORTED)) {
+        client_connected_ = false;
+    }
+    return false;
+}
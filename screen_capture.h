@@ -4,6 +4,7 @@
 // Windows headers - must be included in this order to avoid conflicts
 #include <windows.h>          // Core Windows API types and functions
 #include <d3d11.h>            // Direct3D 11 interface for GPU access
+#include <d3d11_4.h>          // ID3D11Multithread (context shared by capture and encode threads)
 #include <dxgi1_2.h>          // DirectX Graphics Infrastructure for desktop duplication
 #include <mfapi.h>            // Media Foundation API for video encoding
 #include <mfidl.h>            // Media Foundation interfaces
@@ -12,6 +13,7 @@
 #include <mferror.h>          // Media Foundation error codese
 #include <mmdeviceapi.h>      // Multimedia device enumeration
 #include <shlwapi.h>          // Shell lightweight utility APIs (for QISearch helper)
+#include <dwmapi.h>           // DWM window bounds (window capture mode)
 
 
 // Standard library
@@ -23,10 +25,19 @@
 #include <thread>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <atomic>
+#include <condition_variable>
+#include <algorithm>
 #include <cstdint>
 
 class FfmpegNvencEncoder;
+class CursorCompositor;
+class ReplaySource;
+class CaptureRecorder;
+class ScrollDetector;
+class FrameAnalyzer;
+class LatencyProbe;
 
 // Link required libraries - tells linker to include these .lib files
 #pragma comment(lib, "d3d11.lib")        // Direct3D 11 library
@@ -38,6 +49,7 @@ class FfmpegNvencEncoder;
 #pragma comment(lib, "wmcodecdspuuid.lib") // H.264 encoder CLSIDs
 #pragma comment(lib, "ole32.lib")        // COM library for object creation
 #pragma comment(lib, "shlwapi.lib")      // Shell utilities (for QISearch)
+#pragma comment(lib, "dwmapi.lib")       // DwmGetWindowAttribute (window capture)
 
 
 // Structure to hold a single encoded frame with timestamp
@@ -46,8 +58,109 @@ struct EncodedFrame {
     uint64_t timestamp;              // Timestamp in microseconds
     bool is_keyframe;                // True if this is an I-frame (keyframe)
     bool is_audio;                   // True for audio, false for video
+    bool is_cursor;                  // Cursor metadata message instead of media
+    bool is_motion;                  // Move-rect hints for the next video frame
+    int temporal_layer;              // 0 = base; higher layers can be dropped and the rest still decodes
     
-    EncodedFrame() : timestamp(0), is_keyframe(false), is_audio(false) {}
+    EncodedFrame() : timestamp(0), is_keyframe(false), is_audio(false), is_cursor(false), is_motion(false),
+                     temporal_layer(0) {}
+};
+
+// Pipeline components that can be re-created independently after a failure
+enum class PipelineComponent {
+    kNone,
+    kDuplication,     // Desktop duplication (mode change, UAC, fullscreen switch)
+    kColorConverter,  // Video processor MFT (RGB32 -> NV12)
+    kEncoder,         // NVENC encoder and its NV12 surface pool
+    kDevice           // D3D11 device removed/reset - every GPU object is rebuilt
+};
+
+// Settings that can be changed at runtime over the control pipe.
+// Zero / empty means "unchanged" when used as a change request.
+struct StreamSettings {
+    int width;                       // Encode width in pixels
+    int height;                      // Encode height in pixels
+    int fps;                         // Target frames per second
+    int bitrate;                     // Target bitrate in bits per second
+    int keyframe_interval;           // Frames between IDRs
+    int temporal_layers;             // 1 (off), 2 (L1T2) or 3 (L1T3)
+    RECT region;                     // Capture region in desktop pixels (empty = full desktop)
+    
+    StreamSettings() : width(0), height(0), fps(0), bitrate(0), keyframe_interval(0), temporal_layers(0),
+                       region() {}
+};
+
+// One duplicated output (monitor)
+struct DuplicatedOutput {
+    IDXGIOutputDuplication* duplication;  // Desktop duplication interface
+    RECT desktop_rect;                    // Output position in virtual desktop coordinates
+    bool holds_frame;                     // AcquireNextFrame succeeded, ReleaseFrame pending
+    bool owns_pointer;                    // Pointer was last reported visible on this output
+    IDXGIOutput* output;                  // The output itself (vblank waits)
+    DXGI_RATIONAL refresh_rate;           // Current mode refresh rate (0/0 if unknown)
+    
+    DuplicatedOutput() : duplication(nullptr), desktop_rect(), holds_frame(false), owns_pointer(false),
+                         output(nullptr), refresh_rate() {}
+};
+
+// Pipeline-owned copy of a captured frame, handed from the capture thread to the encode thread
+struct CapturedFrame {
+    ID3D11Texture2D* texture;             // Owned texture (capture region size and format)
+    uint64_t timestamp;                   // Capture time in microseconds
+    bool active;                          // Enough changed (or the pointer moved) to need full rate
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> moves; // Moved areas since the previous frame (region coordinates)
+    int source_width;                     // Capture region size the frame was taken at
+    int source_height;
+    
+    CapturedFrame() : texture(nullptr), timestamp(0), active(true), source_width(0), source_height(0) {}
+};
+
+// When the capture loop takes a frame
+enum class CaptureTiming {
+    kPoll,        // Acquire (up to 100 ms), then sleep a full frame interval
+    kEvent,       // Wake as soon as the source has a new frame; fps is only a cap
+    kVblank       // Tick on every Nth vblank of the first output (N = refresh / fps)
+};
+
+// How the mouse pointer reaches the client
+enum class CursorMode {
+    kNone,        // Not shown (desktop duplication never includes it in the image)
+    kComposite,   // Drawn into the video frame
+    kMetadata     // Sent out-of-band as cursor messages for client-side drawing
+};
+
+// Pixel layout of a replay file
+enum class ReplayFormat {
+    kY4m,         // YUV4MPEG2 4:2:0 (frame size from the stream header)
+    kBgra,        // Raw BGRA frames, width*height*4 bytes each
+    kNv12,        // Raw NV12 frames, width*height*3/2 bytes each
+    kDump         // Sparse frame dump from the recorder (detected from the file header)
+};
+
+// Play a file instead of duplicating the desktop (reproducible benchmarks)
+struct ReplaySettings {
+    std::wstring path;               // Y4M or raw frame file (memory-mapped)
+    ReplayFormat format;
+    int width;                       // Frame size of raw files (Y4M carries its own)
+    int height;
+    bool unpaced;                    // Deliver frames as fast as the pipeline takes them
+    bool loop;                       // Start over at the end of the file
+    std::wstring dirty_rects_path;   // Optional sidecar dirty-rect track (see ReplaySource)
+    bool stamp_counter;              // Draw the latency probe's frame counter into each frame
+    
+    ReplaySettings() : format(ReplayFormat::kY4m), width(0), height(0), unpaced(false), loop(true),
+                       stamp_counter(false) {}
+};
+
+// NVENC operating point (h264_nvenc option values)
+struct EncoderTuning {
+    std::string preset;              // p1 (fastest) .. p7 (slowest, best quality)
+    std::string tune;                // ll | ull | hq | lossless
+    std::string rc;                  // cbr | vbr | constqp
+    std::string profile;             // baseline | main | high (temporal layers need main or high)
+    int gop;                         // Frames between IDRs (0 = two seconds)
+    
+    EncoderTuning() : preset("p1"), tune("ll"), rc("cbr"), profile("baseline"), gop(0) {}
 };
 
 // Main capture and encoding class
@@ -62,6 +175,12 @@ public:
     // Start capture and encoding threads
     bool Start();
     
+    // Instead of Start: encode up to max_frames of the replay source with each
+    // operating point in turn, decode the result and print a table of encode
+    // fps, CPU time, bits/frame, largest packet and luma PSNR/SSIM against the
+    // converted input. Needs a replay source and SetSweepMode(true).
+    bool RunEncoderSweep(const std::vector<EncoderTuning>& points, int max_frames);
+    
     // Stop all threads and cleanup
     void Stop();
     
@@ -69,9 +188,108 @@ public:
     void CaptureLoop();
     
     
+    // Encode loop (runs in separate thread): converts and encodes frames from the ring
+    void EncodeLoop();
+    
     // Pipe writing loop (runs in separate thread)
     void PipeWriteLoop();
     
+    // Control pipe loop (runs in separate thread)
+    // Line-based text protocol on <pipe_name>_control, see HandleControlCommand
+    void ControlLoop();
+    
+    // Resize policy when the desktop resolution changes mid-stream:
+    // false = keep the configured encode size and scale/letterbox into it,
+    // true  = reopen the encoder at the new desktop size at the next IDR
+    void SetFollowSourceResolution(bool follow);
+    
+    // Capture pacing (default: poll)
+    void SetCaptureTiming(CaptureTiming timing);
+    
+    // Activity-driven rate governor: after a second with only small changes,
+    // encode at most idle_fps frames per second; the first frame with real
+    // activity is encoded at once and restores the full rate (0 = off)
+    void SetIdleFrameRate(int idle_fps);
+    
+    // Estimate each frame's complexity before encoding; scene cuts get an IDR
+    // and a short bitrate boost instead of an IDR landing mid-scene
+    void SetPreAnalysis(bool enabled);
+    
+    // Temporal layers (1 = off, 2 = L1T2, 3 = L1T3): droppable frames are tagged
+    // with their layer and a backed-up client sheds the top layers first.
+    // Motion hints are not sent while layers are on.
+    void SetTemporalLayers(int layers);
+    
+    // Encoder preset, tune, rate control, profile and GOP (default: p1 / ll /
+    // cbr / baseline, IDR every two seconds)
+    void SetEncoderTuning(const EncoderTuning& tuning);
+    
+    // Leaky-bucket pacing on the pipe (0 kbps = off): video frames larger than
+    // a chunk are written in chunks at rate_kbps, allowing burst_kb ahead, but
+    // never slower than one frame interval per frame. Small frames, audio and
+    // metadata are written at once and only draw on the bucket.
+    void SetPacing(int rate_kbps, int burst_kb);
+    
+    // Strip NAL units from every access unit before it is queued: bit n of
+    // drop_mask drops NAL type n (e.g. 9 = AUD, 12 = filler, 6 = SEI).
+    // Slices and parameter sets are always kept.
+    void SetNalFilter(uint32_t drop_mask);
+    
+    // Put a user_data_unregistered SEI with the capture time (monotonic and
+    // Unix) and a sequence number in front of every access unit's slices,
+    // so receivers can compute per-frame end-to-end latency
+    void SetTimingSei(bool enabled);
+    
+    // Closed-loop latency measurement: the replay source draws a frame
+    // counter into its pixels, and everything written to the pipe is decoded
+    // again in-process and the counter read back, giving capture-to-decoded
+    // latency and dropped/duplicated frames (stats probe_*). Needs a replay
+    // source played whole (no region or window).
+    void SetLatencyProbe(bool enabled);
+    
+    // Offline encoder sweep (see RunEncoderSweep): Initialize sets up capture
+    // and encoding only, without the data pipe, a client or the latency probe
+    void SetSweepMode(bool enabled);
+    
+    // Send move rects (duplication's own plus scrolls found by row hashing)
+    // ahead of each video frame, so clients and tools can see scrolled areas
+    void SetMotionHints(bool enabled);
+    
+    // Outputs to capture, as global indices across all adapters (see ListOutputs).
+    // More than one output is composited side by side into one stream.
+    void SetOutputs(const std::vector<UINT>& output_indices);
+    
+    // Print every output of every adapter with its global index
+    static void ListOutputs();
+    
+    // Time NAL length-prefix to Annex B conversion (the old append-based path
+    // vs the current one) on synthetic IDR-sized packets and print the table
+    static void BenchmarkNalRewrite();
+    
+    // Cursor handling (default: composite into the video)
+    void SetCursorMode(CursorMode mode);
+    
+    // Capture only a rectangle of the desktop (desktop pixels, empty = full desktop).
+    // Only the region is copied, converted and encoded.
+    void SetCaptureRegion(const RECT& region);
+    
+    // Capture only the given window, following it as it moves/resizes (nullptr = off)
+    void SetCaptureWindow(HWND window);
+    
+    // Capture from a file instead of the desktop (empty path = desktop).
+    // Outputs, window tracking and the cursor do not apply to replay.
+    void SetReplaySource(const ReplaySettings& settings);
+    
+    // Record converter input frames (<base>.scd, replayable with --replay), the
+    // bitstream (<base>.h264) and its timing (<base>.timing.txt) until
+    // max_bytes have been written. Takes effect at the next frame boundary.
+    void StartRecording(const std::wstring& base_path, uint64_t max_bytes);
+    void StopRecording();
+    
+    // Make the next capture/encode report a failure of the given component
+    // (exercises the recovery path without a real mode change or TDR)
+    void InjectFault(PipelineComponent component);
+    
 private:
     // Direct3D 11 initialization
     bool InitializeD3D11();
@@ -79,9 +297,65 @@ private:
     // Desktop Duplication API initialization
     bool InitializeDuplication();
     
+    // Video processor (RGB32 -> NV12) initialization
+    bool InitializeColorConverter();
+    
     // Video encoder (H.264) initialization
     bool InitializeVideoEncoder();
     
+    // Release individual components (safe to call when already released)
+    void ReleaseD3D11();
+    void ReleaseDuplication();
+    void ReleaseColorConverter();
+    void ReleaseVideoEncoder();
+    
+    // Re-create a failed component, escalating to a full device reset if needed.
+    // Pipe, queue and threads are left running.
+    bool RecoverPipeline(PipelineComponent failed);
+    
+    // Re-create one component (and anything that depends on it)
+    bool ResetComponent(PipelineComponent component);
+    
+    // Desktop or region size changed: re-point the converter at the new source size
+    // (scaling/letterboxing into the current encode size) and, if following
+    // the source, schedule an encoder reopen
+    bool HandleSourceResize(int source_width, int source_height);
+    
+    // Reopen converter output, NV12 pool and encoder at pending_width_ x pending_height_
+    bool ApplyPendingResize();
+    
+    // width_/height_ belong to the encode thread once running; other threads
+    // read this snapshot (both values from the same resize)
+    void PublishEncodeSize();
+    void EncodeSize(int* width, int* height) const;
+    
+    // Letterbox the converter input into the encode size when the aspect ratios differ
+    void ConfigureConverterRects();
+    
+    // Switch to a new capture region; rebuilds the converter if the region size changed.
+    // Caller holds pipeline_mutex_.
+    void UpdateCaptureRegion(const RECT& region);
+    
+    // Follow capture_window_ to its current position (capture thread, once per frame)
+    void TrackCaptureWindow();
+    
+    // capture_window_'s current bounds in captured coordinates (false = closed,
+    // minimized or unreadable; a closed window is forgotten)
+    bool GetCaptureWindowBounds(RECT* bounds);
+    
+    // Copy the capture region out of the desktop image (returns the desktop
+    // texture itself when capturing the full desktop). Caller releases.
+    ID3D11Texture2D* CropToRegion(ID3D11Texture2D* desktop_texture);
+    
+    // Parse one control command and return the response line
+    std::string HandleControlCommand(const std::string& line);
+    
+    // Apply queued control changes (capture thread, between frames)
+    void ApplyControlChanges();
+    
+    // Current settings as seen by the control thread
+    StreamSettings CurrentSettings();
+    
     
     // Named pipe initialization for IPC with Go process
     bool InitializeNamedPipe();
@@ -89,45 +363,250 @@ private:
     // Capture one frame from desktop
     bool CaptureFrame(ID3D11Texture2D** out_texture, DXGI_OUTDUPL_FRAME_INFO* frame_info);
     
+    // Acquire a frame from one output (sets failed_component_ on loss)
+    bool AcquireOutputFrame(DuplicatedOutput& output, UINT timeout_ms,
+                            DXGI_OUTDUPL_FRAME_INFO* frame_info, ID3D11Texture2D** out_texture);
+    
+    // Copy updated outputs into composite_texture_ (multi-output capture)
+    bool CaptureComposite(ID3D11Texture2D** out_texture, DXGI_OUTDUPL_FRAME_INFO* frame_info);
+    
+    // Block until the next vblank capture tick (kVblank)
+    void WaitForCaptureVblank();
+    
+    // Release frames still held by duplication
+    void ReleaseCapturedFrame();
+    
+    // Gather the changed and moved rectangles of a held duplication frame
+    void CollectDirtyRects(DuplicatedOutput& output, UINT metadata_size);
+    
+    // Changed rectangles of the current frame inside the capture region,
+    // including the pointer tiles when the pointer is drawn
+    void CollectRegionChanges(bool pointer_drawn, std::vector<RECT>& rects);
+    
+    // Hand the frame about to be encoded to the recorder with its changed area
+    void RecordSourceFrame(ID3D11Texture2D* texture, const std::vector<RECT>& changes, uint64_t timestamp);
+    
+    // Fill frame_moves_ from duplication's move rects and the scroll detector
+    void DetectMotion(ID3D11Texture2D* texture, const std::vector<RECT>& changes);
+    
+    // Queue the move rects of a frame about to be encoded (encode thread)
+    void QueueMotionHints(const CapturedFrame& frame);
+    
+    // Queue cursor shape/position messages for client-side drawing (kMetadata)
+    void QueueCursorUpdates(const DXGI_OUTDUPL_FRAME_INFO& frame_info, uint64_t timestamp);
+    
+    // Copy a captured texture into a free ring slot and post it to the mailbox
+    // (replacing an unconsumed older frame), so the duplication frame can be
+    // released right away and capture never waits for the encoder
+    bool QueueCapturedFrame(ID3D11Texture2D* texture, uint64_t timestamp, bool active);
+    
+    // Classify the captured frame for the rate governor
+    bool IsActiveFrame(const DXGI_OUTDUPL_FRAME_INFO& frame_info, bool pointer_drawn);
+    
+    // Track activity and switch between full and idle rate (encode thread)
+    void UpdateRateGovernor(bool active);
+    
+    // Run the pre-analysis on a ring frame and act on scene cuts (encode thread)
+    void ApplyPreAnalysis(const CapturedFrame& frame);
+    
+    // Encode one ring frame (encode thread, pipeline_mutex_ held)
+    void ProcessCapturedFrame(const CapturedFrame& frame);
+    
+    // Release the ring textures and drop the mailbox frame (device reset / shutdown)
+    void ReleaseFrameRing();
+    
     // Encode captured texture to H.264
     bool EncodeVideoFrame(ID3D11Texture2D* texture, uint64_t timestamp);
     
     // Send encoded frame through named pipe
     bool SendFrameToPipe(const EncodedFrame& frame);
     
+    // Block until a client connects to the pipe (initial connect and reconnects)
+    bool WaitForClient();
+    
+    // Drop the current client and any frames queued for it
+    void DisconnectClient();
+    
+    // Write a buffer to the pipe, marking the client disconnected on pipe errors
+    bool WritePipe(const void* data, DWORD size);
+    
+    // Write a frame payload, pacing large video frames through the leaky bucket
+    bool WriteFramePayload(const EncodedFrame& frame);
+    
+    // Add the tokens earned since the last refill at rate bytes per second
+    void RefillPaceTokens(double rate);
+    
     // D3D11 objects
     ID3D11Device* d3d_device_;                          // Direct3D 11 device object
     ID3D11DeviceContext* d3d_context_;                  // Device context for commands
-    IDXGIOutputDuplication* desktop_duplication_;       // Desktop duplication interface
+    std::vector<UINT> output_indices_;                  // Requested outputs (global indices)
+    std::vector<DuplicatedOutput> outputs_;             // One duplication per captured output
+    ID3D11Texture2D* composite_texture_;                // All outputs side by side (multi-output only)
     IMFDXGIDeviceManager* dxgi_manager_;               // D3D11 device manager for MF MFTs
     UINT reset_token_;                                  // Token for DXGI device manager
     
     // Media Foundation objects for video encoding
     IMFTransform* color_converter_;                     // RGB32 -> NV12 converter
     std::unique_ptr<FfmpegNvencEncoder> ffmpeg_encoder_; // NVENC encoder via FFmpeg
+    std::unique_ptr<CursorCompositor> cursor_;           // Pointer shape cache + compositing
+    CursorMode cursor_mode_;                             // How the pointer is delivered
+    ReplaySettings replay_settings_;                     // File replay configuration (empty path = desktop)
+    std::unique_ptr<ReplaySource> replay_;               // File source replacing duplication
+    std::unique_ptr<CaptureRecorder> recorder_;          // Session recorder (nullptr = off)
+    std::vector<RECT> frame_dirty_rects_;                // Changed areas of the current frame (captured coordinates)
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> frame_move_rects_; // Duplication moves of the current frame (captured coordinates)
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> frame_moves_;    // Motion hints for the current frame (region coordinates)
+    std::unique_ptr<ScrollDetector> scroll_detector_;    // Row-hash scroll finder (nullptr = hints off)
+    std::unique_ptr<FrameAnalyzer> analyzer_;            // Complexity/scene-cut pre-analysis (nullptr = off)
+    std::chrono::steady_clock::time_point budget_boost_until_; // End of the raised post-cut bitrate (epoch = none; encode thread)
+    bool frame_rects_full_;                              // Whole frame changed (or changes unknown)
+    std::atomic<bool> force_full_frame_;                 // Next captured frame counts as wholly changed
+    std::vector<uint8_t> metadata_buffer_;               // Move/dirty rect metadata from duplication
+    RECT last_cursor_rect_;                              // Pointer tile drawn into the previous frame
+    std::atomic<bool> cursor_resend_;                    // New client: resend shape and position
+    std::deque<uint64_t> sent_cursor_shapes_;            // Shape hashes already sent, least recent first (bounded)
     
        
     // Named pipe for IPC
     HANDLE pipe_handle_;                                // Windows pipe handle
     std::wstring pipe_name_;                            // Pipe name (e.g., \\.\pipe\MyPipe)
+    std::atomic<bool> client_connected_;                // True while a client is attached to the pipe
+    std::atomic<bool> force_keyframe_;                  // Request an IDR on the next encoded frame
+    bool awaiting_keyframe_;                            // Pipe thread drops video until the first keyframe
+    
+    // Failure recovery (recovery itself runs on the capture thread)
+    PipelineComponent failed_component_;                 // Capture-side failure (duplication/device), capture thread only
+    std::atomic<PipelineComponent> encode_failed_component_;  // Converter/encoder failure reported by the encode thread
+    std::atomic<int> consecutive_encode_failures_;       // Encode failures since the last success
+    std::atomic<int> pending_fault_;                     // Injected PipelineComponent, kNone if none
+    
+    // Runtime control
+    std::thread control_thread_;                         // Control pipe thread
+    std::mutex control_mutex_;                           // Protects the two members below
+    StreamSettings pending_control_;                     // Changes waiting for the next frame boundary
+    StreamSettings active_settings_;                     // Snapshot published by the capture thread
+    bool has_pending_control_;                           // pending_control_ holds changes
+    bool pending_region_;                                // pending_control_.region is meant (may be empty)
+    RECT capture_region_;                                // Requested capture region (empty = full desktop)
+    RECT active_region_;                                 // capture_region_ clamped to the desktop
+    HWND capture_window_;                                // Window to follow (nullptr = off)
+    HWND pending_window_;                                // Window change from the control pipe
+    bool has_pending_window_;                            // pending_window_ is set (guarded by control_mutex_)
+    std::wstring pending_record_path_;                   // Recording to start (empty = stop)
+    uint64_t pending_record_limit_;                      // Byte limit for pending_record_path_
+    bool has_pending_record_;                            // Recording change pending (guarded by control_mutex_)
+    POINT output_origin_;                                // Captured area origin in virtual desktop coordinates
+    ID3D11Texture2D* region_texture_;                    // Region-sized copy fed to the converter
+    int bitrate_;                                        // Encoder target bitrate (bits/s)
+    int keyframe_interval_;                              // Encoder GOP length in frames
+    std::atomic<int> temporal_layers_;                   // 1 = off, 2 = L1T2, 3 = L1T3
+    EncoderTuning tuning_;                               // NVENC preset/tune/rc/profile/GOP
+    
+    // Statistics (reported over the control pipe)
+    std::atomic<uint64_t> frames_captured_;              // Frames acquired from duplication
+    std::atomic<uint64_t> frames_encoded_;               // Access units produced by the encoder
+    std::atomic<uint64_t> frames_sent_;                  // Access units written to the pipe
+    std::atomic<uint64_t> frames_dropped_;               // Access units dropped (disconnect / waiting for IDR)
+    std::atomic<uint64_t> frames_shed_;                  // Upper-layer frames dropped for a backed-up client
+    std::atomic<uint64_t> frames_paced_;                 // Frames written through the pacer
+    std::atomic<uint64_t> pace_time_us_;                 // Total time spent writing paced frames
+    std::atomic<uint64_t> largest_write_;                // Largest single pipe write of a payload
+    std::atomic<uint64_t> send_delay_us_;                // Total capture -> pipe write delay of video frames
+    std::atomic<uint64_t> send_delay_max_us_;            // Largest capture -> pipe write delay
+    std::atomic<uint64_t> send_delay_frames_;            // Frames counted in send_delay_us_
+    std::atomic<uint64_t> bytes_sent_;                   // Payload bytes written to the pipe
+    std::atomic<uint64_t> composite_frames_;             // Multi-output frames composited
+    std::atomic<uint64_t> composite_time_us_;            // Total acquire + composite time
+    std::atomic<uint64_t> frames_superseded_;            // Captured frames replaced in the mailbox before encoding
+    std::atomic<uint64_t> frames_rejoined_;              // Held frames re-encoded for a joining client
+    std::atomic<uint64_t> frames_repeated_;              // Held frames re-encoded to drain the layer reorder window
+    std::atomic<uint64_t> join_latency_us_;              // Last client's connect -> first IDR written
+    std::atomic<uint64_t> acquire_latency_us_;           // Total present -> acquire delay of desktop frames
+    std::atomic<uint64_t> acquire_latency_frames_;       // Frames counted in acquire_latency_us_
+    std::atomic<uint64_t> vblank_phase_us_;              // Total vblank -> acquire delay (kVblank)
+    std::atomic<uint64_t> vblank_phase_max_us_;          // Largest vblank -> acquire delay
+    std::atomic<uint64_t> vblank_phase_frames_;          // Frames counted in vblank_phase_us_
+    std::atomic<uint64_t> moves_duplication_;            // Move rects reported by duplication
+    std::atomic<uint64_t> moves_detected_;               // Scrolls found by the scroll detector
+    std::atomic<uint64_t> motion_time_us_;               // Total motion detection time
+    std::atomic<uint64_t> motion_frames_;                // Frames counted in motion_time_us_
+    std::atomic<uint64_t> scene_cuts_;                   // Scene cuts that got an IDR
+    std::atomic<uint64_t> analysis_time_us_;             // Total pre-analysis time
+    std::atomic<uint64_t> analysis_frames_;              // Frames counted in analysis_time_us_
+    std::atomic<double> last_spatial_;                   // Latest spatial complexity (mean |gradient|)
+    std::atomic<double> last_temporal_;                  // Latest temporal complexity (mean |difference|)
+    
+    // Owned frame ring between the capture and encode threads (latest frame wins)
+    std::vector<CapturedFrame> frame_ring_;              // Ring slots (textures created on first use)
+    std::vector<int> free_frames_;                       // Slots available to the capture thread
+    int mailbox_frame_;                                  // Newest frame not yet taken by the encoder (-1 = empty)
+    int held_frame_;                                     // Last encoded frame, re-encoded for a join (-1 = none)
+    bool join_pending_;                                  // A client joined and has no IDR yet
+    int64_t drain_pts_;                                  // Last frame still held back by B-frame layers (-1 = none, encode thread)
+    std::mutex ring_mutex_;                              // Protects free_frames_, mailbox_frame_, held_frame_, join_pending_
+    std::condition_variable ring_cv_;                    // Signals a frame in the mailbox
+    std::mutex pipeline_mutex_;                          // Converter/encoder use vs. reconfiguration and recovery
     
     // Frame queue (thread-safe)
     std::queue<EncodedFrame> frame_queue_;              // Queue of frames to send
     std::mutex queue_mutex_;                            // Protects frame queue
     
     // Configuration
-    int width_;                                          // Capture width in pixels
-    int height_;                                         // Capture height in pixels
+    int width_;                                          // Encode width in pixels
+    int height_;                                         // Encode height in pixels
+    std::atomic<uint64_t> encode_size_;                  // width_ << 32 | height_, read by other threads
+    int source_width_;                                   // Desktop width the converter expects
+    int source_height_;                                  // Desktop height the converter expects
+    int duplication_width_;                              // Captured desktop width (all outputs)
+    int duplication_height_;                             // Captured desktop height (all outputs)
+    int pending_width_;                                  // Encode size to switch to at next IDR (0 = none)
+    int pending_height_;
+    int frames_since_keyframe_;                          // Encoded frames since the last IDR
+    bool follow_source_resolution_;                      // Reopen encoder on desktop resize
+    CaptureTiming capture_timing_;                       // When the capture loop takes frames
+    LARGE_INTEGER last_vblank_qpc_;                      // QPC time of the last capture vblank
+    int idle_fps_;                                       // Governor idle rate (0 = governor off)
+    std::atomic<bool> idle_rate_;                        // Governor is holding the idle rate
+    std::chrono::steady_clock::time_point last_activity_;    // Last active frame (encode thread)
+    std::chrono::steady_clock::time_point next_idle_encode_; // Earliest idle-rate encode (encode thread)
     int fps_;                                            // Target frames per second
     uint64_t frame_duration_;                            // Duration per frame in 100ns units
     
     // Threading
     std::atomic<bool> running_;                          // Atomic flag for thread safety
     std::thread capture_thread_;                         // Video capture thread
+    std::thread encode_thread_;                          // Conversion + encode thread
     std::thread pipe_thread_;                            // Pipe writing thread
     
     // Timing
     std::chrono::high_resolution_clock::time_point start_time_;  // Capture start time
+    std::chrono::steady_clock::time_point join_time_;    // Current client's connect time (pipe thread)
+    
+    // Pipe pacer (writer thread)
+    int pace_rate_kbps_;                                 // Pacing rate (0 = off)
+    double pace_burst_bytes_;                            // Bucket depth
+    double pace_tokens_;                                 // Bytes that may be written now (negative = owed)
+    std::chrono::steady_clock::time_point pace_refill_;  // Last token refill
+    
+    // NAL filter (encode thread)
+    uint32_t nal_filter_mask_;                           // NAL types to drop (bit per type)
+    std::atomic<uint64_t> nal_bytes_stripped_[32];       // Bytes dropped per NAL type
+    
+    // Timing SEI (encode thread)
+    bool timing_sei_;                                    // Insert capture-time SEI
+    uint32_t timing_sei_sequence_;                       // Access units stamped so far
+    uint64_t start_monotonic_us_;                        // QPC time of start_time_, in us
+    uint64_t start_unix_us_;                             // Unix time of start_time_, in us
+    
+    // Latency probe (fed by the pipe thread, decoded on its own thread)
+    bool latency_probe_enabled_;                         // Stamp and read back frame counters
+    std::unique_ptr<LatencyProbe> latency_probe_;        // Decoder in the loop
+    
+    bool sweep_mode_;                                    // Offline encoder sweep: no pipe or client
+    
+    // Encoder sweep: each converted frame is copied here as the quality reference
+    ID3D11Texture2D* sweep_staging_;                     // NV12 readback (nullptr = not sweeping)
+    bool sweep_copied_;                                  // EncodeVideoFrame filled sweep_staging_
 };
 
 #endif // SCREEN_CAPTURE_H